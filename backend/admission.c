@@ -0,0 +1,174 @@
+#include "structures.h"
+
+// --- ADMISSION CONTROL ---
+// submit_transaction puts two checks in front of create_transaction:
+//  - Load shedding. The pending depth (waiting plus time-locked) is held
+//    against a high-water mark. Past half the mark, new work is turned
+//    away from the lowest priority up. At the mark, only MEDICAL urgency
+//    or ELITE tier gets in, and it keeps getting in until twice the mark.
+//    Bounding the backlog bounds how far aged low-priority work can climb,
+//    so it never crowds out the urgent kind. Answered with
+//    ADMIT_OVERLOADED.
+//  - Rate limits. Each customer has a token bucket whose rate grows with
+//    its tier, and each tier can have one bucket shared by all of its
+//    customers. An empty bucket answers ADMIT_RATE_LIMITED.
+// Both say how many seconds to wait before retrying. Work already
+// accepted is never shed. Imports are only held to the mark, and
+// recovery bypasses all of this. Everything here runs under state_lock.
+// Both are off until the server's -q, -l or --tier-rate flag sets them.
+
+#define ADMIT_RATE_LIMITED 7        // Numbered after IMPORT_MALFORMED
+#define ADMIT_OVERLOADED 8
+#define ADMIT_MAX_RETRY 60          // Seconds; longer estimates are capped
+
+typedef struct {
+    double customer_rate;           // Transactions per second for a BASIC customer; 0 = no limit
+    double burst;                   // Bucket size, in seconds of its rate
+    double tier_rate[TIER_CLASSES]; // Per tier, all its customers together; 0 = no limit
+    int high_water;                 // Pending transactions; 0 = never shed
+} AdmissionConfig;
+
+const double admission_tier_scale[TIER_CLASSES] = { 1, 2, 4, 10 };
+AdmissionConfig admission = { 0, 2, { 0, 0, 0, 0 }, 0 };
+
+typedef struct {
+    double tokens;
+    long long updated_us;           // 0: not used yet, so full
+} TokenBucket;
+
+TokenBucket* customer_buckets;      // Slot i belongs to account FIRST_ACCOUNT_NUMBER + i
+int customer_bucket_cap = 0;
+TokenBucket tier_buckets[TIER_CLASSES];
+
+// Settling rate, for estimating when the backlog will be down again
+long long drain_since_us = 0;
+int drain_since_count = 0;
+double drain_rate = 0;
+
+long long admission_clock_us() {
+    return virtual_clock ? virtual_clock * 1000000LL : metrics_clock_us();
+}
+
+TokenBucket* customer_bucket(int acc_no) {
+    int i = acc_no - FIRST_ACCOUNT_NUMBER;
+    if (i >= customer_bucket_cap) {
+        int cap = customer_bucket_cap ? customer_bucket_cap : 1024;
+        while (cap <= i) cap *= 2;
+        customer_buckets = (TokenBucket*)realloc(customer_buckets, sizeof(TokenBucket) * cap);
+        memset(customer_buckets + customer_bucket_cap, 0, sizeof(TokenBucket) * (cap - customer_bucket_cap));
+        customer_bucket_cap = cap;
+    }
+    return &customer_buckets[i];
+}
+
+// Tops the bucket up to `now`; returns the seconds until it holds a whole
+// token, 0 if it already does
+double bucket_wait(TokenBucket* b, double rate, long long now_us) {
+    double size = rate * admission.burst;
+    if (size < 1) size = 1;
+    if (b->updated_us == 0) b->tokens = size;
+    else if (now_us > b->updated_us) b->tokens += rate * (double)(now_us - b->updated_us) / 1e6;
+    if (b->tokens > size) b->tokens = size;
+    b->updated_us = now_us;
+    return b->tokens >= 1 ? 0 : (1 - b->tokens) / rate;
+}
+
+// Pending depth up to which a transaction of this urgency and tier is
+// admitted
+int admission_threshold(int urgency, int tier) {
+    int mark = admission.high_water;
+    if (urgency >= URGENCY_MEDICAL || tier >= TIER_ELITE) return 2 * mark;
+    // Its base priority before risk, as a fraction of the highest
+    double rank = (urgency * 2.0 + tier * 1.5) / (URGENCY_MEDICAL * 2.0 + TIER_ELITE * 1.5);
+    if (rank < 0) rank = 0;
+    return (int)(mark * (0.5 + 0.5 * rank));
+}
+
+// Seconds until `excess` pending transactions have been settled
+double drain_wait(int excess, long long now_us) {
+    int settled = state.processed_count + state.cancelled_count;
+    if (drain_since_us == 0) {
+        drain_since_us = now_us;
+        drain_since_count = settled;
+    } else if (now_us - drain_since_us >= 1000000) {
+        double rate = (settled - drain_since_count) * 1e6 / (double)(now_us - drain_since_us);
+        drain_rate = drain_rate > 0 ? 0.5 * drain_rate + 0.5 * rate : rate;
+        drain_since_us = now_us;
+        drain_since_count = settled;
+    }
+    return drain_rate > 0 ? excess / drain_rate : ADMIT_MAX_RETRY;
+}
+
+int pending_depth() {
+    return state.tx_count - state.finished_count;
+}
+
+// 0 if the transaction may go ahead; otherwise ADMIT_OVERLOADED or
+// ADMIT_RATE_LIMITED, with the seconds to wait in *retry_after. Takes no
+// tokens: admission_charge does once the transaction is accepted, so
+// wrong PINs and bounced requests can't drain a customer's bucket.
+int admission_check(Customer* sender, int urgency, double* retry_after) {
+    long long now = admission_clock_us();
+    *retry_after = 0;
+
+    if (admission.high_water > 0) {
+        int depth = pending_depth(), threshold = admission_threshold(urgency, sender->tier);
+        double wait = drain_wait(depth - threshold + 1, now);
+        if (depth >= threshold) {
+            *retry_after = wait;
+            return ADMIT_OVERLOADED;
+        }
+    }
+
+    int tier = tier_class(sender->tier);
+    double customer_rate = admission.customer_rate * admission_tier_scale[tier];
+    double tier_rate = admission.tier_rate[tier];
+    TokenBucket* own = customer_rate > 0 ? customer_bucket(sender->account_number) : NULL;
+    TokenBucket* shared = tier_rate > 0 ? &tier_buckets[tier] : NULL;
+    double wait_own = own ? bucket_wait(own, customer_rate, now) : 0;
+    double wait_shared = shared ? bucket_wait(shared, tier_rate, now) : 0;
+    if (wait_own > 0 || wait_shared > 0) {
+        *retry_after = wait_own > wait_shared ? wait_own : wait_shared;
+        return ADMIT_RATE_LIMITED;
+    }
+    return 0;
+}
+
+// Takes a token from the buckets admission_check just let the sender
+// through. Still under the same state_lock, so they have been refilled to
+// now and hold at least one.
+void admission_charge(Customer* sender) {
+    int tier = tier_class(sender->tier);
+    if (admission.customer_rate > 0) customer_bucket(sender->account_number)->tokens -= 1;
+    if (admission.tier_rate[tier] > 0) tier_buckets[tier].tokens -= 1;
+}
+
+// create_transaction behind admission control. Besides its result codes,
+// returns ADMIT_RATE_LIMITED or ADMIT_OVERLOADED with *retry_after set.
+int submit_transaction(int sender_id, int receiver_id, int pin, double amount, int urgency_lvl, double* retry_after) {
+    Customer* sender = find_customer(sender_id);
+    *retry_after = 0;
+    if (sender) {
+        int res = admission_check(sender, urgency_lvl, retry_after);
+        if (res != 0) {
+            metric_add(&metrics()->admission_rejected[res == ADMIT_OVERLOADED], 1);
+            return res;
+        }
+    }
+    int res = create_transaction(sender_id, receiver_id, pin, amount, urgency_lvl);
+    if (res == 0) admission_charge(sender);
+    return res;
+}
+
+// Whether the backlog is at the mark, for work that can't be shed by
+// priority (imports)
+bool admission_full(double* retry_after) {
+    *retry_after = 0;
+    if (admission.high_water <= 0) return false;
+    int depth = pending_depth();
+    double wait = drain_wait(depth - admission.high_water + 1, admission_clock_us());
+    if (depth < admission.high_water) return false;
+    *retry_after = wait;
+    metric_add(&metrics()->admission_rejected[1], 1);
+    return true;
+}
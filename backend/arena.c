@@ -0,0 +1,27 @@
+#include "structures.h"
+
+// --- CHUNKED ARENA ---
+// Elements are allocated in fixed-size chunks that are never moved or
+// freed, so a pointer to an element stays valid for the life of the process
+// while the arena keeps growing.
+
+void arena_init(Arena* a, int elem_size) {
+    memset(a->chunks, 0, sizeof(a->chunks));
+    a->elem_size = elem_size;
+    a->count = 0;
+}
+
+void* arena_at(Arena* a, int i) {
+    return a->chunks[i / ARENA_CHUNK_SIZE] + (size_t)(i % ARENA_CHUNK_SIZE) * a->elem_size;
+}
+
+// Returns a zeroed element, or NULL once ARENA_MAX_CHUNKS is reached
+void* arena_alloc(Arena* a) {
+    int chunk = a->count / ARENA_CHUNK_SIZE;
+    if (chunk >= ARENA_MAX_CHUNKS) return NULL;
+    if (!a->chunks[chunk]) {
+        a->chunks[chunk] = (char*)calloc(ARENA_CHUNK_SIZE, a->elem_size);
+        if (!a->chunks[chunk]) return NULL;
+    }
+    return arena_at(a, a->count++);
+}
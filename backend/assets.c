@@ -0,0 +1,163 @@
+#include "structures.h"
+#include <dirent.h>
+
+// --- STATIC FILE CACHE ---
+// The frontend is read into memory once at startup. Every file keeps an
+// ETag and its response headers prebuilt up to the Connection line, so
+// serving it formats nothing. A precompressed sibling (app.js.gz,
+// app.js.br) is served in its place to clients that accept it. Bodies are
+// never copied per request; the server queues a pointer to them (see
+// conn_attach_body). Files that appear after startup are still read from
+// disk on every request.
+
+#define ASSET_DIR "./frontend"
+#define MAX_ASSETS 64
+#define ASSET_MAX_AGE 300 // Names carry no version, so keep this short; ETags make revalidating cheap
+
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BR,
+    ENCODING_COUNT
+} AssetEncoding;
+
+typedef struct {
+    char* body;             // NULL if the variant doesn't exist
+    int length;
+    char etag[32];          // Quoted, as sent
+    char* header;           // 200 response headers, up to the Connection line
+    int header_len;
+    char* not_modified;     // Same for a 304
+    int not_modified_len;
+} AssetVariant;
+
+typedef struct {
+    char path[128];         // URL path
+    AssetVariant variants[ENCODING_COUNT];
+} Asset;
+
+Asset assets[MAX_ASSETS];
+int asset_count = 0;
+
+const char* encoding_suffix[ENCODING_COUNT] = { "", ".gz", ".br" };
+const char* encoding_header[ENCODING_COUNT] = { "", "Content-Encoding: gzip\r\n", "Content-Encoding: br\r\n" };
+
+const char* get_mime_type(const char* path) {
+    const char* ext = strrchr(path, '.');
+    if (!ext) return "text/plain";
+    if (strcmp(ext, ".html") == 0) return "text/html";
+    if (strcmp(ext, ".css") == 0) return "text/css";
+    if (strcmp(ext, ".js") == 0) return "application/javascript";
+    if (strcmp(ext, ".json") == 0) return "application/json";
+    return "text/plain";
+}
+
+// Whole file into a new buffer; NULL if it can't be read
+char* read_whole_file(const char* path, int* len) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = (char*)malloc(size > 0 ? size : 1);
+    *len = (int)fread(data, 1, size, f);
+    fclose(f);
+    return data;
+}
+
+bool load_variant(AssetVariant* v, const char* file, AssetEncoding encoding, const char* mime, bool html) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s%s", file, encoding_suffix[encoding]);
+    v->body = read_whole_file(path, &v->length);
+    if (!v->body) return false;
+
+    // Each encoding is its own representation, so it gets its own tag
+    snprintf(v->etag, sizeof(v->etag), "\"%08x-%x%s\"", fnv1a(v->body, v->length), v->length,
+        encoding == ENCODING_GZIP ? "-gz" : (encoding == ENCODING_BR ? "-br" : ""));
+
+    // The page itself is always revalidated so a deploy shows up at once
+    char cache_control[64];
+    if (html) snprintf(cache_control, sizeof(cache_control), "no-cache");
+    else snprintf(cache_control, sizeof(cache_control), "public, max-age=%d", ASSET_MAX_AGE);
+
+    char header[512];
+    v->header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %d\r\n"
+        "%s"
+        "ETag: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "Vary: Accept-Encoding\r\n",
+        mime, v->length, encoding_header[encoding], v->etag, cache_control);
+    v->header = strdup(header);
+    v->not_modified_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 304 Not Modified\r\n"
+        "ETag: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "Vary: Accept-Encoding\r\n",
+        v->etag, cache_control);
+    v->not_modified = strdup(header);
+    return true;
+}
+
+// Reads every file in `dir` (not subdirectories); .gz and .br files become
+// variants of the file they compress
+void load_assets(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d && strncmp(dir, "./", 2) == 0) d = opendir(dir + 2);
+    if (!d) return;
+
+    struct dirent* e;
+    while ((e = readdir(d)) && asset_count < MAX_ASSETS) {
+        const char* name = e->d_name;
+        const char* ext = strrchr(name, '.');
+        if (name[0] == '.' || (ext && (strcmp(ext, ".gz") == 0 || strcmp(ext, ".br") == 0))) continue;
+        if (strlen(name) + 2 > sizeof(assets[0].path)) continue;
+
+        char file[512];
+        snprintf(file, sizeof(file), "%s/%s", dir, name);
+        Asset* a = &assets[asset_count];
+        memset(a, 0, sizeof(*a));
+        a->path[0] = '/';
+        memcpy(a->path + 1, name, strlen(name) + 1);
+        bool html = strcmp(get_mime_type(name), "text/html") == 0;
+        if (!load_variant(&a->variants[ENCODING_IDENTITY], file, ENCODING_IDENTITY, get_mime_type(name), html)) continue;
+        load_variant(&a->variants[ENCODING_GZIP], file, ENCODING_GZIP, get_mime_type(name), html);
+        load_variant(&a->variants[ENCODING_BR], file, ENCODING_BR, get_mime_type(name), html);
+        asset_count++;
+    }
+    closedir(d);
+}
+
+// Cached file for a URL path ("/" is index.html), ignoring any query
+Asset* find_asset(const char* path) {
+    if (strcmp(path, "/") == 0 || strncmp(path, "/?", 2) == 0) path = "/index.html";
+    int len = (int)strcspn(path, "?");
+    for (int i = 0; i < asset_count; i++) {
+        if (strncmp(assets[i].path, path, len) == 0 && assets[i].path[len] == 0) return &assets[i];
+    }
+    return NULL;
+}
+
+// Smallest variant the client accepts
+AssetVariant* asset_pick(Asset* a, int accept) {
+    if ((accept & ACCEPT_BR) && a->variants[ENCODING_BR].body) return &a->variants[ENCODING_BR];
+    if ((accept & ACCEPT_GZIP) && a->variants[ENCODING_GZIP].body) return &a->variants[ENCODING_GZIP];
+    return &a->variants[ENCODING_IDENTITY];
+}
+
+// The variant whose ETag the client sent in If-None-Match, if any. An
+// encoding it no longer accepts can't match, so it gets a fresh copy.
+AssetVariant* asset_revalidated(Asset* a, const char* if_none_match, int accept) {
+    if (!if_none_match[0]) return NULL;
+    if (strcmp(if_none_match, "*") == 0) return asset_pick(a, accept);
+    for (int e = 0; e < ENCODING_COUNT; e++) {
+        AssetVariant* v = &a->variants[e];
+        if (!v->body) continue;
+        if (e == ENCODING_GZIP && !(accept & ACCEPT_GZIP)) continue;
+        if (e == ENCODING_BR && !(accept & ACCEPT_BR)) continue;
+        if (strstr(if_none_match, v->etag)) return v; // Also finds it in a list or after W/
+    }
+    return NULL;
+}
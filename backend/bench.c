@@ -0,0 +1,2306 @@
+#include "logic.c"
+#include "recovery.c"
+#include "json.c"
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// --- BENCHMARKS ---
+// Build and run from backend/:
+//   gcc -O2 -pthread -o bench bench.c -I. -lm && ./bench [queued] [transfers]
+//
+// Time-lock queue: the timing wheel against the unlock_time min-heap it
+// replaced. Both get the same locks (unlock times spread over
+// TIME_LOCK_DURATION seconds), lose the same 10% to cancellation and are
+// then drained second by second on a simulated clock.
+//
+// Priority queue: the d-ary heap of inlined keys against the binary heap
+// of Transaction pointers with a comparator callback that it replaced,
+// on the same transactions: push all then pop all, a steady state of
+// pop-one-push-one, and cancelling 10% from the middle.
+//
+// Shard scaling: the same queued transfers settled by 1, 2, 4, 8 and 16
+// shard threads, checking that no money is created or lost. Logging is
+// off, so this measures the engine alone.
+//
+// ./bench cancel [queued]: cancelling waiting transfers and force-unlocking
+// time-locked ones, each a sample spread over the queue, at 10^5 and 10^6
+// queued (or the given count): the id index with heap slots and the
+// timing wheel against finding the transaction and then its heap entry by
+// linear scan, as cancel_transaction and force_unlock used to.
+//
+// ./bench aging [waiting]: the cost of a tick of update_system_state at
+// 10^4, 10^5 and 10^6 waiting transfers (or the given count): the full
+// pass that rewrote every effective priority and rebuilt the heap,
+// against the time-invariant priority_key, where a tick only advances the
+// timing wheel and effective priority is computed when reported.
+//
+// ./bench accounts [customers]: logins (lookup and PIN check) and
+// transfers through create_transaction at 1M accounts by default, with
+// find_customer's direct index against the walk over every customer it
+// replaced (timed on a sample, and for transfers added to the rest of
+// create_transaction as the two lookups it made).
+//
+// ./bench wal [records] [threads]: write-ahead log ingest, 1M records by
+// default from 8 writer threads (transfers, every fourth one cancelled),
+// with fsync off, with group commit (each writer waiting for its records
+// to be durable, as responses do) and with an fsync per record (capped at
+// WAL_ALWAYS_RECORDS); then recover_state on what group commit wrote, in
+// ms per million records. Runs in a scratch directory under the current one.
+//
+// ./bench stress: submitters, an admin thread (cancel, unlock, process,
+// release) and shard threads all racing for a few seconds while a reader
+// checks that published balances always add up. Build it with
+// -fsanitize=thread to have data races reported:
+//   gcc -O1 -g -fsanitize=thread -pthread -o bench bench.c -I. -lm && ./bench stress
+//
+// ./bench sim [key=value ...]: a synthetic workload replayed on a virtual
+// clock (see bench_sim), reporting create/cancel/update/process
+// throughput, queue-wait percentiles by urgency and tier, and memory.
+// Keys: customers, seconds, rate, capacity, lock, cancel, shards, seed,
+// urgency=normal/emi/medical and tier=basic/premium/vip/elite (percent),
+// mark and customer_rate (admission control, off by default),
+// e.g. ./bench sim rate=5000 capacity=4500 lock=0.1 urgency=50/30/20
+//
+// ./bench overload [seconds]: simulations at 0.9x and 10x capacity, with
+// and without admission control, comparing p99 queue wait of MEDICAL,
+// ELITE and NORMAL transactions and how much was turned away.
+//
+// ./bench json: request-body parse throughput, json_parse against the
+// strstr/atoi scanning it replaced.
+//
+// ./bench fuzz [iterations]: random valid bodies must parse to the values
+// they were built from; mutated ones (flipped, inserted, deleted and
+// truncated bytes) must be rejected or parse the same way twice, and are
+// parsed from exactly-sized buffers. Build it with
+// -fsanitize=address,undefined to catch reads past the end:
+//   gcc -O1 -g -fsanitize=address,undefined -pthread -o bench bench.c -I. -lm && ./bench fuzz
+//
+// ./bench http [path] [connections] [seconds] [header]: static-file (or
+// any GET) requests per second against a server already running on
+// port 5000, e.g. ./bench http /app.js 4 5 "Accept-Encoding: gzip" or
+// with "If-None-Match: <etag>" to measure revalidation.
+//
+// ./bench api [connections] [seconds] [stalled] [close]: requests per
+// second and p50/p99 latency of teller traffic (transfers, and every
+// tenth request a page of /api/state) against a server on port 5000
+// started with -l 0, each connection with one request in flight.
+// `stalled` more clients connect and never send anything. With "close"
+// each request takes a new connection, which the blocking accept loop the
+// event loop replaced also answers, so the same run measures before and
+// after: build the server from the baseline commit and compare, e.g.
+//   ./bench api 32 5 0 close; ./bench api 32 5 4 close
+//
+// ./bench replicas [path] [connections] [seconds] [writes_per_second]:
+// read throughput (default /api/state?limit=100) against the primary on
+// port 5000 alone, then spread over it and replicas on 5001, then on
+// 5001-5004, while a writer posts transfers to the primary. Reports the
+// largest replica lag seen. Start the servers first, e.g.
+//   ./server -w 2 -r 1000 --replicate 6000 &
+//   for p in 5001 5002 5003 5004; do ./server -w 2 -p $p --replica-of 127.0.0.1:6000 & done
+//
+// ./bench metrics [per_thread]: cost of recording into a histogram from
+// several threads at once, per-thread blocks against one shared
+// histogram, a check of the merged counts and quantiles, and of samples
+// that fall exactly on an exported bucket bound.
+//
+// ./bench risk [transactions]: risk scoring on one core, feature gathering
+// and scoring in batches of one (create_transaction) and of RISK_BATCH
+// (imports), and the scoring kernel alone, SSE2 against one at a time.
+//
+// ./bench history [rows]: appending finished transactions to the history
+// store, aggregates over all of it (chunk totals, a full scan with SSE2
+// and one row at a time, time buckets) and account history pages.
+//
+// ./bench archive [rows]: the history archive (segment.c) at 50M rows by
+// default, in a scratch directory under the current one: append and
+// archiving speed, bytes per row on disk, resident memory against what
+// the same rows take in memory, p50/p99 of a create-and-settle before
+// and after, and aggregates, account pages and lookups by id with the
+// archive evicted from memory and again warm. Queries race the archiver
+// while it works; build with -fsanitize=thread to check the swaps.
+
+double bench_ms() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// xorshift64, so both queues see identical input
+unsigned long long bench_seed = 88172645463325252ULL;
+unsigned long long bench_rand() {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+Transaction* bench_locks(int n, long long start) {
+    Transaction* txs = (Transaction*)calloc(n, sizeof(Transaction));
+    bench_seed = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        txs[i].id = i;
+        txs[i].unlock_time = start + 1 + (long long)(bench_rand() % TIME_LOCK_DURATION);
+        txs[i].heap_index = -1;
+    }
+    return txs;
+}
+
+int bench_released;
+void bench_release(Transaction* t) {
+    (void)t;
+    bench_released++;
+}
+
+void bench_report(const char* name, int n, int cancelled, double insert_ms, double cancel_ms, double drain_ms) {
+    printf("%-12s insert %7.1f ns  cancel %7.1f ns  release %7.1f ns  total %8.1f ms\n", name,
+        insert_ms * 1e6 / n, cancel_ms * 1e6 / cancelled, drain_ms * 1e6 / (n - cancelled),
+        insert_ms + cancel_ms + drain_ms);
+}
+
+void bench_time_locks(int n) {
+    long long start = 1700000000;
+    int cancelled = n / 10;
+    printf("Time-lock queue, %d pending locks, %d cancelled\n", n, cancelled);
+
+    // Min-heap on unlock_time
+    Transaction* txs = bench_locks(n, start);
+    Heap* h = create_heap(1024);
+    double t0 = bench_ms();
+    for (int i = 0; i < n; i++) heap_push_keyed(h, &txs[i], -(double)txs[i].unlock_time, 0);
+    double t1 = bench_ms();
+    for (int i = 0; i < n; i += 10) heap_remove(h, &txs[i]);
+    double t2 = bench_ms();
+    bench_released = 0;
+    for (long long now = start; now <= start + TIME_LOCK_DURATION; now++) {
+        while (h->size > 0 && heap_peek(h)->unlock_time <= now) bench_release(heap_pop(h));
+    }
+    double t3 = bench_ms();
+    if (bench_released != n - cancelled) printf("heap released %d\n", bench_released);
+    bench_report("heap", n, cancelled, t1 - t0, t2 - t1, t3 - t2);
+    free(h->data);
+    free(h);
+    free(txs);
+
+    // Timing wheel
+    txs = bench_locks(n, start);
+    TimingWheel* w = (TimingWheel*)malloc(sizeof(TimingWheel));
+    wheel_init(w, start);
+    t0 = bench_ms();
+    for (int i = 0; i < n; i++) wheel_insert(w, &txs[i]);
+    t1 = bench_ms();
+    for (int i = 0; i < n; i += 10) wheel_remove(w, &txs[i]);
+    t2 = bench_ms();
+    bench_released = 0;
+    for (long long now = start; now <= start + TIME_LOCK_DURATION; now++) {
+        wheel_advance(w, now, bench_release);
+    }
+    t3 = bench_ms();
+    if (bench_released != n - cancelled) printf("wheel released %d\n", bench_released);
+    bench_report("timing wheel", n, cancelled, t1 - t0, t2 - t1, t3 - t2);
+    free(w);
+    free(txs);
+}
+
+// The binary heap the priority queue used before, kept as the baseline
+typedef struct {
+    Transaction** data;
+    int size;
+    int capacity;
+    int (*compare)(const void* a, const void* b);
+} RefHeap;
+
+int ref_compare_priority(const void* a, const void* b) {
+    Transaction* t1 = *(Transaction**)a;
+    Transaction* t2 = *(Transaction**)b;
+    if (t1->priority_key > t2->priority_key) return 1;
+    if (t1->priority_key < t2->priority_key) return -1;
+    if (t1->arrival_time < t2->arrival_time) return 1;
+    return 0;
+}
+
+void ref_swap(RefHeap* h, int i, int j) {
+    Transaction* temp = h->data[i];
+    h->data[i] = h->data[j];
+    h->data[j] = temp;
+    h->data[i]->heap_index = i;
+    h->data[j]->heap_index = j;
+}
+
+void ref_up(RefHeap* h, int index) {
+    int parent = (index - 1) / 2;
+    if (index > 0 && h->compare(&h->data[index], &h->data[parent]) > 0) {
+        ref_swap(h, index, parent);
+        ref_up(h, parent);
+    }
+}
+
+void ref_down(RefHeap* h, int index) {
+    int left = 2 * index + 1;
+    int right = 2 * index + 2;
+    int largest = index;
+    if (left < h->size && h->compare(&h->data[left], &h->data[largest]) > 0) largest = left;
+    if (right < h->size && h->compare(&h->data[right], &h->data[largest]) > 0) largest = right;
+    if (largest != index) {
+        ref_swap(h, index, largest);
+        ref_down(h, largest);
+    }
+}
+
+void ref_push(RefHeap* h, Transaction* t) {
+    if (h->size == h->capacity) {
+        h->capacity *= 2;
+        h->data = (Transaction**)realloc(h->data, sizeof(Transaction*) * h->capacity);
+    }
+    h->data[h->size] = t;
+    t->heap_index = h->size;
+    ref_up(h, h->size);
+    h->size++;
+}
+
+Transaction* ref_pop(RefHeap* h) {
+    if (h->size == 0) return NULL;
+    Transaction* root = h->data[0];
+    h->data[0] = h->data[h->size - 1];
+    h->data[0]->heap_index = 0;
+    h->size--;
+    ref_down(h, 0);
+    root->heap_index = -1;
+    return root;
+}
+
+void ref_remove(RefHeap* h, Transaction* t) {
+    int i = t->heap_index;
+    if (i < 0 || i >= h->size || h->data[i] != t) return;
+    h->data[i] = h->data[h->size - 1];
+    h->data[i]->heap_index = i;
+    h->size--;
+    t->heap_index = -1;
+    if (i < h->size) {
+        ref_down(h, i);
+        ref_up(h, i);
+    }
+}
+
+// Waiting transfers as create_transaction would queue them, arriving over
+// ten minutes, so equal keys (and the arrival tie-break) do occur
+Transaction* bench_waiting(int n) {
+    Transaction* txs = (Transaction*)calloc(n, sizeof(Transaction));
+    bench_seed = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        txs[i].id = i;
+        txs[i].urgency = (UrgencyLevel)((bench_rand() % 3) * 50);
+        txs[i].tier = (CustomerTier)((bench_rand() % 4) * 20);
+        txs[i].arrival_time = 1700000000 + (time_t)(bench_rand() % 600);
+        txs[i].base_priority = calculate_base_priority(&txs[i]);
+        txs[i].priority_key = txs[i].base_priority - (double)txs[i].arrival_time * AGING_FACTOR;
+        txs[i].heap_index = -1;
+    }
+    return txs;
+}
+
+// Order fingerprint of what came out, which must match between the two
+double bench_fold(double acc, Transaction* t) {
+    return acc * 0.999 + t->priority_key + (double)t->arrival_time * 1e-9;
+}
+
+void bench_heaps(int n) {
+    int held = n / 10;
+    printf("\nPriority queue, %d transactions\n", n);
+    Transaction* txs = bench_waiting(n);
+
+    RefHeap* r = (RefHeap*)malloc(sizeof(RefHeap));
+    r->size = 0;
+    r->capacity = 1024;
+    r->compare = ref_compare_priority;
+    r->data = (Transaction**)malloc(sizeof(Transaction*) * r->capacity);
+    double ref_check = 0, check = 0;
+
+    double t0 = bench_ms();
+    for (int i = 0; i < n; i++) ref_push(r, &txs[i]);
+    double t1 = bench_ms();
+    while (r->size > 0) ref_check = bench_fold(ref_check, ref_pop(r));
+    double t2 = bench_ms();
+    for (int i = 0; i < held; i++) ref_push(r, &txs[i]);
+    double t3 = bench_ms();
+    for (int i = held; i < n; i++) {
+        ref_check = bench_fold(ref_check, ref_pop(r));
+        ref_push(r, &txs[i]);
+    }
+    double t4 = bench_ms();
+    for (int i = 0; i < n; i += 10) ref_remove(r, &txs[i]);
+    double t5 = bench_ms();
+    printf("%-12s push %6.1f ns  pop %6.1f ns  pop+push at %d %6.1f ns  remove %6.1f ns\n", "binary heap",
+        (t1 - t0) * 1e6 / n, (t2 - t1) * 1e6 / n, held, (t4 - t3) * 1e6 / (n - held), (t5 - t4) * 1e6 / (n / 10));
+    free(r->data);
+    free(r);
+
+    Heap* h = create_heap(1024);
+    t0 = bench_ms();
+    for (int i = 0; i < n; i++) heap_push(h, &txs[i]);
+    t1 = bench_ms();
+    while (h->size > 0) check = bench_fold(check, heap_pop(h));
+    t2 = bench_ms();
+    for (int i = 0; i < held; i++) heap_push(h, &txs[i]);
+    t3 = bench_ms();
+    for (int i = held; i < n; i++) {
+        check = bench_fold(check, heap_pop(h));
+        heap_push(h, &txs[i]);
+    }
+    t4 = bench_ms();
+    for (int i = 0; i < n; i += 10) heap_remove(h, &txs[i]);
+    t5 = bench_ms();
+    printf("%d-ary heap   push %6.1f ns  pop %6.1f ns  pop+push at %d %6.1f ns  remove %6.1f ns\n", HEAP_ARITY,
+        (t1 - t0) * 1e6 / n, (t2 - t1) * 1e6 / n, held, (t4 - t3) * 1e6 / (n - held), (t5 - t4) * 1e6 / (n / 10));
+    if (check != ref_check) printf("%d-ary heap popped in a different order\n", HEAP_ARITY);
+    free(h->data);
+    free(h);
+    free(txs);
+}
+
+// Cancel and force-unlock as they were before the indexes: the
+// transaction found by scanning all of them, its slot by scanning the heap
+#define CANCEL_SAMPLE 2000
+
+int ref_compare_unlock(const void* a, const void* b) {
+    Transaction* t1 = *(Transaction**)a;
+    Transaction* t2 = *(Transaction**)b;
+    if (t1->unlock_time < t2->unlock_time) return 1;
+    if (t1->unlock_time > t2->unlock_time) return -1;
+    return 0;
+}
+
+RefHeap* ref_create(int (*compare)(const void*, const void*)) {
+    RefHeap* h = (RefHeap*)malloc(sizeof(RefHeap));
+    h->size = 0;
+    h->capacity = 1024;
+    h->compare = compare;
+    h->data = (Transaction**)malloc(sizeof(Transaction*) * h->capacity);
+    return h;
+}
+
+Transaction* ref_find(Transaction* all, int count, int id) {
+    for (int i = 0; i < count; i++) {
+        if (all[i].id == id) return &all[i];
+    }
+    return NULL;
+}
+
+void ref_remove_id(RefHeap* h, int id) {
+    int i;
+    for (i = 0; i < h->size; i++) {
+        if (h->data[i]->id == id) break;
+    }
+    if (i < h->size) ref_remove(h, h->data[i]);
+}
+
+// Every tenth transaction is time-locked, the rest wait
+Transaction* bench_queued(int n, long long start) {
+    Transaction* txs = bench_waiting(n);
+    for (int i = 5; i < n; i += 10) txs[i].unlock_time = start + 1 + (long long)(bench_rand() % TIME_LOCK_DURATION);
+    return txs;
+}
+
+void bench_cancel(int n) {
+    long long start = 1700000000;
+    int step = n / CANCEL_SAMPLE / 10 * 10;
+    if (step < 10) step = 10;
+    int sample = n / step;
+    printf("\nCancel and unlock, %d queued (%d time-locked), %d of each spread over the queue\n", n, n / 10, sample);
+
+    // Linear scans
+    Transaction* txs = bench_queued(n, start);
+    RefHeap* waiting = ref_create(ref_compare_priority);
+    RefHeap* locked = ref_create(ref_compare_unlock);
+    for (int i = 0; i < n; i++) ref_push(i % 10 == 5 ? locked : waiting, &txs[i]);
+    double t0 = bench_ms();
+    for (int k = 0; k < sample; k++) {
+        Transaction* t = ref_find(txs, n, k * step + 1);
+        if (t) ref_remove_id(waiting, t->id);
+    }
+    double t1 = bench_ms();
+    for (int k = 0; k < sample; k++) {
+        Transaction* t = ref_find(txs, n, k * step + 5);
+        if (!t) continue;
+        ref_remove_id(locked, t->id);
+        ref_push(waiting, t);
+    }
+    double t2 = bench_ms();
+    printf("%-14s cancel %10.1f ns  unlock %10.1f ns\n", "linear scans", (t1 - t0) * 1e6 / sample, (t2 - t1) * 1e6 / sample);
+    double ref_check = 0;
+    int ref_left = waiting->size + locked->size;
+    while (waiting->size > 0) ref_check = bench_fold(ref_check, ref_pop(waiting));
+    free(waiting->data);
+    free(waiting);
+    free(locked->data);
+    free(locked);
+    free(txs);
+
+    // Id index, heap slots and the timing wheel
+    txs = bench_queued(n, start);
+    tx_index_init(&state.tx_index, 1024);
+    Heap* h = create_heap(1024);
+    TimingWheel* w = (TimingWheel*)malloc(sizeof(TimingWheel));
+    wheel_init(w, start);
+    for (int i = 0; i < n; i++) {
+        tx_index_insert(&state.tx_index, &txs[i]);
+        if (i % 10 == 5) wheel_insert(w, &txs[i]);
+        else heap_push(h, &txs[i]);
+    }
+    t0 = bench_ms();
+    for (int k = 0; k < sample; k++) {
+        Transaction* t = find_transaction(k * step + 1);
+        if (t) heap_remove(h, t);
+    }
+    t1 = bench_ms();
+    for (int k = 0; k < sample; k++) {
+        Transaction* t = find_transaction(k * step + 5);
+        if (!t) continue;
+        wheel_remove(w, t);
+        heap_push(h, t);
+    }
+    t2 = bench_ms();
+    printf("%-14s cancel %10.1f ns  unlock %10.1f ns\n", "indexed", (t1 - t0) * 1e6 / sample, (t2 - t1) * 1e6 / sample);
+    double check = 0;
+    int left = h->size + (n / 10 - sample);
+    while (h->size > 0) check = bench_fold(check, heap_pop(h));
+    if (check != ref_check || left != ref_left) printf("indexed queues ended up different\n");
+    free(h->data);
+    free(h);
+    free(w);
+    free(state.tx_index.slots);
+    free(txs);
+}
+
+// The tick as it was: every waiting transaction's effective priority
+// rewritten, then the whole heap rebuilt. The binary heap orders on
+// priority_key, which stands in for effective_priority here.
+void ref_aging_pass(RefHeap* h, time_t now) {
+    for (int i = 0; i < h->size; i++) {
+        Transaction* t = h->data[i];
+        t->priority_key = t->base_priority + difftime(now, t->arrival_time) * AGING_FACTOR;
+    }
+    for (int i = h->size / 2 - 1; i >= 0; i--) ref_down(h, i);
+}
+
+#define AGING_TICKS 20
+
+void bench_aging(int n) {
+    long long start = 1700000600; // After every arrival in bench_waiting
+    printf("\nAging tick, %d waiting, %d time-locked, %d ticks of a second\n", n, n / 10, AGING_TICKS);
+
+    Transaction* txs = bench_waiting(n);
+    RefHeap* r = ref_create(ref_compare_priority);
+    for (int i = 0; i < n; i++) ref_push(r, &txs[i]);
+    double t0 = bench_ms();
+    for (int tick = 1; tick <= AGING_TICKS; tick++) ref_aging_pass(r, (time_t)(start + tick));
+    double ref_us = (bench_ms() - t0) * 1e3 / AGING_TICKS;
+    int ref_top = r->data[0]->id;
+    free(r->data);
+    free(r);
+    free(txs);
+
+    // Now a tick only releases due locks; none of these are due yet, so
+    // it is the wheel's bookkeeping alone
+    txs = bench_waiting(n);
+    Transaction* locks = bench_locks(n / 10, start + 60);
+    Heap* h = create_heap(1024);
+    for (int i = 0; i < n; i++) heap_push(h, &txs[i]);
+    TimingWheel* w = (TimingWheel*)malloc(sizeof(TimingWheel));
+    wheel_init(w, start);
+    for (int i = 0; i < n / 10; i++) wheel_insert(w, &locks[i]);
+    bench_released = 0;
+    t0 = bench_ms();
+    for (int tick = 1; tick <= AGING_TICKS; tick++) wheel_advance(w, start + tick, bench_release);
+    double us = (bench_ms() - t0) * 1e3 / AGING_TICKS;
+    // Effective priority is worked out when reported, as for /api/state
+    t0 = bench_ms();
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += txs[i].priority_key + (double)(start + AGING_TICKS) * AGING_FACTOR;
+    double report_ns = (bench_ms() - t0) * 1e6 / n;
+
+    printf("%-22s %12.1f us per tick\n", "full aging pass", ref_us);
+    printf("%-22s %12.3f us per tick, %.1f ns per effective priority reported\n", "time-invariant key", us, report_ns);
+    if (heap_peek(h)->id != ref_top || bench_released != 0 || sum == 0) printf("time-invariant key put a different transaction first\n");
+    free(h->data);
+    free(h);
+    free(w);
+    free(locks);
+    free(txs);
+}
+
+// find_customer as it was: a walk over every customer
+Customer* ref_find_customer(int acc_no) {
+    for (int i = 0; i < state.customers.count; i++) {
+        Customer* c = (Customer*)arena_at(&state.customers, i);
+        if (c->account_number == acc_no) return c;
+    }
+    return NULL;
+}
+
+#define ACCOUNTS_SAMPLE 1000
+
+int bench_accounts(int accounts) {
+    if (accounts < 2) accounts = 2;
+    printf("Accounts, %d customers; linear lookups timed on %d operations\n", accounts, ACCOUNTS_SAMPLE);
+    init_state();
+    double t0 = bench_ms();
+    for (int i = 0; i < accounts; i++) create_customer("bench", 1000 + i % 9000, (i % 4) * 20, 1e9);
+    printf("%-14s %12.0f accounts/s\n", "create", accounts / ((bench_ms() - t0) / 1000.0));
+
+    // Logins as handle_login does them: look up, compare the PIN
+    int ops = accounts > 1000000 ? accounts : 1000000, ok = 0, ref_ok = 0;
+    bench_seed = 88172645463325252ULL;
+    t0 = bench_ms();
+    for (int i = 0; i < ops; i++) {
+        int acc = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+        Customer* c = find_customer(acc);
+        ok += c && c->pin == 1000 + (acc - FIRST_ACCOUNT_NUMBER) % 9000;
+    }
+    double login = ops / ((bench_ms() - t0) / 1000.0);
+    bench_seed = 88172645463325252ULL;
+    t0 = bench_ms();
+    for (int i = 0; i < ACCOUNTS_SAMPLE; i++) {
+        int acc = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+        Customer* c = ref_find_customer(acc);
+        ref_ok += c && c->pin == 1000 + (acc - FIRST_ACCOUNT_NUMBER) % 9000;
+    }
+    double ref_login = ACCOUNTS_SAMPLE / ((bench_ms() - t0) / 1000.0);
+
+    // Transfers through create_transaction. The old lookups are added as
+    // the two walks it made for sender and receiver.
+    bench_seed = 88172645463325252ULL;
+    t0 = bench_ms();
+    int created = 0;
+    for (int i = 0; i < ACCOUNTS_SAMPLE; i++) {
+        int from = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+        int to = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+        if (!ref_find_customer(from) || !ref_find_customer(to)) continue;
+        created += create_transaction(from, to, 1000 + (from - FIRST_ACCOUNT_NUMBER) % 9000, 1, 0) == 0;
+    }
+    double ref_transfer = ACCOUNTS_SAMPLE / ((bench_ms() - t0) / 1000.0);
+    t0 = bench_ms();
+    for (int i = 0; i < ops; i++) {
+        int from = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+        int to = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+        created += create_transaction(from, to, 1000 + (from - FIRST_ACCOUNT_NUMBER) % 9000, 1, 0) == 0;
+    }
+    double transfer = ops / ((bench_ms() - t0) / 1000.0);
+
+    printf("%-14s %12.0f logins/s     %12.0f transfers/s\n", "linear scan", ref_login, ref_transfer);
+    printf("%-14s %12.0f logins/s     %12.0f transfers/s\n", "direct index", login, transfer);
+    if (ok != ops || ref_ok != ACCOUNTS_SAMPLE || created != ops + ACCOUNTS_SAMPLE) {
+        printf("lookups went wrong: %d of %d logins, %d of %d transfers\n", ok + ref_ok, ops + ACCOUNTS_SAMPLE, created,
+            ops + ACCOUNTS_SAMPLE);
+        return 1;
+    }
+    return 0;
+}
+
+// Write-ahead log: each phase runs in a child process, since the log and
+// its flusher thread are process-wide and are never torn down
+#define WAL_BENCH_DIR "bench_wal.tmp"
+#define WAL_ALWAYS_RECORDS 20000    // An fsync each; more would take minutes
+
+typedef struct {
+    int id;
+    int records;
+    bool wait;                      // For fsync before the next, as responses do
+} WalWriter;
+
+// Transfers between two accounts of its own, every fourth one cancelled
+void* wal_writer(void* arg) {
+    WalWriter* w = (WalWriter*)arg;
+    int a = FIRST_ACCOUNT_NUMBER + 2 * w->id;
+    for (int i = 0; i < w->records; i++) {
+        pthread_mutex_lock(&state_lock);
+        if (i % 4 == 3) cancel_transaction(id_counter - 1);
+        else create_transaction(a + i % 2, a + (i + 1) % 2, 1, 1, (i % 3) * 50);
+        long long lsn = wal_lsn();
+        pthread_mutex_unlock(&state_lock);
+        if (w->wait) wal_wait_durable(lsn);
+    }
+    return NULL;
+}
+
+void wal_bench_clean() {
+    remove(WAL_BENCH_DIR "/bank.wal");
+    remove(WAL_BENCH_DIR "/bank.snap");
+    remove(WAL_BENCH_DIR "/bank.snap.tmp");
+    rmdir(WAL_BENCH_DIR);
+}
+
+// Child: logs `records` events from `threads` writers in `mode`
+void wal_bench_write(WalSyncMode mode, int records, int threads) {
+    init_state();
+    wal_init(WAL_BENCH_DIR, mode); // Starts from an empty directory, nothing to recover
+    if (!wal_start()) exit(1);
+    for (int i = 0; i < 2 * threads; i++) {
+        pthread_mutex_lock(&state_lock);
+        create_customer("bench", 1, 0, 1e12);
+        pthread_mutex_unlock(&state_lock);
+    }
+
+    pthread_t ids[64];
+    WalWriter writers[64];
+    double t0 = bench_ms();
+    for (int i = 0; i < threads; i++) {
+        writers[i].id = i;
+        writers[i].records = records / threads;
+        writers[i].wait = mode == WAL_SYNC_GROUP;
+        pthread_create(&ids[i], NULL, wal_writer, &writers[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    // Everything written out, whatever the mode
+    pthread_mutex_lock(&wal.lock);
+    while (wal.durable_lsn < wal.appended_lsn) pthread_cond_wait(&wal.flushed, &wal.lock);
+    pthread_mutex_unlock(&wal.lock);
+    double ms = bench_ms() - t0;
+
+    static const char* names[] = { "group", "always", "off" };
+    printf("%-8s %9d records %12.0f records/s\n", names[mode], records / threads * threads, records / threads * threads / (ms / 1000.0));
+}
+
+// Child: recovers what the last write phase left
+void wal_bench_recover(int records) {
+    init_state();
+    wal_init(WAL_BENCH_DIR, WAL_SYNC_OFF);
+    double t0 = bench_ms();
+    recover_state();
+    double ms = bench_ms() - t0;
+    printf("recover_state after %d records: %.1f ms, %.1f ms per million\n", records, ms, ms * 1e6 / records);
+}
+
+int wal_bench_child(void (*phase)(WalSyncMode, int, int), WalSyncMode mode, int records, int threads) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (phase) phase(mode, records, threads);
+        else wal_bench_recover(records);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int bench_wal(int records, int threads) {
+    if (threads < 1) threads = 1;
+    if (threads > 64) threads = 64;
+    printf("Write-ahead log in %s/, %d writer threads; a snapshot every %d records\n", WAL_BENCH_DIR, threads, WAL_SNAPSHOT_EVERY);
+    int rc = 0;
+    const WalSyncMode modes[] = { WAL_SYNC_OFF, WAL_SYNC_GROUP, WAL_SYNC_ALWAYS };
+    for (int m = 0; m < 3; m++) {
+        int n = modes[m] == WAL_SYNC_ALWAYS && records > WAL_ALWAYS_RECORDS ? WAL_ALWAYS_RECORDS : records;
+        wal_bench_clean();
+        rc |= wal_bench_child(wal_bench_write, modes[m], n, threads);
+        // Recovery is the same work whichever mode wrote the log
+        if (modes[m] == WAL_SYNC_GROUP) rc |= wal_bench_child(NULL, modes[m], n, threads);
+    }
+    wal_bench_clean();
+    return rc;
+}
+
+void* bench_shard_thread(void* arg) {
+    Shard* s = (Shard*)arg;
+    BatchSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    while (shard_process(s, SHARD_BATCH, false, &summary) > 0) {}
+    return NULL;
+}
+
+void bench_shards(int transfers) {
+    int accounts = 4096;
+    double opening = 1e9;
+    init_state();
+    for (int i = 0; i < accounts; i++) create_customer("bench", 1, (i % 4) * 20, opening);
+    printf("\nShard scaling, %d transfers between %d accounts (%ld cores online)\n", transfers, accounts,
+        sysconf(_SC_NPROCESSORS_ONLN));
+
+    int counts[] = { 1, 2, 4, 8, 16 };
+    double base_rate = 0;
+    for (int k = 0; k < 5; k++) {
+        int shards = counts[k];
+        init_shards(shards);
+        bench_seed = 88172645463325252ULL;
+        for (int i = 0; i < transfers; i++) {
+            int from = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+            int to = FIRST_ACCOUNT_NUMBER + (int)(bench_rand() % accounts);
+            create_transaction(from, to, 1, 1 + (double)(bench_rand() % 500), (int)(bench_rand() % 3) * 50);
+        }
+
+        pthread_t threads[MAX_SHARDS];
+        double t0 = bench_ms();
+        for (int i = 0; i < shards; i++) pthread_create(&threads[i], NULL, bench_shard_thread, &state.shards[i]);
+        for (int i = 0; i < shards; i++) pthread_join(threads[i], NULL);
+        double ms = bench_ms() - t0;
+
+        // Credits still in an inbox count towards `available`
+        double published = 0, spendable = 0;
+        for (int i = 0; i < accounts; i++) {
+            Customer* c = customer_at(FIRST_ACCOUNT_NUMBER + i);
+            published += c->balance;
+            spendable += c->available;
+        }
+        for (int i = 0; i < shards; i++) {
+            Shard* s = &state.shards[i];
+            for (int j = 0; j < s->inbox_len; j++) {
+                spendable += s->inbox[j].amount;
+                customer_at(s->inbox[j].account)->available += s->inbox[j].amount;
+            }
+            s->inbox_len = 0;
+        }
+        double expected = opening * accounts;
+        double rate = transfers / (ms / 1000.0);
+        if (k == 0) base_rate = rate;
+        printf("%2d shard(s) %10.0f transfers/s  %5.2fx  %s\n", shards, rate, rate / base_rate,
+            (fabs(published - expected) < 1e-3 && fabs(spendable - expected) < 1e-3) ? "balanced" : "MONEY NOT CONSERVED");
+    }
+}
+
+#define STRESS_ACCOUNTS 256
+#define STRESS_OPENING 10000.0
+#define STRESS_SUBMITTERS 4
+
+int stress_running = 1;     // Submitters and admin
+int stress_submitting = STRESS_SUBMITTERS;
+int stress_violations = 0;
+
+unsigned long long stress_rand(unsigned long long* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+void* stress_submitter(void* arg) {
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL * (unsigned long long)((long)arg + 1);
+    while (__atomic_load_n(&stress_running, __ATOMIC_RELAXED)) {
+        int from = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % STRESS_ACCOUNTS);
+        int to = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % STRESS_ACCOUNTS);
+        // Some go over the time-lock threshold and wait in the wheel
+        double amount = (stress_rand(&seed) % 20 == 0) ? TIME_LOCK_THRESHOLD : 1 + (double)(stress_rand(&seed) % 3000);
+        pthread_mutex_lock(&state_lock);
+        create_transaction(from, to, 1, amount, (int)(stress_rand(&seed) % 3) * 50);
+        pthread_mutex_unlock(&state_lock);
+    }
+    __atomic_sub_fetch(&stress_submitting, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+void* stress_admin(void* arg) {
+    (void)arg;
+    unsigned long long seed = 12345;
+    BatchSummary summary;
+    while (__atomic_load_n(&stress_running, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&state_lock);
+        int span = id_counter - 1000;
+        if (span > 0) {
+            cancel_transaction(1000 + (int)(stress_rand(&seed) % span));
+            force_unlock(1000 + (int)(stress_rand(&seed) % span));
+        }
+        process_next_transaction();
+        process_batch(32, 0, &summary);
+        update_system_state();
+        pthread_mutex_unlock(&state_lock);
+    }
+    return NULL;
+}
+
+void* stress_shard(void* arg) {
+    Shard* s = (Shard*)arg;
+    BatchSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    while (1) {
+        if (shard_process(s, SHARD_BATCH, false, &summary) > 0) continue;
+        if (__atomic_load_n(&stress_submitting, __ATOMIC_SEQ_CST) == 0) break;
+        sleep_ms(1);
+    }
+    return NULL;
+}
+
+// Published balances move a whole transfer at a time under state_lock,
+// so any reader holding it must see the opening total. It also scrapes
+// the metrics while they are being recorded, and queries the history
+// while it is being appended to.
+void* stress_reader(void* arg) {
+    (void)arg;
+    long long finished = 0;
+    while (__atomic_load_n(&stress_submitting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&state_lock);
+        double total = 0;
+        for (int i = 0; i < STRESS_ACCOUNTS; i++) {
+            Customer* c = find_customer(FIRST_ACCOUNT_NUMBER + i);
+            total += c->balance;
+            if (c->balance < 0) stress_violations++;
+        }
+        if (fabs(total - STRESS_OPENING * STRESS_ACCOUNTS) > 1e-3) stress_violations++;
+        pthread_mutex_unlock(&state_lock);
+
+        // Scrapes race the shard threads recording into their blocks
+        MetricsText mt = { NULL, 0, 0 };
+        metrics_render(&mt);
+        free(mt.buf);
+
+        // The history only grows
+        HistoryGroup by_status[2];
+        history_aggregate(HISTORY_BY_STATUS, 0, UINT_MAX, 1, by_status);
+        if (by_status[0].count + by_status[1].count < finished) stress_violations++;
+        finished = by_status[0].count + by_status[1].count;
+        HistoryRow page[20];
+        int sent, received;
+        if (history_heads(FIRST_ACCOUNT_NUMBER, &sent, &received)) history_page(FIRST_ACCOUNT_NUMBER, &sent, &received, 20, page);
+        sleep_ms(1);
+    }
+    return NULL;
+}
+
+int bench_stress(int seconds) {
+    init_state();
+    init_shards(4);
+    for (int i = 0; i < STRESS_ACCOUNTS; i++) create_customer("stress", 1, (i % 4) * 20, STRESS_OPENING);
+    printf("Stress: %d submitters, admin, reader and %d shard threads for %d s\n",
+        STRESS_SUBMITTERS, state.shard_count, seconds);
+
+    pthread_t threads[STRESS_SUBMITTERS + 2 + MAX_SHARDS];
+    int n = 0;
+    for (long i = 0; i < STRESS_SUBMITTERS; i++) pthread_create(&threads[n++], NULL, stress_submitter, (void*)i);
+    pthread_create(&threads[n++], NULL, stress_admin, NULL);
+    pthread_create(&threads[n++], NULL, stress_reader, NULL);
+    for (int i = 0; i < state.shard_count; i++) pthread_create(&threads[n++], NULL, stress_shard, &state.shards[i]);
+
+    sleep_ms(seconds * 1000);
+    __atomic_store_n(&stress_running, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) pthread_join(threads[i], NULL);
+
+    double published = 0, spendable = 0;
+    for (int i = 0; i < state.shard_count; i++) {
+        Shard* s = &state.shards[i];
+        for (int j = 0; j < s->inbox_len; j++) spendable += s->inbox[j].amount;
+    }
+    for (int i = 0; i < STRESS_ACCOUNTS; i++) {
+        Customer* c = customer_at(FIRST_ACCOUNT_NUMBER + i);
+        published += c->balance;
+        spendable += c->available;
+        if (c->available < 0) stress_violations++;
+    }
+    double expected = STRESS_OPENING * STRESS_ACCOUNTS;
+    if (fabs(published - expected) > 1e-3 || fabs(spendable - expected) > 1e-3) stress_violations++;
+
+    printf("%d transactions, %d settled, %d cancelled, %d still waiting or locked: %s\n",
+        id_counter - 1000, state.processed_count, state.cancelled_count,
+        waiting_count() + state.time_locks.count, stress_violations ? "MONEY NOT CONSERVED" : "balanced");
+    return stress_violations ? 1 : 0;
+}
+
+// Workload of one simulation run; every field can be set as key=value
+typedef struct {
+    int customers;
+    int seconds;        // Virtual seconds to simulate
+    int rate;           // Transactions submitted per virtual second
+    int capacity;       // Transactions processed per virtual second
+    double lock;        // Fraction large enough to be time-locked
+    double cancel;      // Cancel requests per submitted transaction
+    int urgency[3];     // Mix of normal/EMI/medical, in percent
+    int tier[4];        // Mix of basic/premium/VIP/elite customers, in percent
+    int shards;
+    unsigned long long seed;
+    int high_water;     // Admission control's mark; 0 submits without it
+    double customer_rate; // Admission rate for a BASIC customer; 0 = no limit
+} SimConfig;
+
+// What bench_overload compares between runs
+typedef struct {
+    long long submitted, created, shed, limited;
+    unsigned long long p99_medical, p99_elite, p99_normal; // Virtual seconds of queue wait
+} SimResult;
+
+// Index into a percentage mix
+int sim_pick(const int* mix, int n, unsigned long long r) {
+    int roll = (int)(r % 100), acc = 0;
+    for (int i = 0; i < n - 1; i++) {
+        acc += mix[i];
+        if (roll < acc) return i;
+    }
+    return n - 1;
+}
+
+bool sim_option(SimConfig* c, const char* arg) {
+    const char* eq = strchr(arg, '=');
+    if (!eq) return false;
+    int key_len = (int)(eq - arg);
+    const char* v = eq + 1;
+#define SIM_KEY(k) (key_len == (int)strlen(k) && strncmp(arg, k, key_len) == 0)
+    if (SIM_KEY("customers")) c->customers = atoi(v);
+    else if (SIM_KEY("seconds")) c->seconds = atoi(v);
+    else if (SIM_KEY("rate")) c->rate = atoi(v);
+    else if (SIM_KEY("capacity")) c->capacity = atoi(v);
+    else if (SIM_KEY("lock")) c->lock = atof(v);
+    else if (SIM_KEY("cancel")) c->cancel = atof(v);
+    else if (SIM_KEY("shards")) c->shards = atoi(v);
+    else if (SIM_KEY("seed")) c->seed = strtoull(v, NULL, 10);
+    else if (SIM_KEY("mark")) c->high_water = atoi(v);
+    else if (SIM_KEY("customer_rate")) c->customer_rate = atof(v);
+    else if (SIM_KEY("urgency")) return sscanf(v, "%d/%d/%d", &c->urgency[0], &c->urgency[1], &c->urgency[2]) == 3;
+    else if (SIM_KEY("tier")) return sscanf(v, "%d/%d/%d/%d", &c->tier[0], &c->tier[1], &c->tier[2], &c->tier[3]) == 4;
+    else return false;
+#undef SIM_KEY
+    return true;
+}
+
+void sim_print_waits(const char* label, Histogram* h) {
+    if (h->count == 0) return;
+    printf("  %-8s %9llu %7.0f %7.0f %7.0f %7.0f\n", label, h->count, hist_quantile(h, 0.5) / 1e6,
+        hist_quantile(h, 0.9) / 1e6, hist_quantile(h, 0.99) / 1e6, hist_quantile(h, 1.0) / 1e6);
+}
+
+// Replays a synthetic workload on a virtual clock: each simulated second
+// submits `rate` transactions, sends cancel requests, runs the time-lock
+// pass and processes up to `capacity`. The same config and seed always give
+// the same run, so its checksum line can be compared between builds; only
+// the timings differ. With a mark or customer rate, submissions go through
+// admission control. Fills `result` if given.
+int bench_sim(SimConfig* c, SimResult* result) {
+    printf("Simulation: %d customers, %d s at %d tx/s, capacity %d/s, %.0f%% locked, %.0f%% cancelled, "
+        "urgency %d/%d/%d, tier %d/%d/%d/%d, %d shard(s), seed %llu\n",
+        c->customers, c->seconds, c->rate, c->capacity, c->lock * 100, c->cancel * 100,
+        c->urgency[0], c->urgency[1], c->urgency[2], c->tier[0], c->tier[1], c->tier[2], c->tier[3], c->shards, c->seed);
+    bool admitting = c->high_water > 0 || c->customer_rate > 0;
+    if (admitting) printf("Admission control: mark %d pending, %.0f tx/s per basic customer\n", c->high_water, c->customer_rate);
+
+    virtual_clock = 1700000000;
+    init_state();
+    AdmissionConfig saved = admission;
+    admission.high_water = c->high_water;
+    admission.customer_rate = c->customer_rate;
+    free(customer_buckets);
+    customer_buckets = NULL;
+    customer_bucket_cap = 0;
+    drain_since_us = 0;
+    drain_rate = 0;
+    init_shards(c->shards);
+    unsigned long long seed = c->seed ? c->seed : 1;
+    static const int tiers[4] = { TIER_BASIC, TIER_PREMIUM, TIER_VIP, TIER_ELITE };
+    for (int i = 0; i < c->customers; i++) {
+        create_customer("sim", 1, tiers[sim_pick(c->tier, 4, stress_rand(&seed))], 1e12);
+    }
+    MetricsBlock* m = metrics();
+    memset(m->queue_wait, 0, sizeof(m->queue_wait));
+
+    double create_ms = 0, cancel_ms = 0, update_ms = 0, process_ms = 0;
+    long long created = 0, cancel_requests = 0, processed = 0, shed = 0, limited = 0;
+    int first_id = id_counter;
+    for (int sec = 0; sec < c->seconds; sec++) {
+        pthread_mutex_lock(&state_lock);
+        double t0 = bench_ms();
+        for (int i = 0; i < c->rate; i++) {
+            int from = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % c->customers);
+            int to = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % c->customers);
+            bool locked = (stress_rand(&seed) % 10000) < (unsigned long long)(c->lock * 10000);
+            double amount = locked ? TIME_LOCK_THRESHOLD + (double)(stress_rand(&seed) % 5000)
+                                   : 1 + (double)(stress_rand(&seed) % 5000);
+            int urgency = sim_pick(c->urgency, 3, stress_rand(&seed)) * 50;
+            int res;
+            if (admitting) {
+                double retry_after;
+                res = submit_transaction(from, to, 1, amount, urgency, &retry_after);
+                if (res == ADMIT_OVERLOADED) shed++;
+                if (res == ADMIT_RATE_LIMITED) limited++;
+            } else {
+                res = create_transaction(from, to, 1, amount, urgency);
+            }
+            if (res == 0) created++;
+        }
+
+        // Aimed at the last minute of submissions, mostly still pending
+        double t1 = bench_ms();
+        int requests = (int)(c->rate * c->cancel);
+        if ((stress_rand(&seed) % 1000) < (unsigned long long)((c->rate * c->cancel - requests) * 1000)) requests++;
+        int recent = c->rate * 60, newest = id_counter;
+        for (int i = 0; i < requests && newest > first_id; i++) {
+            int span = newest - first_id < recent ? newest - first_id : recent;
+            cancel_transaction(newest - 1 - (int)(stress_rand(&seed) % span));
+            cancel_requests++;
+        }
+
+        double t2 = bench_ms();
+        virtual_clock++;
+        update_system_state();
+
+        double t3 = bench_ms();
+        BatchSummary s;
+        process_batch(c->capacity, 0, &s);
+        processed += s.processed;
+        double t4 = bench_ms();
+        pthread_mutex_unlock(&state_lock);
+
+        create_ms += t1 - t0;
+        cancel_ms += t2 - t1;
+        update_ms += t3 - t2;
+        process_ms += t4 - t3;
+    }
+
+    printf("%-10s %10lld ops %12.0f ops/s\n", "create", created, created / (create_ms / 1000.0));
+    if (admitting) printf("%-10s %10lld shed, %lld rate limited\n", "rejected", shed, limited);
+    printf("%-10s %10lld ops %12.0f ops/s\n", "cancel", cancel_requests, cancel_requests / (cancel_ms / 1000.0));
+    printf("%-10s %10d ops %12.0f ops/s\n", "update", c->seconds, c->seconds / (update_ms / 1000.0));
+    printf("%-10s %10lld ops %12.0f ops/s\n", "process", processed, processed / (process_ms / 1000.0));
+
+    // Virtual seconds from arrival to settlement, time locks included
+    printf("Queue wait (virtual s)   count     p50     p90     p99     max\n");
+    Histogram by_urgency[3], by_tier[4];
+    memset(by_urgency, 0, sizeof(by_urgency));
+    memset(by_tier, 0, sizeof(by_tier));
+    for (int u = 0; u < URGENCY_CLASSES; u++) {
+        for (int t = 0; t < TIER_CLASSES; t++) {
+            hist_merge(&by_urgency[u], &m->queue_wait[u][t]);
+            hist_merge(&by_tier[t], &m->queue_wait[u][t]);
+        }
+    }
+    for (int u = 0; u < URGENCY_CLASSES; u++) sim_print_waits(urgency_names[u], &by_urgency[u]);
+    for (int t = 0; t < TIER_CLASSES; t++) sim_print_waits(tier_names[t], &by_tier[t]);
+
+    long long heap_bytes = 0;
+    for (int i = 0; i < state.shard_count; i++) heap_bytes += (long long)state.shards[i].queue->capacity * sizeof(HeapEntry);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Memory: %d transaction slots (%.1f MB), heaps %.1f MB, index %.1f MB, peak RSS %.1f MB\n",
+        state.transactions.count, state.transactions.count * (double)sizeof(Transaction) / 1048576,
+        heap_bytes / 1048576.0, state.tx_index.capacity * (double)sizeof(Transaction*) / 1048576,
+        usage.ru_maxrss / 1024.0);
+    printf("Checksum: processed %d, cancelled %d, waiting %d, locked %d, wait sum %.0f\n",
+        state.processed_count, state.cancelled_count, waiting_count(), state.time_locks.count, state.total_wait_time);
+    virtual_clock = 0;
+    admission = saved;
+    if (result) {
+        result->submitted = (long long)c->rate * c->seconds;
+        result->created = created;
+        result->shed = shed;
+        result->limited = limited;
+        result->p99_medical = hist_quantile(&by_urgency[2], 0.99) / 1000000;
+        result->p99_elite = hist_quantile(&by_tier[3], 0.99) / 1000000;
+        result->p99_normal = hist_quantile(&by_urgency[0], 0.99) / 1000000;
+    }
+    return 0;
+}
+
+// The same workload at 0.9x and 10x the processing capacity, with and
+// without admission control. The mark is ten seconds of capacity.
+int bench_overload(int seconds) {
+    SimConfig base = { 10000, seconds, 1800, 2000, 0.05, 0.02, { 70, 20, 10 }, { 40, 30, 20, 10 }, 1, 1, 0, 0 };
+    struct {
+        const char* label;
+        int rate;
+        int high_water;
+    } runs[] = {
+        { "0.9x, no admission", 1800, 0 },
+        { "0.9x, admission", 1800, 20000 },
+        { "10x, no admission", 20000, 0 },
+        { "10x, admission", 20000, 20000 },
+    };
+    SimResult results[4];
+    for (int i = 0; i < 4; i++) {
+        SimConfig c = base;
+        c.rate = runs[i].rate;
+        c.high_water = runs[i].high_water;
+        bench_sim(&c, &results[i]);
+        printf("\n");
+    }
+
+    printf("p99 queue wait (virtual s)    medical   elite  normal   admitted   rejected\n");
+    for (int i = 0; i < 4; i++) {
+        SimResult* r = &results[i];
+        printf("  %-26s %7llu %7llu %7llu %9.1f%% %9lld\n", runs[i].label, r->p99_medical, r->p99_elite, r->p99_normal,
+            100.0 * r->created / r->submitted, r->shed + r->limited);
+    }
+    return 0;
+}
+
+// The field scanning the handlers did before json_parse
+void json_baseline(char* body, int* sender, int* receiver, int* pin, double* amount, int* urgency) {
+    char* pS = strstr(body, "\"sender\":"); if(pS) *sender = atoi(pS+9);
+    char* pR = strstr(body, "\"receiver\":"); if(pR) *receiver = atoi(pR+11);
+    char* pP = strstr(body, "\"pin\":"); if(pP) *pin = atoi(pP+6);
+    char* pA = strstr(body, "\"amount\":"); if(pA) *amount = atof(pA+9);
+    char* pU = strstr(body, "\"urgency\":"); if(pU) *urgency = atoi(pU+10);
+}
+
+void bench_json() {
+    const char* bodies[] = {
+        "{\"sender\":50000, \"receiver\":50001, \"pin\":1234, \"amount\":100, \"urgency\":0}",
+        "{\"sender\":50123,\"receiver\":50456,\"pin\":9876,\"amount\":2500.75,\"urgency\":100}",
+        "{\n  \"urgency\": 50,\n  \"amount\": 12.5,\n  \"pin\": 1111,\n  \"receiver\": 50002,\n  \"sender\": 50001,\n"
+        "  \"note\": \"rent for the flat, paid in advance as agreed\"\n}",
+    };
+    int kinds = 3, n = 3000000;
+    char copies[3][256];
+    long long bytes = 0;
+    for (int k = 0; k < kinds; k++) {
+        strcpy(copies[k], bodies[k]);
+        bytes += strlen(bodies[k]);
+    }
+    bytes = bytes * (n / kinds);
+    printf("Request bodies, %d parses (%d shapes)\n", n, kinds);
+
+    volatile long long sink = 0;
+    int sender, receiver, pin, urgency;
+    double amount;
+    double t0 = bench_ms();
+    for (int i = 0; i < n; i++) {
+        sender = receiver = pin = urgency = 0;
+        amount = 0;
+        json_baseline(copies[i % kinds], &sender, &receiver, &pin, &amount, &urgency);
+        sink += sender + receiver + pin + urgency + (long long)amount;
+    }
+    double t1 = bench_ms();
+    for (int i = 0; i < n; i++) {
+        sender = receiver = pin = urgency = 0;
+        amount = 0;
+        JsonField fields[] = {
+            JSON_FIELD("sender", JSON_INT, &sender),
+            JSON_FIELD("receiver", JSON_INT, &receiver),
+            JSON_FIELD("pin", JSON_INT, &pin),
+            JSON_FIELD("amount", JSON_NUMBER, &amount),
+            JSON_FIELD("urgency", JSON_INT, &urgency),
+        };
+        const char* b = copies[i % kinds];
+        if (!json_parse(b, (int)strlen(b), fields, 5)) printf("json_parse rejected shape %d\n", i % kinds);
+        sink += sender + receiver + pin + urgency + (long long)amount;
+    }
+    double t2 = bench_ms();
+    printf("%-12s %6.1f ns/body  %7.1f MB/s\n", "strstr/atoi", (t1 - t0) * 1e6 / n, bytes / ((t1 - t0) * 1e3));
+    printf("%-12s %6.1f ns/body  %7.1f MB/s\n", "json_parse", (t2 - t1) * 1e6 / n, bytes / ((t2 - t1) * 1e3));
+}
+
+// Appends to a growing fuzz document
+typedef struct {
+    char buf[4096];
+    int len;
+} FuzzDoc;
+
+void fuzz_put(FuzzDoc* d, const char* s) {
+    int n = (int)strlen(s);
+    if (d->len + n < (int)sizeof(d->buf)) {
+        memcpy(d->buf + d->len, s, n);
+        d->len += n;
+    }
+}
+
+void fuzz_ws(FuzzDoc* d) {
+    static const char* ws[] = { "", "", " ", "\n  ", "\t", "\r\n" };
+    fuzz_put(d, ws[bench_rand() % 6]);
+}
+
+// A value nobody binds: exercises skipping
+void fuzz_junk(FuzzDoc* d, int depth) {
+    char tmp[32];
+    switch (bench_rand() % (depth < 4 ? 7 : 5)) {
+        case 0: fuzz_put(d, "true"); break;
+        case 1: fuzz_put(d, "null"); break;
+        case 2: sprintf(tmp, "%lld", (long long)(bench_rand() % 2000000) - 1000000); fuzz_put(d, tmp); break;
+        case 3: sprintf(tmp, "-%d.%de+%d", (int)(bench_rand() % 100), (int)(bench_rand() % 100), (int)(bench_rand() % 5));
+                fuzz_put(d, tmp); break;
+        case 4: fuzz_put(d, "\"x\\\"y\\u00e9\\/\""); break;
+        case 5:
+            fuzz_put(d, "[");
+            for (int i = 0, n = (int)(bench_rand() % 4); i < n; i++) {
+                if (i) fuzz_put(d, ",");
+                fuzz_ws(d);
+                fuzz_junk(d, depth + 1);
+            }
+            fuzz_put(d, "]");
+            break;
+        default:
+            fuzz_put(d, "{");
+            for (int i = 0, n = (int)(bench_rand() % 3); i < n; i++) {
+                if (i) fuzz_put(d, ",");
+                fuzz_put(d, "\"sender\":"); // Nested keys must not bind
+                fuzz_junk(d, depth + 1);
+            }
+            fuzz_put(d, "}");
+    }
+}
+
+typedef struct {
+    int id;
+    double amount;
+    char name[50];
+} FuzzFields;
+
+bool fuzz_parse(const char* doc, int len, FuzzFields* out) {
+    out->id = -7;
+    out->amount = -7;
+    memset(out->name, 'z', sizeof(out->name));
+    out->name[0] = 0;
+    JsonField fields[] = {
+        JSON_FIELD("id", JSON_INT, &out->id),
+        JSON_FIELD("amount", JSON_NUMBER, &out->amount),
+        JSON_STRING_FIELD("name", out->name),
+    };
+    // Exactly sized, unterminated copy, so a read past the end is caught
+    char* exact = (char*)malloc(len > 0 ? len : 1);
+    memcpy(exact, doc, len);
+    bool ok = json_parse(exact, len, fields, 3);
+    free(exact);
+    return ok;
+}
+
+int bench_fuzz(int iterations) {
+    static const char alphabet[] = "{}[]\":,\\ \nu0123456789.-+eEtrufalsn\"\"x\x01\xc3\xa9";
+    int failures = 0, accepted = 0;
+    bench_seed = 88172645463325252ULL;
+
+    for (int it = 0; it < iterations && failures < 10; it++) {
+        // A valid body with known values, keys in random order among junk
+        FuzzDoc d;
+        d.len = 0;
+        int id = (int)(bench_rand() % 4000000000ULL - 2000000000LL);
+        long long cents = (long long)(bench_rand() % 100000000);
+        char name[50], encoded[400], tmp[64];
+        int name_len = (int)(bench_rand() % 60), enc = 0, plain = 0;
+        for (int i = 0; i < name_len; i++) {
+            int kind = (int)(bench_rand() % 5);
+            const char* raw = kind == 0 ? "\"" : kind == 1 ? "\\" : kind == 2 ? "\xc3\xa9" : "a";
+            const char* esc = kind == 0 ? "\\\"" : kind == 1 ? "\\\\" : kind == 2 ? "\\u00e9" : "a";
+            int rl = (int)strlen(raw);
+            if (plain + rl <= 49) {
+                memcpy(name + plain, raw, rl);
+                plain += rl;
+            } else {
+                plain = 50; // Truncated from here on
+            }
+            memcpy(encoded + enc, esc, strlen(esc));
+            enc += (int)strlen(esc);
+        }
+        if (plain > 49) {
+            // Recompute what a 50-byte buffer holds: whole characters up to 49 bytes
+            plain = 0;
+            for (int i = 0, e = 0; i < enc;) {
+                int rl, el;
+                if (encoded[i] == '\\' && encoded[i + 1] == 'u') { rl = 2; el = 6; }
+                else if (encoded[i] == '\\') { rl = 1; el = 2; }
+                else { rl = 1; el = 1; }
+                if (plain + rl > 49) break;
+                if (rl == 2) { name[plain] = '\xc3'; name[plain + 1] = '\xa9'; }
+                else name[plain] = encoded[i + el - 1];
+                plain += rl;
+                i += el;
+                (void)e;
+            }
+        }
+        name[plain] = 0;
+        encoded[enc] = 0;
+
+        int order[3] = { 0, 1, 2 };
+        for (int i = 2; i > 0; i--) {
+            int j = (int)(bench_rand() % (i + 1)), t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+        fuzz_ws(&d);
+        fuzz_put(&d, "{");
+        for (int i = 0; i < 3; i++) {
+            if (i) fuzz_put(&d, ",");
+            fuzz_ws(&d);
+            if (bench_rand() % 2) {
+                fuzz_put(&d, "\"idx\":");
+                fuzz_junk(&d, 0);
+                fuzz_put(&d, ",");
+            }
+            if (order[i] == 0) { sprintf(tmp, "\"id\":%d", id); fuzz_put(&d, tmp); }
+            if (order[i] == 1) { sprintf(tmp, "\"amount\" : %lld.%02lld", cents / 100, cents % 100); fuzz_put(&d, tmp); }
+            if (order[i] == 2) { fuzz_put(&d, "\"name\":\""); fuzz_put(&d, encoded); fuzz_put(&d, "\""); }
+            fuzz_ws(&d);
+        }
+        fuzz_put(&d, "}");
+        fuzz_ws(&d);
+
+        FuzzFields f;
+        sprintf(tmp, "%lld.%02lld", cents / 100, cents % 100);
+        if (!fuzz_parse(d.buf, d.len, &f) || f.id != id || f.amount != strtod(tmp, NULL) || strcmp(f.name, name) != 0) {
+            printf("valid body misparsed: %.*s\n", d.len, d.buf);
+            failures++;
+            continue;
+        }
+
+        // Mutations: must not crash, and must parse the same way twice
+        for (int m = 0, count = 1 + (int)(bench_rand() % 4); m < count; m++) {
+            int at = d.len ? (int)(bench_rand() % d.len) : 0;
+            switch (bench_rand() % 4) {
+                case 0: if (d.len) d.buf[at] = alphabet[bench_rand() % (sizeof(alphabet) - 1)]; break;
+                case 1:
+                    if (d.len + 1 < (int)sizeof(d.buf)) {
+                        memmove(d.buf + at + 1, d.buf + at, d.len - at);
+                        d.buf[at] = alphabet[bench_rand() % (sizeof(alphabet) - 1)];
+                        d.len++;
+                    }
+                    break;
+                case 2: if (d.len) { memmove(d.buf + at, d.buf + at + 1, d.len - at - 1); d.len--; } break;
+                default: d.len = at;
+            }
+        }
+        FuzzFields a, b;
+        bool ok_a = fuzz_parse(d.buf, d.len, &a);
+        bool ok_b = fuzz_parse(d.buf, d.len, &b);
+        if (ok_a != ok_b || (ok_a && (a.id != b.id || memcmp(&a.amount, &b.amount, sizeof(double)) != 0
+                                      || strcmp(a.name, b.name) != 0))) {
+            printf("mutated body parsed two ways: %.*s\n", d.len, d.buf);
+            failures++;
+        }
+        if (ok_a && strnlen(a.name, sizeof(a.name)) == sizeof(a.name)) {
+            printf("unterminated string from: %.*s\n", d.len, d.buf);
+            failures++;
+        }
+        // Anything accepted must be one well-formed value (or empty)
+        const char* end = d.buf + d.len;
+        const char* p = json_ws(d.buf, end);
+        if (ok_a && p != end && json_ws(json_skip(p, end, 0) ? json_skip(p, end, 0) : d.buf, end) != end) {
+            printf("accepted malformed body: %.*s\n", d.len, d.buf);
+            failures++;
+        }
+        if (ok_a) accepted++;
+    }
+    printf("Fuzz: %d valid bodies, %d mutations still accepted: %s\n", iterations, accepted,
+        failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+// Recording cost: each thread into its own block, against all of them
+// doing atomic adds on one shared histogram (what a global counter costs)
+#define METRICS_THREADS 4
+Histogram metrics_shared;
+int metrics_per_thread;
+
+void* metrics_local_worker(void* arg) {
+    unsigned long long seed = 1 + (unsigned long long)(long)arg;
+    MetricsBlock* m = metrics();
+    for (int i = 0; i < metrics_per_thread; i++) hist_record(&m->http[ROUTE_STATE], (long long)(stress_rand(&seed) % 100000));
+    return NULL;
+}
+
+void* metrics_shared_worker(void* arg) {
+    unsigned long long seed = 1 + (unsigned long long)(long)arg;
+    for (int i = 0; i < metrics_per_thread; i++) {
+        unsigned long long v = stress_rand(&seed) % 100000;
+        __atomic_fetch_add(&metrics_shared.buckets[hist_index(v)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&metrics_shared.sum, v, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+double metrics_run(void* (*worker)(void*)) {
+    pthread_t threads[METRICS_THREADS];
+    double t0 = bench_ms();
+    for (long i = 0; i < METRICS_THREADS; i++) pthread_create(&threads[i], NULL, worker, (void*)i);
+    for (int i = 0; i < METRICS_THREADS; i++) pthread_join(threads[i], NULL);
+    return (bench_ms() - t0) * 1e6 / ((double)metrics_per_thread * METRICS_THREADS);
+}
+
+int bench_metrics(int per_thread) {
+    metrics_per_thread = per_thread;
+    printf("Histogram recording, %d threads x %d values\n", METRICS_THREADS, per_thread);
+    double local = metrics_run(metrics_local_worker);
+    double shared = metrics_run(metrics_shared_worker);
+    printf("%-16s %6.1f ns/record\n", "per-thread", local);
+    printf("%-16s %6.1f ns/record\n", "shared atomic", shared);
+
+    MetricsText mt = { NULL, 0, 0 };
+    metrics_render(&mt);
+    Histogram merged;
+    memset(&merged, 0, sizeof(merged));
+    for (MetricsBlock* m = metrics_blocks; m; m = m->next) hist_merge(&merged, &m->http[ROUTE_STATE]);
+    bool ok = merged.count == (unsigned long long)per_thread * METRICS_THREADS && strstr(mt.buf, "route=\"/api/state\"");
+    // Uniform 0..99999 us: the quantiles must land within a bucket (1/HIST_SUB)
+    for (int q = 1; q < 10; q++) {
+        double exact = q * 10000.0, got = (double)hist_quantile(&merged, q / 10.0);
+        if (fabs(got - exact) > exact / HIST_SUB + 1) ok = false;
+    }
+    printf("%d bytes of exposition, merged counts and quantiles: %s\n", mt.len, ok ? "ok" : "WRONG");
+
+    // Every bound is the last value of its bucket, and a sample exactly on
+    // a power of two is counted under that power's "le" and not the one below
+    bool bounds = true;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        if (hist_index(hist_upper(i)) != i || hist_index(hist_upper(i) + 1) != i + 1) bounds = false;
+    }
+    for (int e = 4; e <= 25; e++) {
+        Histogram one;
+        memset(&one, 0, sizeof(one));
+        one.count = 1;
+        one.buckets[hist_index(1ULL << e)] = 1;
+        mt.len = 0;
+        mt_histogram(&mt, "b", "", &one, 3, 25);
+        char at[64], below[64];
+        sprintf(at, "b_bucket{le=\"%.9g\"} 1\n", (double)(1ULL << e) / 1e6);
+        sprintf(below, "b_bucket{le=\"%.9g\"} 0\n", (double)(1ULL << (e - 1)) / 1e6);
+        if (!strstr(mt.buf, at) || !strstr(mt.buf, below)) bounds = false;
+    }
+    printf("Samples on a bucket bound: %s\n", bounds ? "ok" : "WRONG");
+    free(mt.buf);
+    return ok && bounds ? 0 : 1;
+}
+
+#define RISK_SENDERS 10000
+
+// Scores every transaction from fresh profiles in batches of `size`;
+// returns ns per transaction and the sum of the scores
+double risk_run(int n, int size, const int* senders, const int* receivers, const double* amounts,
+                const long long* times, long long* score_sum) {
+    memset(risk_profiles, 0, sizeof(RiskProfile) * risk_profile_cap);
+    RiskBatch batch;
+    batch.n = 0;
+    *score_sum = 0;
+    double t0 = bench_ms();
+    for (int i = 0; i < n; i++) {
+        risk_observe(&batch, senders[i], receivers[i], amounts[i], times[i]);
+        if (batch.n == size || i == n - 1) {
+            risk_score_batch(&batch);
+            for (int j = 0; j < batch.n; j++) *score_sum += batch.score[j];
+            batch.n = 0;
+        }
+    }
+    return (bench_ms() - t0) * 1e6 / n;
+}
+
+int bench_risk(int n) {
+    printf("Risk scoring, %d transactions from %d senders, one core\n", n, RISK_SENDERS);
+    int* senders = (int*)malloc(sizeof(int) * n);
+    int* receivers = (int*)malloc(sizeof(int) * n);
+    double* amounts = (double*)malloc(sizeof(double) * n);
+    long long* times = (long long*)malloc(sizeof(long long) * n);
+    unsigned long long seed = 1;
+    long long now = 1700000000;
+    for (int i = 0; i < n; i++) {
+        senders[i] = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % RISK_SENDERS);
+        // Mostly a few regular payees, sometimes anyone
+        int payee = (stress_rand(&seed) % 10 < 8) ? (int)(stress_rand(&seed) % 5) : (int)(stress_rand(&seed) % RISK_SENDERS);
+        receivers[i] = FIRST_ACCOUNT_NUMBER + (senders[i] - FIRST_ACCOUNT_NUMBER + payee) % RISK_SENDERS;
+        amounts[i] = (stress_rand(&seed) % 100 == 0) ? 20000 + (double)(stress_rand(&seed) % 50000)
+                                                      : 50 + (double)(stress_rand(&seed) % 500);
+        if (i % 2000 == 0) now++;
+        times[i] = now;
+    }
+    risk_profile(FIRST_ACCOUNT_NUMBER + RISK_SENDERS - 1);
+
+    long long sum_one, sum_batch;
+    double one = risk_run(n, 1, senders, receivers, amounts, times, &sum_one);
+    double batched = risk_run(n, RISK_BATCH, senders, receivers, amounts, times, &sum_batch);
+    printf("%-22s %6.1f ns/tx %12.0f tx/s\n", "gather + score, 1", one, 1e9 / one);
+    printf("%-22s %6.1f ns/tx %12.0f tx/s\n", "gather + score, 64", batched, 1e9 / batched);
+
+    // The kernel alone, over one batch of the gathered features
+    RiskBatch batch;
+    batch.n = 0;
+    memset(risk_profiles, 0, sizeof(RiskProfile) * risk_profile_cap);
+    for (int i = 0; i < RISK_BATCH; i++) risk_observe(&batch, senders[i], receivers[i], amounts[i], times[i]);
+    int rounds = n / RISK_BATCH > 0 ? n / RISK_BATCH : 1;
+    RiskBatch check = batch;
+    double t0 = bench_ms();
+    for (int r = 0; r < rounds; r++) {
+        risk_score_batch(&batch);
+        __asm__ volatile("" : : "r"(batch.score) : "memory");
+    }
+    double simd = (bench_ms() - t0) * 1e6 / ((double)rounds * RISK_BATCH);
+    t0 = bench_ms();
+    for (int r = 0; r < rounds; r++) {
+        risk_score_lanes(&check, 0);
+        __asm__ volatile("" : : "r"(check.score) : "memory");
+    }
+    double scalar = (bench_ms() - t0) * 1e6 / ((double)rounds * RISK_BATCH);
+    printf("%-22s %6.2f ns/tx %12.0f tx/s\n", "kernel, SSE2", simd, 1e9 / simd);
+    printf("%-22s %6.2f ns/tx %12.0f tx/s\n", "kernel, one at a time", scalar, 1e9 / scalar);
+
+    bool ok = sum_one == sum_batch && memcmp(batch.score, check.score, sizeof(batch.score)) == 0;
+    printf("Mean score %.2f; batch sizes and kernels agree: %s\n", (double)sum_batch / n, ok ? "ok" : "WRONG");
+    free(senders);
+    free(receivers);
+    free(amounts);
+    free(times);
+    return ok ? 0 : 1;
+}
+
+#define HISTORY_ACCOUNTS 100000
+
+int bench_history(int rows) {
+    printf("History store, %d rows from %d accounts\n", rows, HISTORY_ACCOUNTS);
+    static const int urgencies[3] = { URGENCY_NORMAL, URGENCY_EMI, URGENCY_MEDICAL };
+    static const int tiers[4] = { TIER_BASIC, TIER_PREMIUM, TIER_VIP, TIER_ELITE };
+    unsigned long long seed = 1;
+    Transaction t;
+    memset(&t, 0, sizeof(t));
+    double t0 = bench_ms();
+    for (int i = 0; i < rows; i++) {
+        t.id = i;
+        t.sender_id = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % HISTORY_ACCOUNTS);
+        t.receiver_id = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % HISTORY_ACCOUNTS);
+        t.amount = 1 + (double)(stress_rand(&seed) % 500000) / 100;
+        t.urgency = (UrgencyLevel)urgencies[stress_rand(&seed) % 3];
+        t.tier = (CustomerTier)tiers[stress_rand(&seed) % 4];
+        t.status = (stress_rand(&seed) % 10 == 0) ? STATUS_CANCELLED : STATUS_DONE;
+        t.arrival_time = 1700000000 + i / 1000; // 1000 a second
+        history_append(&t);
+    }
+    printf("%-24s %8.1f ns/row\n", "append", (bench_ms() - t0) * 1e6 / rows);
+
+    HistoryGroup totals[HISTORY_MAX_KEYS], status[HISTORY_MAX_KEYS], simd[HISTORY_MAX_KEYS], scalar[HISTORY_MAX_KEYS];
+    HistoryGroup* buckets = (HistoryGroup*)malloc(sizeof(HistoryGroup) * HISTORY_MAX_BUCKETS);
+    t0 = bench_ms();
+    history_aggregate(HISTORY_BY_TIER, 0, UINT_MAX, 3600, totals);
+    printf("%-24s %8.3f ms\n", "by tier, chunk totals", bench_ms() - t0);
+    history_aggregate(HISTORY_BY_STATUS, 0, UINT_MAX, 3600, status);
+
+    memset(simd, 0, sizeof(simd));
+    memset(scalar, 0, sizeof(scalar));
+    t0 = bench_ms();
+    for (int base = 0; base < rows; base += HISTORY_CHUNK) {
+        int n = rows - base < HISTORY_CHUNK ? rows - base : HISTORY_CHUNK;
+        HistoryChunk* c = history.chunks[base / HISTORY_CHUNK];
+        history_scan(c->time, c->amount, 0, n, c->status, 2, 0, UINT_MAX, simd);
+    }
+    double simd_ms = bench_ms() - t0;
+    t0 = bench_ms();
+    for (int base = 0; base < rows; base += HISTORY_CHUNK) {
+        int n = rows - base < HISTORY_CHUNK ? rows - base : HISTORY_CHUNK;
+        HistoryChunk* c = history.chunks[base / HISTORY_CHUNK];
+        history_scan_rows(c->time, c->amount, 0, n, c->status, 0, UINT_MAX, scalar);
+    }
+    double scalar_ms = bench_ms() - t0;
+    printf("%-24s %8.3f ms\n", "by status, scan SSE2", simd_ms);
+    printf("%-24s %8.3f ms\n", "by status, scan by row", scalar_ms);
+
+    unsigned int from = 1700000000, to = 1700000000 + rows / 1000 + 1;
+    t0 = bench_ms();
+    int n = history_aggregate(HISTORY_BY_TIME, from, to, 3600, buckets);
+    printf("%-24s %8.3f ms (%d buckets)\n", "by hour", bench_ms() - t0, n);
+    t0 = bench_ms();
+    int odd = history_aggregate(HISTORY_BY_TIME, from, to, 1000, buckets);
+    printf("%-24s %8.3f ms (%d buckets)\n", "by 1000 s, split chunks", bench_ms() - t0, odd);
+
+    HistoryRow* page = (HistoryRow*)malloc(sizeof(HistoryRow) * 50);
+    int pages = 10000, listed = 0;
+    t0 = bench_ms();
+    for (int i = 0; i < pages; i++) {
+        int account = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % HISTORY_ACCOUNTS);
+        int i_acc = account - FIRST_ACCOUNT_NUMBER;
+        int sent = history.sent_head[i_acc], received = history.received_head[i_acc];
+        listed += history_page(account, &sent, &received, 50, page);
+    }
+    printf("%-24s %8.1f us/page (%.0f rows each)\n", "account page", (bench_ms() - t0) * 1e3 / pages, (double)listed / pages);
+
+    bool ok = true;
+    long long counted = 0;
+    for (int g = 0; g < TIER_CLASSES; g++) counted += totals[g].count;
+    for (int g = 0; g < 2; g++) {
+        if (status[g].count != simd[g].count || status[g].count != scalar[g].count) ok = false;
+        if (fabs(status[g].sum - simd[g].sum) > 1e-6 * status[g].sum || fabs(status[g].sum - scalar[g].sum) > 1e-6 * status[g].sum) ok = false;
+    }
+    long long bucketed = 0;
+    for (int b = 0; b < odd; b++) bucketed += buckets[b].count;
+    if (counted != rows || bucketed != rows) ok = false;
+    printf("Chunk totals, scans and buckets agree: %s\n", ok ? "ok" : "WRONG");
+    free(page);
+    free(buckets);
+    return ok ? 0 : 1;
+}
+
+// Resident memory from /proc/self/status, in MB: anonymous (heap) and
+// file-backed (mapped segments)
+void bench_rss(double* anon_mb, double* file_mb) {
+    char line[256];
+    FILE* f = fopen("/proc/self/status", "r");
+    *anon_mb = *file_mb = 0;
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "RssAnon:", 8) == 0) *anon_mb = atof(line + 8) / 1024;
+        if (strncmp(line, "RssFile:", 8) == 0) *file_mb = atof(line + 8) / 1024;
+    }
+    fclose(f);
+}
+
+int bench_compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// A transfer created and settled under state_lock, timed one at a time
+void archive_hot_path(const char* label, int n, unsigned long long* seed) {
+    long long* ns = (long long*)malloc(sizeof(long long) * n);
+    for (int i = 0; i < n; i++) {
+        int from = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(seed) % HISTORY_ACCOUNTS);
+        int to = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(seed) % HISTORY_ACCOUNTS);
+        struct timespec a, b;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        pthread_mutex_lock(&state_lock);
+        create_transaction(from, to, 1, (double)(100 + stress_rand(seed) % 50000) / 100, (int)(stress_rand(seed) % 3) * 50);
+        process_next_transaction();
+        pthread_mutex_unlock(&state_lock);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        ns[i] = (b.tv_sec - a.tv_sec) * 1000000000LL + (b.tv_nsec - a.tv_nsec);
+    }
+    qsort(ns, n, sizeof(long long), bench_compare_ll);
+    printf("%-28s p50 %6lld ns  p99 %6lld ns  max %8lld ns\n", label, ns[n / 2], ns[(int)(n * 0.99)], ns[n - 1]);
+    free(ns);
+}
+
+// Evicts the archive from memory, so the next query reads it from disk
+// (or the page cache, which this can only ask to drop)
+void archive_evict() {
+    pthread_rwlock_rdlock(&history_swap_lock);
+    for (int k = 0; k < HISTORY_MAX_CHUNKS && history.segments[k]; k++) {
+        HistorySegment* s = history.segments[k];
+        madvise((void*)s->map, s->size, MADV_DONTNEED);
+        char path[600];
+        history_segment_path(k, path);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    pthread_rwlock_unlock(&history_swap_lock);
+}
+
+// Waits for the archiver to catch up; returns the segments written
+int archive_settle() {
+    int count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&history.archived, __ATOMIC_ACQUIRE) < count / HISTORY_CHUNK) sleep_ms(10);
+    return count / HISTORY_CHUNK;
+}
+
+volatile int archive_appending;
+int archive_violations;
+
+// Queries racing the appends and the archiver's swaps
+void* archive_reader(void* arg) {
+    unsigned long long seed = 99;
+    long long finished = 0;
+    (void)arg;
+    while (__atomic_load_n(&archive_appending, __ATOMIC_SEQ_CST)) {
+        HistoryGroup by_status[2];
+        history_aggregate(HISTORY_BY_STATUS, 0, UINT_MAX, 1, by_status);
+        if (by_status[0].count + by_status[1].count < finished) archive_violations++;
+        finished = by_status[0].count + by_status[1].count;
+        HistoryRow page[20];
+        int account = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % HISTORY_ACCOUNTS), sent, received;
+        if (history_heads(account, &sent, &received)) {
+            int n = history_page(account, &sent, &received, 20, page);
+            for (int i = 0; i < n; i++) {
+                if (page[i].sender != account && page[i].receiver != account) archive_violations++;
+            }
+        }
+        sleep_ms(1);
+    }
+    return NULL;
+}
+
+// Time window whose totals the aggregates are checked against
+#define ARCHIVE_CHECK_FROM 1700003600
+#define ARCHIVE_CHECK_TO 1700007777
+
+int bench_archive(int rows) {
+    char dir[] = "bench-archive-XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("Could not create a directory here\n");
+        return 1;
+    }
+    history_open(dir);
+    init_state();
+    for (int i = 0; i < HISTORY_ACCOUNTS; i++) create_customer("archive", 1, (i % 4) * 20, 1e12);
+    printf("History archive in %s/history, %d rows from %d accounts\n", dir, rows, HISTORY_ACCOUNTS);
+
+    double anon, file;
+    unsigned long long seed = 7;
+    bench_rss(&anon, &file);
+    printf("%-28s %8.1f MB anon %8.1f MB file\n", "resident, empty", anon, file);
+    archive_hot_path("hot path, empty history", 200000, &seed);
+
+    static const int urgencies[3] = { URGENCY_NORMAL, URGENCY_EMI, URGENCY_MEDICAL };
+    static const int tiers[4] = { TIER_BASIC, TIER_PREMIUM, TIER_VIP, TIER_ELITE };
+    HistoryGroup expected[TIER_CLASSES];
+    memset(expected, 0, sizeof(expected));
+    Transaction t;
+    memset(&t, 0, sizeof(t));
+    pthread_t reader;
+    archive_appending = 1;
+    pthread_create(&reader, NULL, archive_reader, NULL);
+    int first_id = id_counter, start = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+    double t0 = bench_ms();
+    for (int i = 0; i < rows; i += 1000) {
+        pthread_mutex_lock(&state_lock);
+        for (int j = i; j < i + 1000 && j < rows; j++) {
+            t.id = id_counter++;
+            t.sender_id = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % HISTORY_ACCOUNTS);
+            t.receiver_id = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&seed) % HISTORY_ACCOUNTS);
+            t.amount = (double)(100 + stress_rand(&seed) % 500000) / 100; // Whole cents, as requests give them
+            t.urgency = (UrgencyLevel)urgencies[stress_rand(&seed) % 3];
+            t.tier = (CustomerTier)tiers[stress_rand(&seed) % 4];
+            t.status = (stress_rand(&seed) % 10 == 0) ? STATUS_CANCELLED : STATUS_DONE;
+            t.arrival_time = 1700000000 + j / 1000; // 1000 a second
+            if (t.arrival_time >= ARCHIVE_CHECK_FROM && t.arrival_time < ARCHIVE_CHECK_TO) {
+                expected[tier_class(t.tier)].count++;
+                expected[tier_class(t.tier)].sum += t.amount;
+            }
+            history_append(&t);
+        }
+        pthread_mutex_unlock(&state_lock);
+    }
+    double append_ms = bench_ms() - t0;
+    int count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE), archived = archive_settle();
+    double archive_ms = bench_ms() - t0;
+    __atomic_store_n(&archive_appending, 0, __ATOMIC_SEQ_CST);
+    pthread_join(reader, NULL);
+    printf("%-28s %8.1f ns/row, archived after %.1f s\n", "append", append_ms * 1e6 / rows, archive_ms / 1000);
+
+    long long disk = 0;
+    pthread_rwlock_rdlock(&history_swap_lock);
+    for (int k = 0; k < archived; k++) disk += history.segments[k]->size;
+    pthread_rwlock_unlock(&history_swap_lock);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    bench_rss(&anon, &file);
+    printf("%-28s %8.1f MB in %d segments, %.1f bytes/row (%d in memory)\n", "on disk", disk / 1048576.0,
+        archived, (double)disk / ((long long)archived * HISTORY_CHUNK), (int)(sizeof(HistoryChunk) / HISTORY_CHUNK));
+    printf("%-28s %8.1f MB anon %8.1f MB file (all in memory: %.0f MB more)\n", "resident, archived", anon, file,
+        (double)count * sizeof(HistoryChunk) / HISTORY_CHUNK / 1048576.0);
+    printf("%-28s %8.1f MB\n", "peak resident", usage.ru_maxrss / 1024.0);
+    archive_hot_path("hot path, archived history", 200000, &seed);
+    count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+
+    HistoryGroup tiers_all[TIER_CLASSES], tiers_range[TIER_CLASSES], status[2];
+    HistoryGroup* buckets = (HistoryGroup*)malloc(sizeof(HistoryGroup) * HISTORY_MAX_BUCKETS);
+    HistoryRow* page = (HistoryRow*)malloc(sizeof(HistoryRow) * 50);
+    unsigned int last = 1700000000 + (rows - 1) / 1000;
+    int lookups = 1000, pages = 1000, listed = 0, found = 0, buckets_n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        const char* when = pass == 0 ? "cold" : "warm";
+        char label[64];
+        unsigned long long query_seed = 11; // The same accounts and ids both times
+        if (pass == 0) {
+            archive_evict();
+            bench_rss(&anon, &file);
+            printf("%-28s %8.1f MB anon %8.1f MB file\n", "resident, archive evicted", anon, file);
+        }
+        t0 = bench_ms();
+        history_aggregate(HISTORY_BY_TIER, 0, UINT_MAX, 3600, tiers_all);
+        snprintf(label, sizeof(label), "by tier, all, %s", when);
+        printf("%-28s %8.3f ms\n", label, bench_ms() - t0);
+        t0 = bench_ms();
+        history_aggregate(HISTORY_BY_TIER, ARCHIVE_CHECK_FROM, ARCHIVE_CHECK_TO, 3600, tiers_range);
+        snprintf(label, sizeof(label), "by tier, 70 min, %s", when);
+        printf("%-28s %8.3f ms\n", label, bench_ms() - t0);
+        t0 = bench_ms();
+        buckets_n = history_aggregate(HISTORY_BY_TIME, last - 86400 + 1, last + 1, 3600, buckets);
+        snprintf(label, sizeof(label), "by hour, last day, %s", when);
+        printf("%-28s %8.3f ms (%d buckets)\n", label, bench_ms() - t0, buckets_n);
+
+        listed = 0;
+        t0 = bench_ms();
+        for (int i = 0; i < pages; i++) {
+            int account = FIRST_ACCOUNT_NUMBER + (int)(stress_rand(&query_seed) % HISTORY_ACCOUNTS), sent, received;
+            if (history_heads(account, &sent, &received)) listed += history_page(account, &sent, &received, 50, page);
+        }
+        snprintf(label, sizeof(label), "account page, %s", when);
+        printf("%-28s %8.1f us/page (%.0f rows each)\n", label, (bench_ms() - t0) * 1e3 / pages, (double)listed / pages);
+
+        found = 0;
+        t0 = bench_ms();
+        for (int i = 0; i < lookups; i++) {
+            int id = first_id + (int)(stress_rand(&query_seed) % rows);
+            HistoryRow row;
+            if (history_find(id, &row) && row.id == id) found++;
+        }
+        snprintf(label, sizeof(label), "lookup by id, %s", when);
+        printf("%-28s %8.1f us\n", label, (bench_ms() - t0) * 1e3 / lookups);
+    }
+    bench_rss(&anon, &file);
+    printf("%-28s %8.1f MB anon %8.1f MB file\n", "resident, after queries", anon, file);
+    history_aggregate(HISTORY_BY_STATUS, 0, UINT_MAX, 1, status);
+
+    bool ok = archive_violations == 0 && found == lookups;
+    long long counted = 0;
+    for (int g = 0; g < TIER_CLASSES; g++) {
+        counted += tiers_all[g].count;
+        if (tiers_range[g].count != expected[g].count || fabs(tiers_range[g].sum - expected[g].sum) > 1e-6 * expected[g].sum) ok = false;
+    }
+    if (counted != count || status[0].count + status[1].count != count || count - start < rows) ok = false;
+    printf("Segments, totals, lookups and pages agree: %s\n", ok ? "ok" : "WRONG");
+
+    archived = archive_settle();
+    for (int k = 0; k < archived; k++) {
+        char path[600];
+        history_segment_path(k, path);
+        remove(path);
+    }
+    rmdir(history.dir);
+    rmdir(dir);
+    free(page);
+    free(buckets);
+    return ok ? 0 : 1;
+}
+
+// HTTP load: keep-alive connections to a running server, each on its own
+// thread with HTTP_PIPELINE requests in flight
+#define HTTP_PIPELINE 16
+char http_request[1024];
+int http_seconds;
+
+typedef struct {
+    int port;
+    long long responses;
+    long long not_modified;
+    long long bytes;
+    bool failed;
+} HttpLoad;
+
+int http_connect(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Length of the first whole response in buf, 0 if incomplete
+int http_response_len(const char* buf, int len, bool* not_modified) {
+    const char* end = NULL;
+    for (int i = 0; i + 3 < len && !end; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') end = buf + i;
+    }
+    if (!end) return 0;
+    int header = (int)(end - buf) + 4;
+    long body = 0;
+    for (const char* p = buf; p < end; p++) {
+        if ((p == buf || p[-1] == '\n') && strncasecmp(p, "content-length:", 15) == 0) body = strtol(p + 15, NULL, 10);
+    }
+    *not_modified = strncmp(buf + 9, "304", 3) == 0;
+    return (len >= header + body) ? header + (int)body : 0;
+}
+
+void* http_load_worker(void* arg) {
+    HttpLoad* load = (HttpLoad*)arg;
+    int fd = http_connect(load->port);
+    if (fd < 0) {
+        load->failed = true;
+        return NULL;
+    }
+
+    int req_len = (int)strlen(http_request);
+    char* batch = (char*)malloc(req_len * HTTP_PIPELINE);
+    for (int i = 0; i < HTTP_PIPELINE; i++) memcpy(batch + i * req_len, http_request, req_len);
+    int cap = 1 << 20, len = 0;
+    char* buf = (char*)malloc(cap);
+
+    double deadline = bench_ms() + http_seconds * 1000.0;
+    while (bench_ms() < deadline) {
+        if (send(fd, batch, req_len * HTTP_PIPELINE, 0) != req_len * HTTP_PIPELINE) break;
+        int pending = HTTP_PIPELINE;
+        while (pending > 0) {
+            bool not_modified;
+            int n;
+            while (pending > 0 && (n = http_response_len(buf, len, &not_modified)) > 0) {
+                load->responses++;
+                load->not_modified += not_modified;
+                load->bytes += n;
+                memmove(buf, buf + n, len - n);
+                len -= n;
+                pending--;
+            }
+            if (pending == 0) break;
+            if (len == cap) {
+                cap *= 2;
+                buf = (char*)realloc(buf, cap);
+            }
+            ssize_t got = recv(fd, buf + len, cap - len, 0);
+            if (got <= 0) {
+                load->failed = true;
+                pending = 0;
+                deadline = 0;
+            }
+            else len += (int)got;
+        }
+    }
+    close(fd);
+    free(batch);
+    free(buf);
+    return NULL;
+}
+
+int bench_http(const char* path, int connections, int seconds, const char* header) {
+    snprintf(http_request, sizeof(http_request), "GET %s HTTP/1.1\r\nHost: localhost\r\n%s%s\r\n",
+        path, header, header[0] ? "\r\n" : "");
+    http_seconds = seconds;
+    printf("GET %s%s%s, %d connections x %d pipelined, %d s\n", path, header[0] ? " with " : "", header,
+        connections, HTTP_PIPELINE, seconds);
+
+    pthread_t threads[64];
+    HttpLoad loads[64];
+    if (connections > 64) connections = 64;
+    memset(loads, 0, sizeof(loads));
+    for (int i = 0; i < connections; i++) loads[i].port = 5000;
+    double t0 = bench_ms();
+    for (int i = 0; i < connections; i++) pthread_create(&threads[i], NULL, http_load_worker, &loads[i]);
+    for (int i = 0; i < connections; i++) pthread_join(threads[i], NULL);
+    double ms = bench_ms() - t0;
+
+    HttpLoad total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < connections; i++) {
+        total.responses += loads[i].responses;
+        total.not_modified += loads[i].not_modified;
+        total.bytes += loads[i].bytes;
+        total.failed |= loads[i].failed;
+    }
+    printf("%.0f requests/s, %.1f MB/s, %lld of %lld answered 304%s\n", total.responses / (ms / 1000.0),
+        total.bytes / (ms * 1e3), total.not_modified, total.responses, total.failed ? " (connection errors)" : "");
+    return total.failed ? 1 : 0;
+}
+
+// One request on a keep-alive connection; returns the response, body
+// included, in buf (terminated), or NULL
+char* http_call(int fd, const char* request, char* buf, int cap) {
+    if (send(fd, request, strlen(request), 0) != (ssize_t)strlen(request)) return NULL;
+    int len = 0;
+    bool not_modified;
+    while (http_response_len(buf, len, &not_modified) == 0) {
+        ssize_t got = recv(fd, buf + len, cap - 1 - len, 0);
+        if (got <= 0) return NULL;
+        len += (int)got;
+    }
+    buf[len] = 0;
+    return buf;
+}
+
+char* http_post(int fd, const char* path, const char* body, char* buf, int cap) {
+    char request[512];
+    snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n%s",
+        path, (int)strlen(body), body);
+    return http_call(fd, request, buf, cap);
+}
+
+// Transfers back and forth between two accounts of its own, at a steady
+// rate, on the primary
+typedef struct {
+    int rate;
+    volatile bool stop;
+    long long sent;
+    bool failed;
+} ReplicaWriter;
+
+void* replica_writer(void* arg) {
+    ReplicaWriter* w = (ReplicaWriter*)arg;
+    char buf[4096];
+    int fd = http_connect(5000), accounts[2];
+    for (int i = 0; i < 2 && fd >= 0; i++) {
+        char* r = http_post(fd, "/api/customer", "{\"name\":\"Bench\", \"pin\":1, \"tier\":0, \"balance\":1000000000}", buf, sizeof(buf));
+        char* at = r ? strstr(r, "\"account_number\":") : NULL;
+        if (!at) {
+            close(fd);
+            fd = -1;
+            break;
+        }
+        accounts[i] = atoi(at + 17);
+    }
+    if (fd < 0) {
+        w->failed = true;
+        return NULL;
+    }
+
+    double start = bench_ms();
+    while (!w->stop) {
+        char body[256];
+        snprintf(body, sizeof(body), "{\"sender\":%d, \"receiver\":%d, \"pin\":1, \"amount\":1, \"urgency\":0}",
+            accounts[w->sent % 2], accounts[(w->sent + 1) % 2]);
+        if (!http_post(fd, "/api/transaction", body, buf, sizeof(buf))) {
+            w->failed = true;
+            break;
+        }
+        w->sent++;
+        double due = start + w->sent * 1000.0 / w->rate;
+        if (due > bench_ms()) sleep_ms((int)(due - bench_ms()));
+    }
+    close(fd);
+    return NULL;
+}
+
+// The "lag_ms" a replica reports, -1 if it doesn't answer
+long long replica_lag_ms(int port) {
+    char buf[4096];
+    int fd = http_connect(port);
+    if (fd < 0) return -1;
+    char* r = http_call(fd, "GET /api/replication HTTP/1.1\r\nHost: localhost\r\n\r\n", buf, sizeof(buf));
+    close(fd);
+    char* at = r ? strstr(r, "\"lag_ms\":") : NULL;
+    return at ? atoll(at + 9) : -1;
+}
+
+int bench_replicas(const char* path, int connections, int seconds, int write_rate) {
+    snprintf(http_request, sizeof(http_request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    http_seconds = seconds;
+    if (connections > 64) connections = 64;
+    printf("GET %s, %d connections x %d pipelined, %d s per run, %d transfers/s to the primary\n", path, connections,
+        HTTP_PIPELINE, seconds, write_rate);
+    printf("%-10s %14s %12s %14s\n", "replicas", "reads/s", "writes/s", "max lag (ms)");
+
+    const int replica_counts[] = { 0, 1, 4 };
+    for (int run = 0; run < 3; run++) {
+        int servers = 1 + replica_counts[run];
+        bool reachable = true;
+        for (int i = 1; i < servers; i++) reachable &= replica_lag_ms(5000 + i) >= 0;
+        if (!reachable) {
+            printf("%-10d %14s\n", replica_counts[run], "(not running)");
+            continue;
+        }
+
+        ReplicaWriter writer = { write_rate, false, 0, false };
+        pthread_t writer_thread;
+        if (write_rate > 0) pthread_create(&writer_thread, NULL, replica_writer, &writer);
+
+        // Readers spread over the primary and the replicas
+        pthread_t threads[64];
+        HttpLoad loads[64];
+        memset(loads, 0, sizeof(loads));
+        double t0 = bench_ms();
+        for (int i = 0; i < connections; i++) {
+            loads[i].port = 5000 + i % servers;
+            pthread_create(&threads[i], NULL, http_load_worker, &loads[i]);
+        }
+        long long max_lag = 0;
+        while (bench_ms() - t0 < seconds * 1000.0) {
+            sleep_ms(250);
+            for (int i = 1; i < servers; i++) {
+                long long lag = replica_lag_ms(5000 + i);
+                if (lag > max_lag) max_lag = lag;
+            }
+        }
+        for (int i = 0; i < connections; i++) pthread_join(threads[i], NULL);
+        double ms = bench_ms() - t0;
+        writer.stop = true;
+        if (write_rate > 0) pthread_join(writer_thread, NULL);
+
+        long long responses = 0;
+        bool failed = writer.failed;
+        for (int i = 0; i < connections; i++) {
+            responses += loads[i].responses;
+            failed |= loads[i].failed;
+        }
+        char lag[32] = "-";
+        if (servers > 1) snprintf(lag, sizeof(lag), "%lld", max_lag);
+        printf("%-10d %14.0f %12.0f %14s%s\n", replica_counts[run], responses / (ms / 1000.0), writer.sent / (ms / 1000.0),
+            lag, failed ? " (connection errors)" : "");
+    }
+    return 0;
+}
+
+// Teller load: one request at a time per connection, each timed, so the
+// percentiles are what a client waits rather than what a pipeline hides
+#define API_TIMEOUT_SECONDS 1
+
+typedef struct {
+    bool close_each;        // New connection per request, "Connection: close"
+    int accounts[2];
+    long long* latency_us;
+    int count, cap;
+    long long errors;       // Failed or timed out
+} ApiLoad;
+
+// http_connect, with connect() and every recv() giving up after
+// API_TIMEOUT_SECONDS: a server stuck on another client never accepts
+int api_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval tv = { API_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(5000);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void* api_load_worker(void* arg) {
+    ApiLoad* load = (ApiLoad*)arg;
+    const char* connection = load->close_each ? "Connection: close\r\n" : "";
+    int cap = 1 << 20;
+    char* buf = (char*)malloc(cap);
+    int fd = -1;
+
+    double deadline = bench_ms() + http_seconds * 1000.0;
+    for (long long i = 0; bench_ms() < deadline; i++) {
+        char request[512], body[256];
+        if (i % 10 == 9) {
+            snprintf(request, sizeof(request), "GET /api/state?limit=100 HTTP/1.1\r\nHost: localhost\r\n%s\r\n", connection);
+        } else {
+            snprintf(body, sizeof(body), "{\"sender\":%d, \"receiver\":%d, \"pin\":1, \"amount\":1, \"urgency\":0}",
+                load->accounts[i % 2], load->accounts[(i + 1) % 2]);
+            snprintf(request, sizeof(request), "POST /api/transaction HTTP/1.1\r\nHost: localhost\r\n%sContent-Length: %d\r\n\r\n%s",
+                connection, (int)strlen(body), body);
+        }
+
+        double start = bench_ms();
+        if (fd < 0) fd = api_connect();
+        bool ok = fd >= 0 && http_call(fd, request, buf, cap) != NULL;
+        if (!ok) load->errors++;
+        else {
+            if (load->count == load->cap) {
+                load->cap = load->cap ? load->cap * 2 : 4096;
+                load->latency_us = (long long*)realloc(load->latency_us, sizeof(long long) * load->cap);
+            }
+            load->latency_us[load->count++] = (long long)((bench_ms() - start) * 1000);
+        }
+        if ((!ok || load->close_each) && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+int bench_api(int connections, int seconds, int stalled, bool close_each) {
+    signal(SIGPIPE, SIG_IGN); // A server that hangs up is counted, not fatal
+    http_seconds = seconds;
+    if (connections > 64) connections = 64;
+    printf("POST /api/transaction, every 10th GET /api/state?limit=100: %d connections (%s), %d stalled, %d s\n",
+        connections, close_each ? "one per request" : "keep-alive", stalled, seconds);
+
+    // Two accounts to move money between, set up on short connections
+    // so any version of the server can answer
+    int accounts[2];
+    char buf[4096];
+    for (int i = 0; i < 2; i++) {
+        int fd = api_connect();
+        const char* body = "{\"name\":\"Bench\", \"pin\":1, \"tier\":0, \"balance\":1000000000}";
+        char request[512];
+        snprintf(request, sizeof(request), "POST /api/customer HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\nContent-Length: %d\r\n\r\n%s",
+            (int)strlen(body), body);
+        char* r = fd >= 0 ? http_call(fd, request, buf, sizeof(buf)) : NULL;
+        char* at = r ? strstr(r, "\"account_number\":") : NULL;
+        if (fd >= 0) close(fd);
+        if (!at) {
+            printf("No server answering on port 5000\n");
+            return 1;
+        }
+        accounts[i] = atoi(at + 17);
+    }
+
+    // Clients that connect and never send a thing
+    int* stalled_fds = (int*)malloc(sizeof(int) * (stalled + 1));
+    for (int i = 0; i < stalled; i++) stalled_fds[i] = api_connect();
+
+    pthread_t threads[64];
+    ApiLoad loads[64];
+    memset(loads, 0, sizeof(loads));
+    double t0 = bench_ms();
+    for (int i = 0; i < connections; i++) {
+        loads[i].close_each = close_each;
+        memcpy(loads[i].accounts, accounts, sizeof(accounts));
+        pthread_create(&threads[i], NULL, api_load_worker, &loads[i]);
+    }
+    for (int i = 0; i < connections; i++) pthread_join(threads[i], NULL);
+    double ms = bench_ms() - t0;
+    for (int i = 0; i < stalled; i++) {
+        if (stalled_fds[i] >= 0) close(stalled_fds[i]);
+    }
+    free(stalled_fds);
+
+    long long total = 0, errors = 0;
+    for (int i = 0; i < connections; i++) {
+        total += loads[i].count;
+        errors += loads[i].errors;
+    }
+    long long* all = (long long*)malloc(sizeof(long long) * (total + 1));
+    long long at = 0;
+    for (int i = 0; i < connections; i++) {
+        memcpy(all + at, loads[i].latency_us, sizeof(long long) * loads[i].count);
+        at += loads[i].count;
+        free(loads[i].latency_us);
+    }
+    qsort(all, total, sizeof(long long), bench_compare_ll);
+    if (total > 0) {
+        printf("%.0f requests/s, p50 %.2f ms, p99 %.2f ms, %lld failed or timed out after %d s\n", total / (ms / 1000.0),
+            all[total / 2] / 1000.0, all[total * 99 / 100] / 1000.0, errors, API_TIMEOUT_SECONDS);
+    } else {
+        printf("No requests answered, %lld failed or timed out after %d s\n", errors, API_TIMEOUT_SECONDS);
+    }
+    free(all);
+    return errors > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "stress") == 0) return bench_stress((argc > 2) ? atoi(argv[2]) : 5);
+    if (argc > 1 && strcmp(argv[1], "sim") == 0) {
+        SimConfig c = { 10000, 600, 2000, 2000, 0.05, 0.02, { 70, 20, 10 }, { 40, 30, 20, 10 }, 1, 1, 0, 0 };
+        for (int i = 2; i < argc; i++) {
+            if (!sim_option(&c, argv[i])) {
+                printf("Unknown option %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (c.customers < 2 || c.shards < 1 || c.shards > MAX_SHARDS) return 1;
+        return bench_sim(&c, NULL);
+    }
+    if (argc > 1 && strcmp(argv[1], "overload") == 0) return bench_overload((argc > 2) ? atoi(argv[2]) : 300);
+    if (argc > 1 && strcmp(argv[1], "json") == 0) {
+        bench_json();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "fuzz") == 0) return bench_fuzz((argc > 2) ? atoi(argv[2]) : 1000000);
+    if (argc > 1 && strcmp(argv[1], "http") == 0) {
+        return bench_http((argc > 2) ? argv[2] : "/", (argc > 3) ? atoi(argv[3]) : 4, (argc > 4) ? atoi(argv[4]) : 5,
+            (argc > 5) ? argv[5] : "");
+    }
+    if (argc > 1 && strcmp(argv[1], "cancel") == 0) {
+        if (argc > 2) bench_cancel(atoi(argv[2]));
+        else {
+            bench_cancel(100000);
+            bench_cancel(1000000);
+        }
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "aging") == 0) {
+        if (argc > 2) bench_aging(atoi(argv[2]));
+        else {
+            for (int n = 10000; n <= 1000000; n *= 10) bench_aging(n);
+        }
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "accounts") == 0) return bench_accounts((argc > 2) ? atoi(argv[2]) : 1000000);
+    if (argc > 1 && strcmp(argv[1], "wal") == 0) return bench_wal((argc > 2) ? atoi(argv[2]) : 1000000, (argc > 3) ? atoi(argv[3]) : 8);
+    if (argc > 1 && strcmp(argv[1], "api") == 0) {
+        return bench_api((argc > 2) ? atoi(argv[2]) : 32, (argc > 3) ? atoi(argv[3]) : 5, (argc > 4) ? atoi(argv[4]) : 0,
+            argc > 5 && strcmp(argv[5], "close") == 0);
+    }
+    if (argc > 1 && strcmp(argv[1], "replicas") == 0) {
+        return bench_replicas((argc > 2) ? argv[2] : "/api/state?limit=100", (argc > 3) ? atoi(argv[3]) : 8,
+            (argc > 4) ? atoi(argv[4]) : 5, (argc > 5) ? atoi(argv[5]) : 500);
+    }
+    if (argc > 1 && strcmp(argv[1], "metrics") == 0) return bench_metrics((argc > 2) ? atoi(argv[2]) : 10000000);
+    if (argc > 1 && strcmp(argv[1], "history") == 0) return bench_history((argc > 2) ? atoi(argv[2]) : 10000000);
+    if (argc > 1 && strcmp(argv[1], "archive") == 0) return bench_archive((argc > 2) ? atoi(argv[2]) : 50000000);
+    if (argc > 1 && strcmp(argv[1], "risk") == 0) return bench_risk((argc > 2) ? atoi(argv[2]) : 10000000);
+
+    int n = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int transfers = (argc > 2) ? atoi(argv[2]) : 1000000;
+    if (n < 10) n = 10;
+    bench_time_locks(n);
+    bench_heaps(n);
+    bench_shards(transfers);
+    return 0;
+}
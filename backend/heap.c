@@ -1,104 +1,140 @@
 #include "structures.h"
 
+// d-ary max-heap (HEAP_ARITY children per node) of HeapEntry. Each entry
+// carries its ordering key, so sifting compares contiguous entries and
+// only touches a Transaction to keep its heap_index in sync. The children
+// of node i are d*i+1 .. d*i+d, so one sift step scans a run of d entries.
+
 // Initialize a heap
-Heap* create_heap(int capacity, int (*compare)(const void* a, const void* b)) {
+Heap* create_heap(int capacity) {
     Heap* h = (Heap*)malloc(sizeof(Heap));
     h->size = 0;
     h->capacity = capacity;
-    h->compare = compare;
-    // data is array of pointers, already allocated as part of struct if fixed, 
-    // but here we used define MAX_TRANSACTIONS in struct? 
-    // Wait, in structures.h: Transaction* data[MAX_TRANSACTIONS]; 
-    // So no dynamic allocation needed for the array itself.
+    // Only entries live here, so growing it never moves a Transaction
+    h->data = (HeapEntry*)malloc(sizeof(HeapEntry) * capacity);
     return h;
 }
 
-void swap(Transaction** a, Transaction** b) {
-    Transaction* temp = *a;
-    *a = *b;
-    *b = temp;
+// True if a comes out before b: larger key first, then smaller tie
+static inline bool heap_before(const HeapEntry* a, const HeapEntry* b) {
+    if (a->key != b->key) return a->key > b->key;
+    return a->tie < b->tie;
 }
 
-// Compare for Priority Queue (Max Heap based on effective_priority)
-int compare_priority(const void* a, const void* b) {
-    Transaction* t1 = *(Transaction**)a;
-    Transaction* t2 = *(Transaction**)b;
-    if (t1->effective_priority > t2->effective_priority) return 1;
-    if (t1->effective_priority < t2->effective_priority) return -1;
-    // Tie-breaker: Arrival time (FIFO)
-    if (t1->arrival_time < t2->arrival_time) return 1; 
-    return 0;
+// Priority queue order: the time-invariant priority_key, then arrival (FIFO)
+static inline HeapEntry priority_entry(Transaction* t) {
+    HeapEntry e = { t->priority_key, (long long)t->arrival_time, t };
+    return e;
 }
 
-// Compare for Time Lock Queue (Min Heap based on unlock_time)
-int compare_timelock(const void* a, const void* b) {
-    Transaction* t1 = *(Transaction**)a;
-    Transaction* t2 = *(Transaction**)b;
-    // We want smallest unlock_time at top
-    if (t1->unlock_time < t2->unlock_time) return 1; 
-    if (t1->unlock_time > t2->unlock_time) return -1;
-    return 0;
+// Moves the hole at `index` up until `e` fits, then places `e` there
+static inline void heapify_up(Heap* h, int index, HeapEntry e) {
+    while (index > 0) {
+        int parent = (index - 1) / HEAP_ARITY;
+        if (!heap_before(&e, &h->data[parent])) break;
+        h->data[index] = h->data[parent];
+        h->data[index].t->heap_index = index;
+        index = parent;
+    }
+    h->data[index] = e;
+    e.t->heap_index = index;
 }
 
-void heapify_up(Heap* h, int index) {
-    int parent = (index - 1) / 2;
-    if (index > 0 && h->compare(&h->data[index], &h->data[parent]) > 0) {
-        swap(&h->data[index], &h->data[parent]);
-        heapify_up(h, parent);
+// Moves the hole at `index` down until `e` fits, then places `e` there
+static inline void heapify_down(Heap* h, int index, HeapEntry e) {
+    while (1) {
+        int first = HEAP_ARITY * index + 1;
+        if (first >= h->size) break;
+        int last = first + HEAP_ARITY < h->size ? first + HEAP_ARITY : h->size;
+        int best = first;
+        for (int c = first + 1; c < last; c++) {
+            if (heap_before(&h->data[c], &h->data[best])) best = c;
+        }
+        if (!heap_before(&h->data[best], &e)) break;
+        h->data[index] = h->data[best];
+        h->data[index].t->heap_index = index;
+        index = best;
     }
+    h->data[index] = e;
+    e.t->heap_index = index;
 }
 
-void heapify_down(Heap* h, int index) {
-    int left = 2 * index + 1;
-    int right = 2 * index + 2;
-    int largest = index;
-
-    if (left < h->size && h->compare(&h->data[left], &h->data[largest]) > 0)
-        largest = left;
-    
-    if (right < h->size && h->compare(&h->data[right], &h->data[largest]) > 0)
-        largest = right;
-
-    if (largest != index) {
-        swap(&h->data[index], &h->data[largest]);
-        heapify_down(h, largest);
+static inline void heap_reserve(Heap* h) {
+    if (h->size == h->capacity) {
+        h->capacity *= 2;
+        h->data = (HeapEntry*)realloc(h->data, sizeof(HeapEntry) * h->capacity);
     }
 }
 
+// Add t ordered by (key, tie) instead of its priority
+void heap_push_keyed(Heap* h, Transaction* t, double key, long long tie) {
+    heap_reserve(h);
+    HeapEntry e = { key, tie, t };
+    h->size++;
+    heapify_up(h, h->size - 1, e);
+}
+
 void heap_push(Heap* h, Transaction* t) {
-    if (h->size >= MAX_TRANSACTIONS) return; // Full
-    h->data[h->size] = t;
-    heapify_up(h, h->size);
+    heap_reserve(h);
     h->size++;
+    heapify_up(h, h->size - 1, priority_entry(t));
 }
 
 Transaction* heap_pop(Heap* h) {
     if (h->size == 0) return NULL;
-    Transaction* root = h->data[0];
-    h->data[0] = h->data[h->size - 1];
+    Transaction* root = h->data[0].t;
     h->size--;
-    heapify_down(h, 0);
+    if (h->size > 0) heapify_down(h, 0, h->data[h->size]);
+    root->heap_index = -1;
     return root;
 }
 
 Transaction* heap_peek(Heap* h) {
     if (h->size == 0) return NULL;
-    return h->data[0];
+    return h->data[0].t;
 }
 
-// Helper to remove a specific transaction (middle of heap) - O(N) scan, O(logN) fix
-// Needed for cancellation
-void heap_remove(Heap* h, int tx_id) {
-    int i;
-    for (i = 0; i < h->size; i++) {
-        if (h->data[i]->id == tx_id) break;
+// Add without sifting; call heap_build() once all entries are in
+void heap_append(Heap* h, Transaction* t) {
+    heap_reserve(h);
+    t->heap_index = h->size;
+    h->data[h->size++] = priority_entry(t);
+}
+
+// Bottom-up heap construction - O(N) instead of N pushes
+void heap_build(Heap* h) {
+    if (h->size < 2) return; // (size - 2) / d truncates to 0 for size 0
+    for (int i = (h->size - 2) / HEAP_ARITY; i >= 0; i--) {
+        heapify_down(h, i, h->data[i]);
     }
-    if (i == h->size) return; // Not found
+}
+
+// Adds k transactions at once. Appending them and rebuilding is O(n + k),
+// pushing one by one O(k log n); this picks whichever is less work.
+void heap_push_many(Heap* h, Transaction** ts, int k) {
+    int total = h->size + k;
+    int depth = 1;
+    for (long long span = HEAP_ARITY; span < total; span *= HEAP_ARITY) depth++;
+    if ((long long)k * depth < total) {
+        for (int i = 0; i < k; i++) heap_push(h, ts[i]);
+        return;
+    }
+    for (int i = 0; i < k; i++) heap_append(h, ts[i]);
+    heap_build(h);
+}
+
+// Remove a specific transaction (middle of heap) - O(logN), the
+// transaction knows its own slot. Needed for cancellation.
+void heap_remove(Heap* h, Transaction* t) {
+    int i = t->heap_index;
+    if (i < 0 || i >= h->size || h->data[i].t != t) return; // Not in this heap
 
-    h->data[i] = h->data[h->size - 1];
     h->size--;
-    // We might need to go up or down depending on the value
-    // Easiest is to try both or compare with parent
-    heapify_down(h, i);
-    heapify_up(h, i); 
+    t->heap_index = -1;
+    // The moved entry might need to go up or down
+    if (i < h->size) {
+        HeapEntry moved = h->data[h->size];
+        if (i > 0 && heap_before(&moved, &h->data[(i - 1) / HEAP_ARITY])) heapify_up(h, i, moved);
+        else heapify_down(h, i, moved);
+    }
 }
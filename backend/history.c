@@ -0,0 +1,577 @@
+#include "structures.h"
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// --- TRANSACTION HISTORY ---
+// A copy of every finished (processed or cancelled) transaction is
+// appended here, one array per field, in chunks of HISTORY_CHUNK rows.
+// This is what account history and aggregate queries read, long after a
+// transaction's slot has been reused.
+//
+// Each row links to the previous row with the same sender and the previous
+// row with the same receiver. Each account keeps the newest row of each
+// chain, so an account's history is read newest first, one page at a time,
+// without a scan.
+//
+// Aggregates scan only the fields they need, four rows at a time with
+// SSE2 where that pays. A full chunk also keeps its time and id ranges and
+// its totals by tier, urgency and status. Rows are appended roughly in
+// arrival order, so chunks cover narrow time ranges, and a query reads
+// the totals of every chunk inside its range and scans at most the
+// chunks at either end.
+//
+// With a data directory (history_open), full chunks are archived: written
+// to <dir>/history as segments (segment.c), mapped back and freed. Memory
+// then holds the chunk being filled, whatever the archiver hasn't caught
+// up with, and the per-account heads; the rest is paged in as queries
+// touch it. Archived history survives restarts. Without one, every chunk
+// stays in memory, and the history is rebuilt on startup from what the
+// snapshot and log still hold: MAX_FINISHED_HISTORY transactions at least.
+//
+// Rows are appended under state_lock and never change once written.
+// Chunks never move, and `count` is published with a release store, so
+// queries read rows below it without state_lock. They hold
+// history_swap_lock for reading, which the archiver takes for writing to
+// swap a chunk for its segment. Only the per-account heads need
+// state_lock.
+
+#define HISTORY_CHUNK 65536
+#define HISTORY_MAX_CHUNKS 1024     // 64M rows
+#define HISTORY_MAX_BUCKETS 1000    // Per time-bucketed query
+#define HISTORY_MAX_KEYS 4          // Groups one scan adds up at once
+// Recovery restores at most the transactions the snapshot kept and those
+// that finished in the log after it; twice that many of the newest
+// archived rows are the ones it can repeat
+#define HISTORY_RECOVERY_ROWS (2 * (MAX_FINISHED_HISTORY + WAL_SNAPSHOT_EVERY))
+
+typedef enum {
+    HISTORY_BY_TIER,
+    HISTORY_BY_URGENCY,
+    HISTORY_BY_STATUS,
+    HISTORY_BY_TIME
+} HistoryDimension;
+
+typedef struct {
+    long long count;
+    double sum;
+} HistoryGroup;
+
+typedef struct {
+    unsigned int min_time, max_time;
+    int min_id, max_id;
+    HistoryGroup by_tier[TIER_CLASSES];
+    HistoryGroup by_urgency[URGENCY_CLASSES];
+    HistoryGroup by_status[2];
+} HistorySummary;
+
+typedef struct {
+    int id[HISTORY_CHUNK];
+    int sender[HISTORY_CHUNK];
+    int receiver[HISTORY_CHUNK];
+    double amount[HISTORY_CHUNK];
+    unsigned int time[HISTORY_CHUNK];       // Arrival, Unix seconds
+    unsigned char urgency[HISTORY_CHUNK];   // urgency_class
+    unsigned char tier[HISTORY_CHUNK];      // tier_class
+    unsigned char status[HISTORY_CHUNK];    // 0 processed, 1 cancelled
+    int prev_sent[HISTORY_CHUNK];           // Sender's previous row; -1 if none
+    int prev_received[HISTORY_CHUNK];       // Receiver's previous row; -1 if none
+    HistorySummary summary;                 // Final once the chunk is full
+} HistoryChunk;
+
+#include "segment.c"
+
+typedef struct {
+    HistoryChunk* chunks[HISTORY_MAX_CHUNKS];       // NULL once archived
+    HistorySegment* segments[HISTORY_MAX_CHUNKS];   // Archived chunks
+    int count;              // Rows written; read with acquire
+    int archived;           // Chunks archived, all of them below the rest
+    int* sent_head;         // Per account slot: newest row it sent, -1 if none
+    int* received_head;
+    int head_cap;
+    long long dropped;      // Finished after the store filled up
+    char dir[512];          // Where segments go; empty keeps everything in memory
+    int* recent_ids;        // Sorted ids of the newest archived rows, during recovery
+    int recent_count;
+} History;
+
+History history;
+pthread_rwlock_t history_swap_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t archive_wake = PTHREAD_COND_INITIALIZER;    // A chunk filled up
+
+// Values of each class, as the listings show them
+const int urgency_values[URGENCY_CLASSES] = { URGENCY_NORMAL, URGENCY_EMI, URGENCY_MEDICAL };
+const int tier_values[TIER_CLASSES] = { TIER_BASIC, TIER_PREMIUM, TIER_VIP, TIER_ELITE };
+
+// One row, copied out for a listing
+typedef struct {
+    int id, sender, receiver;
+    double amount;
+    long long time;
+    int urgency, tier, status;
+} HistoryRow;
+
+static inline HistoryChunk* history_chunk(int row) {
+    return history.chunks[row / HISTORY_CHUNK];
+}
+
+// An integer field of `row`, from its chunk or its segment. Caller holds
+// history_swap_lock.
+static inline long long history_field(int row, SegmentColumn col) {
+    HistorySegment* s = history.segments[row / HISTORY_CHUNK];
+    if (s) return segment_value(s, col, row % HISTORY_CHUNK);
+    return segment_source(history_chunk(row), col, row % HISTORY_CHUNK);
+}
+
+void history_ensure_heads(int acc_no) {
+    int i = acc_no - FIRST_ACCOUNT_NUMBER;
+    if (i < history.head_cap) return;
+    int cap = history.head_cap ? history.head_cap : 1024;
+    while (cap <= i) cap *= 2;
+    history.sent_head = (int*)realloc(history.sent_head, sizeof(int) * cap);
+    history.received_head = (int*)realloc(history.received_head, sizeof(int) * cap);
+    for (int j = history.head_cap; j < cap; j++) history.sent_head[j] = history.received_head[j] = -1;
+    history.head_cap = cap;
+}
+
+// Chunks are mapped on their own rather than taken from the heap, so
+// archiving one gives its memory straight back
+HistoryChunk* history_chunk_alloc() {
+#ifdef _WIN32
+    return (HistoryChunk*)calloc(1, sizeof(HistoryChunk));
+#else
+    void* c = mmap(NULL, sizeof(HistoryChunk), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return c == MAP_FAILED ? NULL : (HistoryChunk*)c; // Zeroed
+#endif
+}
+
+void history_chunk_free(HistoryChunk* c) {
+#ifdef _WIN32
+    free(c);
+#else
+    munmap(c, sizeof(HistoryChunk));
+#endif
+}
+
+int history_compare_ids(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Copies a transaction that just finished. Caller holds state_lock.
+void history_append(Transaction* t) {
+    if (history.recent_ids && bsearch(&t->id, history.recent_ids, history.recent_count, sizeof(int), history_compare_ids)) return;
+    int row = history.count;
+    if (row == HISTORY_CHUNK * HISTORY_MAX_CHUNKS) {
+        history.dropped++;
+        return;
+    }
+    HistoryChunk* c = history.chunks[row / HISTORY_CHUNK];
+    if (!c) {
+        c = history_chunk_alloc();
+        if (!c) {
+            history.dropped++;
+            return;
+        }
+        c->summary.min_time = UINT_MAX;
+        c->summary.min_id = INT_MAX;
+        c->summary.max_id = INT_MIN;
+        history.chunks[row / HISTORY_CHUNK] = c;
+    }
+    history_ensure_heads(t->sender_id > t->receiver_id ? t->sender_id : t->receiver_id);
+
+    int i = row % HISTORY_CHUNK;
+    unsigned int time = (unsigned int)t->arrival_time;
+    int u = urgency_class(t->urgency), tier = tier_class(t->tier), status = t->status == STATUS_DONE ? 0 : 1;
+    c->id[i] = t->id;
+    c->sender[i] = t->sender_id;
+    c->receiver[i] = t->receiver_id;
+    c->amount[i] = t->amount;
+    c->time[i] = time;
+    c->urgency[i] = (unsigned char)u;
+    c->tier[i] = (unsigned char)tier;
+    c->status[i] = (unsigned char)status;
+    c->prev_sent[i] = history.sent_head[t->sender_id - FIRST_ACCOUNT_NUMBER];
+    c->prev_received[i] = history.received_head[t->receiver_id - FIRST_ACCOUNT_NUMBER];
+    history.sent_head[t->sender_id - FIRST_ACCOUNT_NUMBER] = row;
+    history.received_head[t->receiver_id - FIRST_ACCOUNT_NUMBER] = row;
+
+    HistorySummary* sum = &c->summary;
+    if (time < sum->min_time) sum->min_time = time;
+    if (time > sum->max_time) sum->max_time = time;
+    if (t->id < sum->min_id) sum->min_id = t->id;
+    if (t->id > sum->max_id) sum->max_id = t->id;
+    sum->by_tier[tier].count++;
+    sum->by_tier[tier].sum += t->amount;
+    sum->by_urgency[u].count++;
+    sum->by_urgency[u].sum += t->amount;
+    sum->by_status[status].count++;
+    sum->by_status[status].sum += t->amount;
+    __atomic_store_n(&history.count, row + 1, __ATOMIC_RELEASE);
+
+    if (history.dir[0] && (row + 1) % HISTORY_CHUNK == 0) {
+        pthread_mutex_lock(&archive_lock);
+        pthread_cond_signal(&archive_wake);
+        pthread_mutex_unlock(&archive_lock);
+    }
+}
+
+// Caller holds history_swap_lock
+void history_row(int row, HistoryRow* out) {
+    HistorySegment* s = history.segments[row / HISTORY_CHUNK];
+    int classes = (int)history_field(row, SEG_CLASSES);
+    out->id = (int)history_field(row, SEG_ID);
+    out->sender = (int)history_field(row, SEG_SENDER);
+    out->receiver = (int)history_field(row, SEG_RECEIVER);
+    out->amount = s ? segment_amount(s, row % HISTORY_CHUNK) : history_chunk(row)->amount[row % HISTORY_CHUNK];
+    out->time = history_field(row, SEG_TIME);
+    out->urgency = urgency_values[classes & 3];
+    out->tier = tier_values[classes >> 2 & 3];
+    out->status = classes >> 4 ? STATUS_CANCELLED : STATUS_DONE;
+}
+
+// Newest row `acc_no` sent and received, for starting a listing; false if
+// there is no such account
+bool history_heads(int acc_no, int* sent, int* received) {
+    pthread_mutex_lock(&state_lock);
+    bool found = find_customer(acc_no) != NULL;
+    int i = acc_no - FIRST_ACCOUNT_NUMBER;
+    *sent = *received = -1;
+    if (found && i < history.head_cap) {
+        *sent = history.sent_head[i];
+        *received = history.received_head[i];
+    }
+    pthread_mutex_unlock(&state_lock);
+    return found;
+}
+
+// Up to `limit` of acc_no's rows, newest first, merging the rows it sent
+// (from row `sent` down; -1 for none) and received (from `received`
+// down). Leaves `sent` and `received` where the next page starts. A
+// position that isn't on the account's chain ends it.
+int history_page(int acc_no, int* sent, int* received, int limit, HistoryRow* out) {
+    int count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+    int s = *sent < count ? *sent : -1, r = *received < count ? *received : -1;
+    pthread_rwlock_rdlock(&history_swap_lock);
+    if (s >= 0 && history_field(s, SEG_SENDER) != acc_no) s = -1;
+    if (r >= 0 && history_field(r, SEG_RECEIVER) != acc_no) r = -1;
+
+    int n = 0;
+    while (n < limit && (s >= 0 || r >= 0)) {
+        int row = s > r ? s : r;
+        history_row(row, &out[n++]);
+        if (row == s) s = (int)history_field(row, SEG_PREV_SENT);
+        if (row == r) r = (int)history_field(row, SEG_PREV_RECEIVED); // Both, for a transfer to oneself
+    }
+    pthread_rwlock_unlock(&history_swap_lock);
+    *sent = s;
+    *received = r;
+    return n;
+}
+
+// The row of the finished transaction `id`, newest chunks first, skipping
+// the full chunks and archived blocks whose id range can't hold it; false
+// if it isn't in the history
+bool history_find(int id, HistoryRow* out) {
+    int count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+    int found = -1;
+    pthread_rwlock_rdlock(&history_swap_lock);
+    for (int k = (count + HISTORY_CHUNK - 1) / HISTORY_CHUNK - 1; k >= 0 && found < 0; k--) {
+        int base = k * HISTORY_CHUNK;
+        int rows = count - base < HISTORY_CHUNK ? count - base : HISTORY_CHUNK;
+        HistorySegment* s = history.segments[k];
+        HistoryChunk* c = history.chunks[k];
+        const HistorySummary* sum = s ? &s->header.summary : &c->summary;
+        if (rows == HISTORY_CHUNK && (id < sum->min_id || id > sum->max_id)) continue;
+
+        if (!s) {
+            for (int i = 0; i < rows; i++) {
+                if (c->id[i] == id) {
+                    found = base + i;
+                    break;
+                }
+            }
+            continue;
+        }
+        for (int b = 0; b < SEGMENT_BLOCKS && found < 0; b++) {
+            const SegmentBlock* block = &s->header.blocks[b];
+            if (id < block->min_id || id > block->max_id) continue;
+            for (int i = b * HISTORY_BLOCK; i < (b + 1) * HISTORY_BLOCK; i++) {
+                if (segment_value(s, SEG_ID, i) == id) {
+                    found = base + i;
+                    break;
+                }
+            }
+        }
+    }
+    if (found >= 0) history_row(found, out);
+    pthread_rwlock_unlock(&history_swap_lock);
+    return found >= 0;
+}
+
+// history_scan one row at a time
+static inline void history_scan_rows(const unsigned int* time, const double* amount, int lo, int hi, const unsigned char* keys,
+                                     unsigned int from, unsigned int to, HistoryGroup* out) {
+    for (int i = lo; i < hi; i++) {
+        if (time[i] < from || time[i] >= to) continue;
+        HistoryGroup* g = &out[keys ? keys[i] : 0];
+        g->count++;
+        g->sum += amount[i];
+    }
+}
+
+#ifdef __SSE2__
+// Four rows at a time; returns where it stopped. `groups` is a constant
+// at every call, so the accumulators stay in registers.
+static inline int history_scan_sse2(const unsigned int* time, const double* amount, int lo, int hi, const unsigned char* keys,
+                                    const int groups, unsigned int from, unsigned int to, HistoryGroup* out) {
+    const __m128i bias = _mm_set1_epi32((int)0x80000000); // Unsigned order, signed compares
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo_time = _mm_xor_si128(_mm_set1_epi32((int)from), bias);
+    const __m128i hi_time = _mm_xor_si128(_mm_set1_epi32((int)to), bias);
+    __m128i counts[HISTORY_MAX_KEYS];
+    __m128d sums[HISTORY_MAX_KEYS];
+    for (int g = 0; g < groups; g++) {
+        counts[g] = zero;
+        sums[g] = _mm_setzero_pd();
+    }
+    int i = lo;
+    for (; i + 4 <= hi; i += 4) {
+        __m128i t = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(time + i)), bias);
+        __m128i in = _mm_andnot_si128(_mm_cmplt_epi32(t, lo_time), _mm_cmplt_epi32(t, hi_time));
+        __m128i k = zero;
+        if (keys) {
+            int packed;
+            memcpy(&packed, keys + i, 4);
+            k = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        }
+        __m128d a0 = _mm_loadu_pd(amount + i), a1 = _mm_loadu_pd(amount + i + 2);
+        for (int g = 0; g < groups; g++) {
+            __m128i m = _mm_and_si128(in, _mm_cmpeq_epi32(k, _mm_set1_epi32(g)));
+            counts[g] = _mm_sub_epi32(counts[g], m); // A match is -1
+            sums[g] = _mm_add_pd(sums[g], _mm_and_pd(a0, _mm_castsi128_pd(_mm_unpacklo_epi32(m, m))));
+            sums[g] = _mm_add_pd(sums[g], _mm_and_pd(a1, _mm_castsi128_pd(_mm_unpackhi_epi32(m, m))));
+        }
+    }
+    for (int g = 0; g < groups; g++) {
+        int lanes[4];
+        double halves[2];
+        _mm_storeu_si128((__m128i*)lanes, counts[g]);
+        _mm_storeu_pd(halves, sums[g]);
+        out[g].count += (long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        out[g].sum += halves[0] + halves[1];
+    }
+    return i;
+}
+#endif
+
+// Adds rows [lo, hi) with a time in [from, to) to out[key], key being the
+// row's entry in `keys` (below `groups`, at most HISTORY_MAX_KEYS), or to
+// out[0] if keys is NULL
+void history_scan(const unsigned int* time, const double* amount, int lo, int hi, const unsigned char* keys, int groups,
+                  unsigned int from, unsigned int to, HistoryGroup* out) {
+    int i = lo;
+#ifdef __SSE2__
+    // Each group costs a pass over the two-double registers, so by four
+    // groups this is no faster than going row by row
+    switch (groups) {
+        case 1: i = history_scan_sse2(time, amount, lo, hi, keys, 1, from, to, out); break;
+        case 2: i = history_scan_sse2(time, amount, lo, hi, keys, 2, from, to, out); break;
+        case 3: i = history_scan_sse2(time, amount, lo, hi, keys, 3, from, to, out); break;
+    }
+#endif
+    history_scan_rows(time, amount, i, hi, keys, from, to, out);
+}
+
+// Adds `rows` rows to out as history_aggregate groups them. Their times
+// all lie in [min_time, max_time].
+static void history_scan_columns(HistoryDimension by, const unsigned int* time, const double* amount, const unsigned char* keys,
+                                 int rows, unsigned int min_time, unsigned int max_time, int groups,
+                                 unsigned int from, unsigned int to, unsigned int bucket, HistoryGroup* out) {
+    unsigned int first = from / bucket;
+    if (by != HISTORY_BY_TIME) {
+        history_scan(time, amount, 0, rows, keys, groups, from, to, out);
+    } else if (min_time / bucket == max_time / bucket) {
+        // All in one bucket, which the range overlaps
+        history_scan(time, amount, 0, rows, NULL, 1, from, to, &out[min_time / bucket - first]);
+    } else {
+        for (int i = 0; i < rows; i++) {
+            if (time[i] < from || time[i] >= to) continue;
+            HistoryGroup* g = &out[time[i] / bucket - first];
+            g->count++;
+            g->sum += amount[i];
+        }
+    }
+}
+
+// history_scan_columns over the blocks of segment s that overlap
+// [from, to), decoding them one at a time
+static void history_scan_segment(const HistorySegment* s, HistoryDimension by, int groups,
+                                 unsigned int from, unsigned int to, unsigned int bucket, HistoryGroup* out) {
+    unsigned int time[HISTORY_BLOCK];
+    double amount[HISTORY_BLOCK];
+    unsigned char keys[HISTORY_BLOCK];
+    int shift = by == HISTORY_BY_URGENCY ? 0 : (by == HISTORY_BY_TIER ? 2 : 4);
+    for (int b = 0; b < SEGMENT_BLOCKS; b++) {
+        const SegmentBlock* block = &s->header.blocks[b];
+        if (block->max_time < from || block->min_time >= to) continue;
+        int base = b * HISTORY_BLOCK;
+        for (int i = 0; i < HISTORY_BLOCK; i++) {
+            time[i] = (unsigned int)segment_value(s, SEG_TIME, base + i);
+            amount[i] = segment_amount(s, base + i);
+        }
+        if (by != HISTORY_BY_TIME) {
+            for (int i = 0; i < HISTORY_BLOCK; i++) keys[i] = (unsigned char)(segment_value(s, SEG_CLASSES, base + i) >> shift & 3);
+        }
+        history_scan_columns(by, time, amount, by != HISTORY_BY_TIME ? keys : NULL, HISTORY_BLOCK,
+                             block->min_time, block->max_time, groups, from, to, bucket, out);
+    }
+}
+
+// Totals of rows with a time in [from, to) into `out`, by tier,
+// urgency or status class, or by time in buckets of `bucket` seconds
+// (aligned to the Unix epoch; out[0] is the one holding `from`). Returns
+// the number of groups, or -1 for more than HISTORY_MAX_BUCKETS.
+int history_aggregate(HistoryDimension by, unsigned int from, unsigned int to, unsigned int bucket, HistoryGroup* out) {
+    int groups;
+    if (by == HISTORY_BY_TIER) groups = TIER_CLASSES;
+    else if (by == HISTORY_BY_URGENCY) groups = URGENCY_CLASSES;
+    else if (by == HISTORY_BY_STATUS) groups = 2;
+    else {
+        if (to <= from) return 0;
+        long long n = (long long)(to - 1) / bucket - from / bucket + 1;
+        if (n > HISTORY_MAX_BUCKETS) return -1;
+        groups = (int)n;
+    }
+    memset(out, 0, sizeof(HistoryGroup) * groups);
+    unsigned int first = from / bucket;
+
+    int count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+    pthread_rwlock_rdlock(&history_swap_lock);
+    for (int base = 0; base < count; base += HISTORY_CHUNK) {
+        HistorySegment* s = history.segments[base / HISTORY_CHUNK];
+        HistoryChunk* c = history.chunks[base / HISTORY_CHUNK];
+        const HistorySummary* sum = s ? &s->header.summary : &c->summary;
+        int rows = count - base < HISTORY_CHUNK ? count - base : HISTORY_CHUNK;
+        bool full = rows == HISTORY_CHUNK;
+        if (full && (sum->max_time < from || sum->min_time >= to)) continue;
+        bool inside = full && sum->min_time >= from && sum->max_time < to;
+
+        if (inside && by != HISTORY_BY_TIME) {
+            const HistoryGroup* totals = by == HISTORY_BY_TIER ? sum->by_tier : (by == HISTORY_BY_URGENCY ? sum->by_urgency : sum->by_status);
+            for (int g = 0; g < groups; g++) {
+                out[g].count += totals[g].count;
+                out[g].sum += totals[g].sum;
+            }
+        } else if (inside && sum->min_time / bucket == sum->max_time / bucket) {
+            HistoryGroup* g = &out[sum->min_time / bucket - first];
+            g->count += sum->by_status[0].count + sum->by_status[1].count;
+            g->sum += sum->by_status[0].sum + sum->by_status[1].sum;
+        } else if (s) {
+            history_scan_segment(s, by, groups, from, to, bucket, out);
+        } else {
+            const unsigned char* keys = by == HISTORY_BY_TIER ? c->tier : (by == HISTORY_BY_URGENCY ? c->urgency : c->status);
+            history_scan_columns(by, c->time, c->amount, by != HISTORY_BY_TIME ? keys : NULL, rows,
+                                 full ? sum->min_time : 0, full ? sum->max_time : UINT_MAX, groups, from, to, bucket, out);
+        }
+    }
+    pthread_rwlock_unlock(&history_swap_lock);
+    return groups;
+}
+
+// --- ARCHIVING ---
+// A thread writes each chunk to a segment once it is full, then swaps
+// the mapped segment in for it. A chunk is only archived once the log
+// entries that finished its transactions are on disk, so the archive
+// never holds an outcome recovery would not. If a segment can't be
+// written, archiving stops and the chunks stay in memory.
+
+void history_segment_path(int k, char* path) {
+    sprintf(path, "%s/%06d.seg", history.dir, k);
+}
+
+#ifndef _WIN32
+void* history_archiver(void* arg) {
+    (void)arg;
+    while (1) {
+        int k = history.archived;
+        pthread_mutex_lock(&archive_lock);
+        while (k >= __atomic_load_n(&history.count, __ATOMIC_ACQUIRE) / HISTORY_CHUNK) pthread_cond_wait(&archive_wake, &archive_lock);
+        pthread_mutex_unlock(&archive_lock);
+
+        pthread_mutex_lock(&state_lock); // Whatever finished its rows has been logged
+        long long lsn = wal_lsn();
+        pthread_mutex_unlock(&state_lock);
+        wal_wait_durable(lsn);
+
+        char path[600];
+        history_segment_path(k, path);
+        HistorySegment* s = segment_write(history.chunks[k], path) ? segment_map(path, false) : NULL;
+        if (!s) {
+            printf("Could not archive history to %s; keeping it in memory\n", path);
+            return NULL;
+        }
+        pthread_rwlock_wrlock(&history_swap_lock);
+        HistoryChunk* c = history.chunks[k];
+        history.segments[k] = s;
+        history.chunks[k] = NULL;
+        __atomic_store_n(&history.archived, k + 1, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&history_swap_lock);
+        history_chunk_free(c);
+    }
+    return NULL;
+}
+#endif
+
+// Maps the segments in <dir>/history, rebuilds the account heads from
+// them and archives there from now on. Call before recovery, which then
+// skips the transactions the archive already holds, until
+// history_recovered. Rows of the chunk that was still filling are lost,
+// unless the snapshot or log still has them.
+void history_open(const char* dir) {
+#ifndef _WIN32
+    snprintf(history.dir, sizeof(history.dir), "%s/history", dir);
+    make_dir(history.dir);
+    int k = 0;
+    char path[600];
+    for (; k < HISTORY_MAX_CHUNKS; k++) {
+        history_segment_path(k, path);
+        HistorySegment* s = segment_map(path, true);
+        if (!s) break;
+        history.segments[k] = s;
+        for (int i = 0; i < HISTORY_CHUNK; i++) {
+            int sender = (int)segment_value(s, SEG_SENDER, i), receiver = (int)segment_value(s, SEG_RECEIVER, i);
+            history_ensure_heads(sender > receiver ? sender : receiver);
+            history.sent_head[sender - FIRST_ACCOUNT_NUMBER] = k * HISTORY_CHUNK + i;
+            history.received_head[receiver - FIRST_ACCOUNT_NUMBER] = k * HISTORY_CHUNK + i;
+        }
+    }
+    history.archived = k;
+    history.count = k * HISTORY_CHUNK;
+    if (k > 0) printf("Mapped %d archived history rows\n", history.count);
+
+    int first = k - (HISTORY_RECOVERY_ROWS + HISTORY_CHUNK - 1) / HISTORY_CHUNK;
+    if (first < 0) first = 0;
+    if (first < k) {
+        history.recent_ids = (int*)malloc(sizeof(int) * (k - first) * HISTORY_CHUNK);
+        for (int j = first; j < k; j++) {
+            for (int i = 0; i < HISTORY_CHUNK; i++) history.recent_ids[history.recent_count++] = (int)segment_value(history.segments[j], SEG_ID, i);
+        }
+        qsort(history.recent_ids, history.recent_count, sizeof(int), history_compare_ids);
+    }
+
+    pthread_t archiver;
+    pthread_create(&archiver, NULL, history_archiver, NULL);
+    pthread_detach(archiver);
+#else
+    (void)dir;
+#endif
+}
+
+void history_recovered() {
+    free(history.recent_ids);
+    history.recent_ids = NULL;
+    history.recent_count = 0;
+}
@@ -0,0 +1,151 @@
+#include "structures.h"
+
+// --- HTTP/1.1 REQUEST PARSER ---
+// Works on whatever bytes have arrived so far. The caller keeps calling it
+// as more data comes in; nothing is copied out except method and path.
+
+#define HTTP_MAX_HEADER 8192
+#define HTTP_MAX_BODY (1024 * 1024)
+#define HTTP_MAX_UPLOAD (64 * 1024 * 1024) // POST /api/import
+
+typedef enum {
+    HTTP_INCOMPLETE = 0,
+    HTTP_COMPLETE = 1,
+    HTTP_BAD_REQUEST = -1,
+    HTTP_TOO_LARGE = -2
+} HttpParseResult;
+
+#define ACCEPT_GZIP 1
+#define ACCEPT_BR 2
+
+typedef struct {
+    char method[16];
+    char path[256];
+    char* body;      // Points into the connection buffer, not terminated
+    int body_len;
+    int total_len;   // Header + body bytes, i.e. how much to consume
+    bool keep_alive;
+    bool http10;     // No chunked encoding for these clients
+    int accept;      // ACCEPT_* encodings the client takes
+    char if_none_match[128]; // ETags the client has cached, as sent; "" if none
+} HttpRequest;
+
+// Case-insensitive prefix match for header names
+bool header_is(const char* line, const char* name) {
+    for (; *name; line++, name++) {
+        char c = *line;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != *name) return false;
+    }
+    return true;
+}
+
+// Finds the blank line ending the headers. `*scanned` remembers how far
+// previous calls got so a request arriving byte by byte stays linear.
+int find_header_end(const char* buf, int len, int* scanned) {
+    int i = *scanned > 3 ? *scanned - 3 : 0;
+    for (; i + 3 < len; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+            return i + 4;
+        }
+    }
+    *scanned = len;
+    return -1;
+}
+
+// Copies the value of `name` from a "a=1&b=2" query string
+bool query_param(const char* query, const char* name, char* out, int out_size) {
+    int name_len = (int)strlen(name);
+    const char* p = query;
+    while (p && *p) {
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            p += name_len + 1;
+            int n = 0;
+            while (p[n] && p[n] != '&' && n < out_size - 1) {
+                out[n] = p[n];
+                n++;
+            }
+            out[n] = 0;
+            return true;
+        }
+        p = strchr(p, '&');
+        if (p) p++;
+    }
+    return false;
+}
+
+// ACCEPT_* bits for an Accept-Encoding value; "gzip;q=0" refuses gzip
+int parse_accept_encoding(const char* v, const char* end) {
+    int accept = 0;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == ',')) v++;
+        const char* name = v;
+        while (v < end && *v != ',' && *v != ';' && *v != ' ') v++;
+        int len = (int)(v - name);
+        const char* params = v;
+        while (v < end && *v != ',') v++;
+        bool refused = false;
+        for (const char* q = params; q + 2 < v; q++) {
+            if (header_is(q, "q=")) refused = strtod(q + 2, NULL) == 0; // Stops at ',' or the line end
+        }
+        if (refused) continue;
+        if (len == 4 && header_is(name, "gzip")) accept |= ACCEPT_GZIP;
+        else if (len == 2 && header_is(name, "br")) accept |= ACCEPT_BR;
+    }
+    return accept;
+}
+
+HttpParseResult http_parse_request(char* buf, int len, int* scanned, HttpRequest* req) {
+    int header_len = find_header_end(buf, len, scanned);
+    if (header_len < 0) return len > HTTP_MAX_HEADER ? HTTP_TOO_LARGE : HTTP_INCOMPLETE;
+
+    // Request line: METHOD SP PATH SP VERSION
+    char version[16] = {0};
+    if (sscanf(buf, "%15s %255s %15s", req->method, req->path, version) != 3) return HTTP_BAD_REQUEST;
+    if (strncmp(version, "HTTP/1.", 7) != 0) return HTTP_BAD_REQUEST;
+
+    req->http10 = strcmp(version, "HTTP/1.0") == 0;
+    req->keep_alive = !req->http10; // 1.1 defaults to persistent
+    req->accept = 0;
+    req->if_none_match[0] = 0;
+    long content_length = 0;
+
+    char* line = strstr(buf, "\r\n") + 2;
+    char* end = buf + header_len - 2;
+    while (line < end) {
+        char* next = line;
+        while (next < end && *next != '\r') next++;
+
+        if (header_is(line, "content-length:")) {
+            content_length = strtol(line + 15, NULL, 10);
+            if (content_length < 0) return HTTP_BAD_REQUEST;
+        } else if (header_is(line, "connection:")) {
+            char* v = line + 11;
+            while (*v == ' ') v++;
+            if (header_is(v, "close")) req->keep_alive = false;
+            else if (header_is(v, "keep-alive")) req->keep_alive = true;
+        } else if (header_is(line, "accept-encoding:")) {
+            req->accept = parse_accept_encoding(line + 16, next);
+        } else if (header_is(line, "if-none-match:")) {
+            char* v = line + 14;
+            while (*v == ' ') v++;
+            int n = (int)(next - v);
+            if (n > (int)sizeof(req->if_none_match) - 1) n = sizeof(req->if_none_match) - 1;
+            memcpy(req->if_none_match, v, n);
+            req->if_none_match[n] = 0;
+        } else if (header_is(line, "transfer-encoding:")) {
+            return HTTP_BAD_REQUEST; // Chunked uploads are not supported
+        }
+        line = next + 2;
+    }
+
+    long max_body = (strncmp(req->path, "/api/import", 11) == 0) ? HTTP_MAX_UPLOAD : HTTP_MAX_BODY;
+    if (content_length > max_body) return HTTP_TOO_LARGE;
+    if (len < header_len + content_length) return HTTP_INCOMPLETE;
+
+    req->body = buf + header_len;
+    req->body_len = (int)content_length;
+    req->total_len = header_len + (int)content_length;
+    *scanned = 0;
+    return HTTP_COMPLETE;
+}
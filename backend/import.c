@@ -0,0 +1,255 @@
+#include "structures.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// --- BULK IMPORT ---
+// Batch files of transfers, either uploaded to POST /api/import or loaded
+// offline with `server --import <file>`. Two formats:
+//
+//   CSV:    sender,receiver,pin,amount[,urgency]
+//           One transfer per line; an optional header line (starting
+//           with a letter) and blank lines are skipped.
+//   Binary: "TXB1" followed by ImportRecord structs (little-endian,
+//           24 bytes each, no padding).
+//
+// Each row is checked exactly as POST /api/transaction would check it,
+// and rejected rows are reported by line (or record) number. Rows are
+// handed to import_transactions IMPORT_CHUNK at a time, so other
+// requests get state_lock in between.
+
+#define IMPORT_CHUNK 65536
+#define IMPORT_MAX_ERRORS 1000      // Listed in a response; the rest are only counted
+#define IMPORT_MAGIC "TXB1"
+
+typedef struct {
+    int sender;
+    int receiver;
+    int pin;
+    int urgency;
+    double amount;
+} ImportRecord;
+
+const char* tx_error_message(int code) {
+    switch (code) {
+        case 1: return "Invalid Sender";
+        case 2: return "Receiver Not Found";
+        case 3: return "Wrong PIN";
+        case 4: return "Insufficient Funds";
+        case 5: return "Transaction Store Full";
+        case ADMIT_RATE_LIMITED: return "Rate Limited";
+        case ADMIT_OVERLOADED: return "Overloaded";
+        case IMPORT_MALFORMED: return "Malformed Row";
+        case TX_INVALID_AMOUNT: return "Invalid Amount";
+        default: return "Unknown Error";
+    }
+}
+
+// Field parsers for one CSV line: each skips surrounding spaces and the
+// comma after the field, and fails on anything else
+
+const char* csv_skip_spaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p;
+}
+
+const char* csv_end_field(const char* p, const char* end, bool last) {
+    p = csv_skip_spaces(p, end);
+    if (p == end) return p;
+    if (*p != ',' || last) return NULL;
+    return p + 1;
+}
+
+const char* csv_int(const char* p, const char* end, int* out) {
+    p = csv_skip_spaces(p, end);
+    long long v = 0;
+    const char* start = p;
+    while (p < end && *p >= '0' && *p <= '9' && p - start < 10) v = v * 10 + (*p++ - '0');
+    if (p == start || v > 2147483647LL) return NULL;
+    *out = (int)v;
+    return p;
+}
+
+// Plain decimals only ("123", "99.5"); the mantissa is an exact integer,
+// so dividing once by a power of ten rounds correctly. Zero parses, and
+// is turned down by admit_start like any other amount it won't take.
+const char* csv_amount(const char* p, const char* end, double* out) {
+    static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+                                    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    p = csv_skip_spaces(p, end);
+    long long mantissa = 0;
+    int digits = 0, decimals = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) mantissa = mantissa * 10 + (*p - '0');
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, decimals++) mantissa = mantissa * 10 + (*p - '0');
+    }
+    if (digits == 0 || digits > 18) return NULL;
+    *out = (double)mantissa / pow10[decimals];
+    return p;
+}
+
+void import_grow(ImportRow** rows, int* cap, int need) {
+    if (need <= *cap) return;
+    while (*cap < need) *cap = *cap ? *cap * 2 : 4096;
+    *rows = (ImportRow*)realloc(*rows, sizeof(ImportRow) * *cap);
+}
+
+int import_parse_csv(const char* buf, size_t len, ImportRow** out) {
+    ImportRow* rows = NULL;
+    int count = 0, cap = 0;
+    const char* end = buf + len;
+    int line = 0;
+
+    for (const char* p = buf; p < end;) {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        const char* stop = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+        const char* q = csv_skip_spaces(p, stop);
+        line++;
+
+        bool header = line == 1 && q < stop && ((*q | 0x20) >= 'a' && (*q | 0x20) <= 'z');
+        if (q < stop && !header) {
+            import_grow(&rows, &cap, count + 1);
+            ImportRow* r = &rows[count++];
+            memset(r, 0, sizeof(*r));
+            r->line = line;
+
+            q = csv_int(q, stop, &r->sender);
+            if (q) q = csv_end_field(q, stop, false);
+            if (q) q = csv_int(q, stop, &r->receiver);
+            if (q) q = csv_end_field(q, stop, false);
+            if (q) q = csv_int(q, stop, &r->pin);
+            if (q) q = csv_end_field(q, stop, false);
+            if (q) q = csv_amount(q, stop, &r->amount);
+            if (q) q = csv_end_field(q, stop, false);
+            if (q && q < stop) {
+                q = csv_int(q, stop, &r->urgency);
+                if (q) q = csv_end_field(q, stop, true);
+            }
+            if (!q || q != stop) r->error = IMPORT_MALFORMED;
+        }
+        p = eol + 1;
+    }
+    *out = rows;
+    return count;
+}
+
+// -1 if the length doesn't match whole records
+int import_parse_binary(const char* buf, size_t len, ImportRow** out) {
+    size_t body = len - 4;
+    if (body % sizeof(ImportRecord) != 0 || body / sizeof(ImportRecord) > INT_MAX) return -1;
+    int count = (int)(body / sizeof(ImportRecord));
+    ImportRow* rows = (ImportRow*)malloc(sizeof(ImportRow) * (count > 0 ? count : 1));
+
+    const char* p = buf + 4;
+    for (int i = 0; i < count; i++, p += sizeof(ImportRecord)) {
+        ImportRecord rec;
+        memcpy(&rec, p, sizeof(rec)); // Uploads needn't be aligned
+        ImportRow* r = &rows[i];
+        r->sender = rec.sender;
+        r->receiver = rec.receiver;
+        r->pin = rec.pin;
+        r->urgency = rec.urgency;
+        r->amount = rec.amount;
+        r->line = i + 1;
+        r->error = 0;
+    }
+    *out = rows;
+    return count;
+}
+
+// Rows parsed from either format into a new array; -1 if malformed as a whole
+int import_parse(const char* buf, size_t len, ImportRow** out) {
+    *out = NULL;
+    if (len >= 4 && memcmp(buf, IMPORT_MAGIC, 4) == 0) return import_parse_binary(buf, len, out);
+    return import_parse_csv(buf, len, out);
+}
+
+// Read-only view of a whole file; mapped where mmap exists
+const char* map_file(const char* path, size_t* len) {
+#ifdef _WIN32
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = (char*)malloc(size > 0 ? size : 1);
+    *len = fread(data, 1, size, f);
+    fclose(f);
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    *len = (size_t)st.st_size;
+    if (*len == 0) {
+        close(fd);
+        return "";
+    }
+    void* data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    madvise(data, *len, MADV_SEQUENTIAL);
+    return (const char*)data;
+#endif
+}
+
+void unmap_file(const char* data, size_t len) {
+#ifdef _WIN32
+    (void)len;
+    free((void*)data);
+#else
+    if (len > 0) munmap((void*)data, len);
+#endif
+}
+
+// Offline loader: imports a file into the recovered state, printing the
+// summary and rejected rows. Logging is off while it runs; the caller
+// writes one snapshot at the end instead. Returns the exit code.
+int import_file(const char* path) {
+    size_t len;
+    const char* data = map_file(path, &len);
+    if (!data) {
+        printf("%s: cannot read\n", path);
+        return 1;
+    }
+
+    double t0 = now_ms();
+    ImportRow* rows;
+    int n = import_parse(data, len, &rows);
+    if (n < 0) {
+        printf("%s: not a whole number of binary records\n", path);
+        unmap_file(data, len);
+        return 1;
+    }
+
+    ImportError* errors = (ImportError*)malloc(sizeof(ImportError) * IMPORT_MAX_ERRORS);
+    ImportSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    for (int off = 0; off < n; off += IMPORT_CHUNK) {
+        pthread_mutex_lock(&state_lock);
+        import_transactions(rows + off, (n - off < IMPORT_CHUNK) ? n - off : IMPORT_CHUNK, errors, IMPORT_MAX_ERRORS, &summary);
+        pthread_mutex_unlock(&state_lock);
+    }
+    double ms = now_ms() - t0;
+
+    int listed = summary.rejected < IMPORT_MAX_ERRORS ? summary.rejected : IMPORT_MAX_ERRORS;
+    for (int i = 0; i < listed; i++) printf("%s:%d: %s\n", path, errors[i].line, tx_error_message(errors[i].code));
+    if (listed < summary.rejected) printf("... and %d more rejected rows\n", summary.rejected - listed);
+    printf("%s: %d rows, %d accepted (%d time-locked), %d rejected in %.1f ms (%.0f rows/s)",
+        path, summary.rows, summary.accepted, summary.locked, summary.rejected, ms, ms > 0 ? summary.rows / (ms / 1000.0) : 0.0);
+    if (summary.accepted > 0) printf(", ids %d-%d", summary.first_id, summary.last_id);
+    printf("\n");
+
+    free(errors);
+    free(rows);
+    unmap_file(data, len);
+    return 0;
+}
@@ -0,0 +1,323 @@
+#include "structures.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// --- JSON REQUEST BODIES ---
+// One pass over a request body: each top-level key is matched against the
+// handler's field table and its value is parsed straight into the bound
+// variable. Nothing is copied except string values, which are unescaped
+// into their destination. Unknown keys (nested values included) are
+// checked and skipped. A body that isn't one well-formed JSON object, or
+// a bound field of the wrong type, fails the whole parse.
+
+#define JSON_MAX_DEPTH 32
+
+typedef enum {
+    JSON_INT,       // int, whole numbers only
+    JSON_NUMBER,    // double
+    JSON_STRING     // char[size], truncated to fit
+} JsonType;
+
+typedef struct {
+    const char* key;
+    JsonType type;
+    void* out;
+    int size;       // JSON_STRING only
+} JsonField;
+
+// Every member spelled out, so field tables build clean under -Wextra
+#define JSON_FIELD(key, type, out) { (key), (type), (out), 0 }
+#define JSON_STRING_FIELD(key, buf) { (key), JSON_STRING, (buf), (int)sizeof(buf) }
+
+static inline const char* json_ws(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+// First byte at or after p that is '"', '\\' or a control character;
+// `end` if none. Sixteen bytes at a time where SSE2 is available.
+static inline const char* json_string_special(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                   _mm_cmpeq_epi8(_mm_max_epu8(v, control), control)); // v <= 0x1F
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+    return p;
+}
+
+int json_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// p is just past the opening quote. Returns the position after the
+// closing quote, or NULL. With `out`, also writes the unescaped value
+// (UTF-8, NUL-terminated). A value longer than `size` is cut at the last
+// whole character that fits.
+const char* json_string(const char* p, const char* end, char* out, int size) {
+    int len = 0;
+    while (1) {
+        const char* q = json_string_special(p, end);
+        if (out && len < size - 1) {
+            int n = (int)(q - p);
+            if (n > size - 1 - len) {
+                n = size - 1 - len;
+                while (n > 0 && ((unsigned char)p[n] & 0xC0) == 0x80) n--; // Mid-character
+                size = len + n + 1; // Full: nothing more is written
+            }
+            memcpy(out + len, p, n);
+            len += n;
+        }
+        if (q == end || (unsigned char)*q < 0x20) return NULL;
+        if (*q == '"') {
+            if (out) out[len] = 0;
+            return q + 1;
+        }
+
+        // Escape sequence
+        if (end - q < 2) return NULL;
+        char c = q[1];
+        p = q + 2;
+        unsigned int cp;
+        switch (c) {
+            case '"': case '\\': case '/': cp = (unsigned char)c; break;
+            case 'b': cp = '\b'; break;
+            case 'f': cp = '\f'; break;
+            case 'n': cp = '\n'; break;
+            case 'r': cp = '\r'; break;
+            case 't': cp = '\t'; break;
+            case 'u': {
+                if (end - p < 4) return NULL;
+                cp = 0;
+                for (int i = 0; i < 4; i++) {
+                    int h = json_hex(p[i]);
+                    if (h < 0) return NULL;
+                    cp = cp * 16 + h;
+                }
+                p += 4;
+                // A surrogate pair is two escapes; a lone half becomes U+FFFD
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    unsigned int lo = 0;
+                    int i = 0;
+                    for (; i < 4 && json_hex(p[2 + i]) >= 0; i++) lo = lo * 16 + json_hex(p[2 + i]);
+                    if (i == 4 && lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                }
+                if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+                break;
+            }
+            default: return NULL;
+        }
+        if (!out) continue;
+
+        char utf8[4];
+        int n;
+        if (cp < 0x80) { utf8[0] = (char)cp; n = 1; }
+        else if (cp < 0x800) { utf8[0] = (char)(0xC0 | (cp >> 6)); utf8[1] = (char)(0x80 | (cp & 0x3F)); n = 2; }
+        else if (cp < 0x10000) {
+            utf8[0] = (char)(0xE0 | (cp >> 12)); utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            utf8[2] = (char)(0x80 | (cp & 0x3F)); n = 3;
+        } else {
+            utf8[0] = (char)(0xF0 | (cp >> 18)); utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F)); utf8[3] = (char)(0x80 | (cp & 0x3F)); n = 4;
+        }
+        if (len + n <= size - 1) {
+            memcpy(out + len, utf8, n);
+            len += n;
+        } else {
+            size = len + 1; // Full: the rest is only checked
+        }
+    }
+}
+
+// End of the number starting at p, or NULL if it isn't one. `whole` is
+// set when it has no fraction or exponent.
+static inline const char* json_number(const char* p, const char* end, bool* whole) {
+    *whole = true;
+    if (p < end && *p == '-') p++;
+    if (p == end) return NULL;
+    if (*p == '0') p++;
+    else if (*p >= '1' && *p <= '9') while (p < end && *p >= '0' && *p <= '9') p++;
+    else return NULL;
+    if (p < end && *p == '.') {
+        *whole = false;
+        p++;
+        if (p == end || *p < '0' || *p > '9') return NULL;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        *whole = false;
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (p == end || *p < '0' || *p > '9') return NULL;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    return p;
+}
+
+const char* json_literal(const char* p, const char* end, const char* word, int len) {
+    if (end - p < len || memcmp(p, word, len) != 0) return NULL;
+    return p + len;
+}
+
+// Checks and skips any value; returns the position after it or NULL
+const char* json_skip(const char* p, const char* end, int depth) {
+    if (p == end || depth > JSON_MAX_DEPTH) return NULL;
+    bool whole;
+    switch (*p) {
+        case '"': return json_string(p + 1, end, NULL, 0);
+        case 't': return json_literal(p, end, "true", 4);
+        case 'f': return json_literal(p, end, "false", 5);
+        case 'n': return json_literal(p, end, "null", 4);
+        case '[': {
+            p = json_ws(p + 1, end);
+            if (p < end && *p == ']') return p + 1;
+            while (1) {
+                p = json_skip(p, end, depth + 1);
+                if (!p) return NULL;
+                p = json_ws(p, end);
+                if (p == end) return NULL;
+                if (*p == ']') return p + 1;
+                if (*p != ',') return NULL;
+                p = json_ws(p + 1, end);
+            }
+        }
+        case '{': {
+            p = json_ws(p + 1, end);
+            if (p < end && *p == '}') return p + 1;
+            while (1) {
+                if (p == end || *p != '"') return NULL;
+                p = json_string(p + 1, end, NULL, 0);
+                if (!p) return NULL;
+                p = json_ws(p, end);
+                if (p == end || *p != ':') return NULL;
+                p = json_skip(json_ws(p + 1, end), end, depth + 1);
+                if (!p) return NULL;
+                p = json_ws(p, end);
+                if (p == end) return NULL;
+                if (*p == '}') return p + 1;
+                if (*p != ',') return NULL;
+                p = json_ws(p + 1, end);
+            }
+        }
+        default: return json_number(p, end, &whole);
+    }
+}
+
+// Parses a value into its bound field; NULL on a type mismatch. null
+// leaves the field as it was, like a missing key (JSON.stringify(NaN)
+// sends null).
+static inline const char* json_bind_value(const char* p, const char* end, JsonField* f) {
+    if (p < end && *p == 'n') return json_literal(p, end, "null", 4);
+    if (f->type == JSON_STRING) {
+        if (p == end || *p != '"') return NULL;
+        return json_string(p + 1, end, (char*)f->out, f->size);
+    }
+
+    bool whole;
+    const char* q = json_number(p, end, &whole);
+    if (!q) return NULL;
+    if (f->type == JSON_NUMBER) {
+        // Up to 15 digits with no exponent: the digits are an exact
+        // integer and so is the power of ten, so one division rounds
+        // correctly, the same as strtod
+        static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+        long long mantissa = 0;
+        int digits = 0, decimals = -1;
+        const char* d = (*p == '-') ? p + 1 : p;
+        for (; d < q && digits <= 15; d++) {
+            if (*d == '.') decimals = 0;
+            else if (*d >= '0' && *d <= '9') {
+                mantissa = mantissa * 10 + (*d - '0');
+                digits++;
+                if (decimals >= 0) decimals++;
+            }
+            else break;
+        }
+        if (d == q && digits <= 15) {
+            double v = (double)mantissa / pow10[decimals > 0 ? decimals : 0];
+            *(double*)f->out = (*p == '-') ? -v : v;
+            return q;
+        }
+
+        // The number grammar already stopped at q, and strtod reads no further
+        char tmp[64];
+        int n = (int)(q - p);
+        if (n >= (int)sizeof(tmp)) return NULL;
+        memcpy(tmp, p, n);
+        tmp[n] = 0;
+        *(double*)f->out = strtod(tmp, NULL);
+        return q;
+    }
+
+    if (!whole) return NULL;
+    bool negative = *p == '-';
+    long long v = 0;
+    for (const char* d = negative ? p + 1 : p; d < q; d++) {
+        v = v * 10 + (*d - '0');
+        if (v > 2147483648LL) return NULL;
+    }
+    if (negative) v = -v;
+    if (v > 2147483647LL) return NULL;
+    *(int*)f->out = (int)v;
+    return q;
+}
+
+// Keys hold no NUL, so a shorter field name stops the loop at its own end
+static inline bool json_key_is(const char* name, const char* key, int key_len) {
+    int i = 0;
+    for (; i < key_len; i++) {
+        if (name[i] != key[i]) return false;
+    }
+    return name[i] == 0;
+}
+
+// Fills the fields found in `body` (len bytes); fields it doesn't mention
+// keep their values. An empty body counts as {}. False if the body is
+// malformed or a field has the wrong type.
+bool json_parse(const char* body, int len, JsonField* fields, int field_count) {
+    const char* end = body + len;
+    const char* p = json_ws(body, end);
+    if (p == end) return true;
+    if (*p != '{') return false;
+
+    p = json_ws(p + 1, end);
+    if (p < end && *p == '}') return json_ws(p + 1, end) == end;
+    while (1) {
+        if (p == end || *p != '"') return false;
+        const char* key = p + 1;
+        p = json_string(key, end, NULL, 0);
+        if (!p) return false;
+        int key_len = (int)(p - 1 - key); // Escaped keys never match a field
+        p = json_ws(p, end);
+        if (p == end || *p != ':') return false;
+        p = json_ws(p + 1, end);
+
+        JsonField* f = NULL;
+        for (int i = 0; i < field_count && !f; i++) {
+            if (json_key_is(fields[i].key, key, key_len)) f = &fields[i];
+        }
+        p = f ? json_bind_value(p, end, f) : json_skip(p, end, 1);
+        if (!p) return false;
+
+        p = json_ws(p, end);
+        if (p == end) return false;
+        if (*p == '}') return json_ws(p + 1, end) == end;
+        if (*p != ',') return false;
+        p = json_ws(p + 1, end);
+    }
+}
@@ -1,44 +1,329 @@
 #include "structures.h"
+#include <pthread.h>
 #include "heap.c" 
+#include "arena.c"
+#include "timerwheel.c"
+#include "metrics.c"
+#include "risk.c"
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/timerfd.h>
+#endif
 
 GlobalState state;
 int id_counter = 1000;
-int account_counter = 50000; // Start account numbers from 50000
+int account_counter = FIRST_ACCOUNT_NUMBER;
+
+// Engine time: the wall clock, unless a simulation (see bench.c) has set
+// virtual_clock and is moving it forward itself
+long long virtual_clock = 0;
+
+time_t engine_now() {
+    return virtual_clock ? (time_t)virtual_clock : time(NULL);
+}
+
+// --- CHANGE TRACKING ---
+
+// Called (under state_lock) after every change; the server uses it to
+// wake event-stream subscribers
+void (*on_state_change)(void) = NULL;
+
+long long record_change(ChangeKind kind, int id) {
+    long long v = ++state.version;
+    ChangeEntry* e = &state.changes.entries[(v - 1) % CHANGELOG_SIZE];
+    e->kind = kind;
+    e->id = id;
+    if (on_state_change) on_state_change();
+    return v;
+}
+
+void mark_tx_changed(Transaction* t) {
+    t->version = record_change(CHANGE_TX, t->id);
+}
+
+void mark_customer_changed(Customer* c) {
+    c->version = record_change(CHANGE_CUSTOMER, c->account_number);
+}
+
+// Oldest version still in the ring; deltas from before it need a full reload
+long long oldest_change() {
+    long long oldest = state.version - CHANGELOG_SIZE + 1;
+    return oldest < 1 ? 1 : oldest;
+}
+
+// Serializes everything that reads or changes the state
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copies for readers holding only state_lock (snapshots, the WAL, /api/state).
+// Shard threads move heap_index and `available` under their own lock, so
+// those are left out; recovery rebuilds both anyway.
+Transaction published_transaction(const Transaction* t) {
+    Transaction c;
+    memset(&c, 0, sizeof(c));
+    c.id = t->id;
+    c.sender_id = t->sender_id;
+    c.receiver_id = t->receiver_id;
+    c.amount = t->amount;
+    c.urgency = t->urgency;
+    c.tier = t->tier;
+    c.risk_score = t->risk_score;
+    c.arrival_time = t->arrival_time;
+    c.unlock_time = t->unlock_time;
+    c.base_priority = t->base_priority;
+    c.priority_key = t->priority_key;
+    c.status = t->status;
+    c.heap_index = -1;
+    c.version = t->version;
+    return c;
+}
+
+Customer published_customer(const Customer* c) {
+    Customer p;
+    memset(&p, 0, sizeof(p));
+    p.account_number = c->account_number;
+    memcpy(p.name, c->name, sizeof(p.name));
+    p.pin = c->pin;
+    p.balance = c->balance;
+    p.available = c->balance;
+    p.tier = c->tier;
+    p.version = c->version;
+    return p;
+}
+
+#include "wal.c"
+
+// --- TRANSACTION INDEX ---
+// Linear probing over a power-of-two table, kept at most half full.
+
+unsigned int hash_id(int id) {
+    return (unsigned int)id * 2654435761u; // Knuth multiplicative hash
+}
+
+void tx_index_init(TxIndex* idx, int capacity) {
+    idx->slots = (Transaction**)calloc(capacity, sizeof(Transaction*));
+    idx->capacity = capacity;
+    idx->count = 0;
+}
+
+void tx_index_insert(TxIndex* idx, Transaction* t);
+
+void tx_index_grow(TxIndex* idx) {
+    Transaction** old = idx->slots;
+    int old_capacity = idx->capacity;
+    tx_index_init(idx, old_capacity * 2);
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i]) tx_index_insert(idx, old[i]);
+    }
+    free(old);
+}
+
+void tx_index_insert(TxIndex* idx, Transaction* t) {
+    if ((idx->count + 1) * 2 > idx->capacity) tx_index_grow(idx);
+    unsigned int mask = idx->capacity - 1;
+    unsigned int i = hash_id(t->id) & mask;
+    while (idx->slots[i]) i = (i + 1) & mask;
+    idx->slots[i] = t;
+    idx->count++;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+void tx_index_remove(TxIndex* idx, Transaction* t) {
+    unsigned int mask = idx->capacity - 1;
+    unsigned int i = hash_id(t->id) & mask;
+    while (idx->slots[i] && idx->slots[i] != t) i = (i + 1) & mask;
+    if (!idx->slots[i]) return;
+
+    unsigned int j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!idx->slots[j]) break;
+        unsigned int home = hash_id(idx->slots[j]->id) & mask;
+        // Move j back into the hole unless its home lies in (i, j]
+        bool stays = (i < j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            idx->slots[i] = idx->slots[j];
+            i = j;
+        }
+    }
+    idx->slots[i] = NULL;
+    idx->count--;
+}
+
+Transaction* find_transaction(int id) {
+    TxIndex* idx = &state.tx_index;
+    unsigned int mask = idx->capacity - 1;
+    for (unsigned int i = hash_id(id) & mask; idx->slots[i]; i = (i + 1) & mask) {
+        if (idx->slots[i]->id == id) return idx->slots[i];
+    }
+    return NULL;
+}
+
+void init_shards(int count);
 
 void init_state() {
+    arena_init(&state.transactions, sizeof(Transaction));
     state.tx_count = 0;
-    state.customer_count = 0;
+    state.free_list = NULL;
+    state.finished_head = state.finished_tail = NULL;
+    state.finished_count = 0;
+    state.epoch = (long long)time(NULL);
+    state.version = 0;
+    arena_init(&state.customers, sizeof(Customer));
     state.processed_count = 0;
     state.cancelled_count = 0;
     state.total_wait_time = 0;
     
-    state.priority_queue = create_heap(MAX_TRANSACTIONS, compare_priority);
-    state.time_lock_queue = create_heap(MAX_TRANSACTIONS, compare_timelock);
+    init_shards(1);
+    wheel_init(&state.time_locks, (long long)engine_now());
+    tx_index_init(&state.tx_index, 1024);
 
     // Default Admin? No, admin role is separate from customers. 
     // Maybe seed one demo customer
 }
 
 Customer* create_customer(const char* name, int pin, int tier, double initial_balance) {
-    if (state.customer_count >= MAX_CUSTOMERS) return NULL;
+    Customer* c = (Customer*)arena_alloc(&state.customers);
+    if (!c) return NULL;
     
-    Customer* c = &state.all_customers[state.customer_count++];
     c->account_number = account_counter++; // Simple Sequential
     strncpy(c->name, name, 49);
     c->pin = pin;
     c->tier = (CustomerTier)tier;
     c->balance = initial_balance;
+    c->available = initial_balance;
+    mark_customer_changed(c);
+    wal_log_customer(c);
     
     return c;
 }
 
+// Account numbers are handed out sequentially and customers are never
+// removed, so the account number maps directly to its slot - O(1).
 Customer* find_customer(int acc_no) {
-    for(int i=0; i<state.customer_count; i++) {
-        if (state.all_customers[i].account_number == acc_no) {
-            return &state.all_customers[i];
-        }
+    int i = acc_no - FIRST_ACCOUNT_NUMBER;
+    if (i < 0 || i >= state.customers.count) return NULL;
+    return (Customer*)arena_at(&state.customers, i);
+}
+
+// For shard workers, which only see accounts that transactions refer to
+// and so never need the bounds check (or state.customers.count)
+Customer* customer_at(int acc_no) {
+    return (Customer*)arena_at(&state.customers, acc_no - FIRST_ACCOUNT_NUMBER);
+}
+
+// Slot-order access for listings; may return a STATUS_FREE slot
+Transaction* transaction_at(int slot) {
+    return (Transaction*)arena_at(&state.transactions, slot);
+}
+
+Transaction* alloc_transaction() {
+    Transaction* t = state.free_list;
+    if (t) {
+        state.free_list = t->next;
+        memset(t, 0, sizeof(Transaction)); // Recycled slots carry old fields
+    } else {
+        t = (Transaction*)arena_alloc(&state.transactions);
     }
-    return NULL;
+    if (t) state.tx_count++;
+    return t;
+}
+
+#include "history.c"
+
+// Called once a transaction becomes DONE or CANCELLED. It is copied into
+// the history store, and stays visible here until MAX_FINISHED_HISTORY
+// newer ones have finished, then its slot is reused, so memory tracks
+// pending work plus a bounded history.
+void retire_transaction(Transaction* t) {
+    history_append(t);
+    t->next = NULL;
+    if (state.finished_tail) state.finished_tail->next = t;
+    else state.finished_head = t;
+    state.finished_tail = t;
+    state.finished_count++;
+
+    while (state.finished_count > MAX_FINISHED_HISTORY) {
+        Transaction* old = state.finished_head;
+        state.finished_head = old->next;
+        if (!state.finished_head) state.finished_tail = NULL;
+        state.finished_count--;
+
+        tx_index_remove(&state.tx_index, old);
+        record_change(CHANGE_TX_REMOVED, old->id);
+        old->status = STATUS_FREE;
+        old->next = state.free_list;
+        state.free_list = old;
+        state.tx_count--;
+    }
+}
+
+// --- SHARDS ---
+// Waiting transactions are queued on their sender's shard. Settling one
+// happens in two steps:
+//  1. shard_take, under that shard's lock only: pop in priority order and
+//     decide each against the sender's `available` balance. Shards do this
+//     in parallel; a sender's transactions are always decided in order.
+//  2. publish_settlements, under state_lock: apply the outcomes to the
+//     published balances, history, change log and WAL.
+// The receiver's credit goes through its shard's inbox only after step 2,
+// even on the same shard: money is never spendable before the transfer
+// that brought it is published and logged. So `available` never exceeds
+// `balance`, and since neither goes below zero, the order in which two
+// threads publish batches from one shard doesn't matter.
+
+void init_shards(int count) {
+    if (count < 1) count = 1;
+    if (count > MAX_SHARDS) count = MAX_SHARDS;
+    for (int i = 0; i < state.shard_count; i++) {
+        free(state.shards[i].queue->data);
+        free(state.shards[i].queue);
+        free(state.shards[i].inbox);
+    }
+    for (int i = 0; i < count; i++) {
+        Shard* s = &state.shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->queue = create_heap(1024);
+        s->inbox = NULL;
+        s->inbox_len = s->inbox_cap = 0;
+    }
+    state.shard_count = count;
+}
+
+Shard* shard_for(int acc_no) {
+    return &state.shards[acc_no % state.shard_count];
+}
+
+void enqueue_waiting(Transaction* t) {
+    Shard* s = shard_for(t->sender_id);
+    pthread_mutex_lock(&s->lock);
+    heap_push(s->queue, t);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// False if its shard has already taken it for settling
+bool dequeue_waiting(Transaction* t) {
+    Shard* s = shard_for(t->sender_id);
+    pthread_mutex_lock(&s->lock);
+    bool queued = t->heap_index >= 0;
+    if (queued) heap_remove(s->queue, t);
+    pthread_mutex_unlock(&s->lock);
+    return queued;
+}
+
+int waiting_count() {
+    int n = 0;
+    for (int i = 0; i < state.shard_count; i++) {
+        pthread_mutex_lock(&state.shards[i].lock);
+        n += state.shards[i].queue->size;
+        pthread_mutex_unlock(&state.shards[i].lock);
+    }
+    return n;
+}
+
+// Priority after aging, computed only when someone looks at it
+double effective_priority(Transaction* t, time_t now) {
+    if (t->status != STATUS_WAITING) return t->base_priority;
+    return t->priority_key + (double)now * AGING_FACTOR;
 }
 
 double calculate_base_priority(Transaction* t) {
@@ -49,9 +334,11 @@ double calculate_base_priority(Transaction* t) {
     return p;
 }
 
-// Returns: 0=Success, 1=InvalidSender, 2=InvalidReceiver, 3=AuthFail, 4=InsufficientFunds, 5=Full
-int create_transaction(int sender_id, int receiver_id, int pin, double amount, int urgency_lvl) {
-    if (state.tx_count >= MAX_TRANSACTIONS) return 5;
+// Validates and fills in a new transaction, adding its risk features to
+// `batch`. It isn't live until admit_finish gives it its score. Same
+// result codes as create_transaction.
+int admit_start(int sender_id, int receiver_id, int pin, double amount, int urgency_lvl, RiskBatch* batch, Transaction** out) {
+    if (!(amount > 0)) return TX_INVALID_AMOUNT; // NaN fails too
 
     Customer* sender = find_customer(sender_id);
     if (!sender) return 1;
@@ -63,117 +350,418 @@ int create_transaction(int sender_id, int receiver_id, int pin, double amount, i
     if (sender->balance < amount) return 4;
 
     // Create Transaction
-    Transaction* t = &state.all_transactions[state.tx_count++];
+    Transaction* t = alloc_transaction();
+    if (!t) return 5;
     t->id = id_counter++;
     t->sender_id = sender_id;
     t->receiver_id = receiver_id;
     t->amount = amount;
     t->urgency = (UrgencyLevel)urgency_lvl;
     t->tier = sender->tier; // Inherit tier from sender
-    t->risk_score = 0; // Default
-    t->arrival_time = time(NULL);
-    t->base_priority = calculate_base_priority(t);
-    t->effective_priority = t->base_priority;
+    t->arrival_time = engine_now();
     t->status = STATUS_WAITING;
+    t->heap_index = -1;
+    risk_observe(batch, sender_id, receiver_id, amount, t->arrival_time);
+
+    *out = t;
+    return 0;
+}
+
+// Prioritizes, indexes and logs a transaction from admit_start,
+// time-locking it if it is large. A waiting one is left for the caller
+// to queue.
+void admit_finish(Transaction* t, int risk_score) {
+    t->risk_score = risk_score;
+    t->base_priority = calculate_base_priority(t);
+    t->priority_key = t->base_priority - (double)t->arrival_time * AGING_FACTOR;
+    tx_index_insert(&state.tx_index, t);
 
     // Logic: Time Lock if High Value
     if (t->amount >= TIME_LOCK_THRESHOLD) {
         t->status = STATUS_LOCKED;
         t->unlock_time = t->arrival_time + TIME_LOCK_DURATION;
-        heap_push(state.time_lock_queue, t);
-    } else {
-        heap_push(state.priority_queue, t);
+        wheel_insert(&state.time_locks, t);
     }
+    mark_tx_changed(t);
+    wal_log_transaction(t);
+}
+
+// One transaction, scored as a batch of one
+int admit_transaction(int sender_id, int receiver_id, int pin, double amount, int urgency_lvl, Transaction** out) {
+    RiskBatch batch;
+    batch.n = 0;
+    int res = admit_start(sender_id, receiver_id, pin, amount, urgency_lvl, &batch, out);
+    if (res != 0) return res;
+    risk_score_batch(&batch);
+    admit_finish(*out, batch.score[0]);
+    return 0;
+}
 
+// Returns: 0=Success, 1=InvalidSender, 2=InvalidReceiver, 3=AuthFail, 4=InsufficientFunds, 5=Full,
+// TX_INVALID_AMOUNT
+int create_transaction(int sender_id, int receiver_id, int pin, double amount, int urgency_lvl) {
+    Transaction* t;
+    int res = admit_transaction(sender_id, receiver_id, pin, amount, urgency_lvl, &t);
+    if (res != 0) return res;
+    if (t->status == STATUS_WAITING) enqueue_waiting(t);
     return 0; // OK
 }
 
-void update_system_state() {
-    time_t now = time(NULL);
+#include "admission.c"
 
-    // 1. Time Lock -> PQ
-    while (state.time_lock_queue->size > 0) {
-        Transaction* top = heap_peek(state.time_lock_queue);
-        if (top->unlock_time <= now) {
-            heap_pop(state.time_lock_queue); 
-            if (top->status != STATUS_CANCELLED) {
-                top->status = STATUS_WAITING;
-                heap_push(state.priority_queue, top); 
+// Creates a batch of rows exactly as create_transaction would one by
+// one, but queues them per shard: each shard's new entries go in under
+// one lock hold, heapified together. Rows the parser already rejected
+// (error != 0) are reported as they are. Per-row failures go to
+// `errors` (room for `max_errors`); out->rejected counts all of them.
+// Caller holds state_lock.
+void import_transactions(ImportRow* rows, int n, ImportError* errors, int max_errors, ImportSummary* out) {
+    Transaction** queued = (Transaction**)malloc(sizeof(Transaction*) * (n > 0 ? n : 1));
+    int* per_shard = (int*)calloc(state.shard_count + 1, sizeof(int));
+    int waiting = 0;
+
+    // Rows are scored RISK_BATCH at a time, between admitting and
+    // finishing them
+    RiskBatch* batch = (RiskBatch*)malloc(sizeof(RiskBatch));
+    Transaction* pending[RISK_BATCH];
+    batch->n = 0;
+    for (int i = 0; i <= n; i++) {
+        if (batch->n == RISK_BATCH || (i == n && batch->n > 0)) {
+            risk_score_batch(batch);
+            for (int j = 0; j < batch->n; j++) {
+                Transaction* t = pending[j];
+                admit_finish(t, batch->score[j]);
+                if (out->first_id == 0) out->first_id = t->id;
+                out->last_id = t->id;
+                out->accepted++;
+                if (t->status == STATUS_LOCKED) {
+                    out->locked++;
+                    continue;
+                }
+                queued[waiting++] = t;
+                per_shard[t->sender_id % state.shard_count + 1]++;
             }
-        } else {
-            break; 
+            batch->n = 0;
         }
-    }
+        if (i == n) break;
 
-    // 2. Aging
-    for (int i = 0; i < state.priority_queue->size; i++) {
-        Transaction* t = state.priority_queue->data[i];
-        double wait_seconds = difftime(now, t->arrival_time);
-        t->effective_priority = t->base_priority + (wait_seconds * AGING_FACTOR);
+        ImportRow* r = &rows[i];
+        Transaction* t = NULL;
+        int res = r->error ? r->error : admit_start(r->sender, r->receiver, r->pin, r->amount, r->urgency, batch, &t);
+        out->rows++;
+        if (res != 0) {
+            if (out->rejected < max_errors) {
+                errors[out->rejected].line = r->line;
+                errors[out->rejected].code = res;
+            }
+            out->rejected++;
+            continue;
+        }
+        pending[batch->n - 1] = t;
     }
-    
-    // Lazy Re-heapify
-    for (int i = (state.priority_queue->size / 2) - 1; i >= 0; i--) {
-        heapify_down(state.priority_queue, i);
+    free(batch);
+
+    // Counting sort by shard, so each shard gets one contiguous run
+    Transaction** by_shard = (Transaction**)malloc(sizeof(Transaction*) * (waiting > 0 ? waiting : 1));
+    for (int s = 0; s < state.shard_count; s++) per_shard[s + 1] += per_shard[s];
+    int* fill = (int*)malloc(sizeof(int) * state.shard_count);
+    memcpy(fill, per_shard, sizeof(int) * state.shard_count);
+    for (int i = 0; i < waiting; i++) by_shard[fill[queued[i]->sender_id % state.shard_count]++] = queued[i];
+
+    for (int s = 0; s < state.shard_count; s++) {
+        int count = per_shard[s + 1] - per_shard[s];
+        if (count == 0) continue;
+        Shard* shard = &state.shards[s];
+        pthread_mutex_lock(&shard->lock);
+        heap_push_many(shard->queue, by_shard + per_shard[s], count);
+        pthread_mutex_unlock(&shard->lock);
     }
+
+    free(fill);
+    free(by_shard);
+    free(per_shard);
+    free(queued);
 }
 
-Transaction* process_next_transaction() {
-    Transaction* t = heap_pop(state.priority_queue);
-    
-    // Process the money transfer here!
-    if (t) {
+void release_time_lock(Transaction* t) {
+    hist_record(&metrics()->lock_dwell, (long long)(difftime(engine_now(), t->arrival_time) * 1e6));
+    t->status = STATUS_WAITING;
+    enqueue_waiting(t);
+    mark_tx_changed(t);
+}
+
+void update_system_state() {
+    time_t now = engine_now();
+    long long start = metrics_clock_us();
+
+    // 1. Time Lock -> PQ
+    wheel_advance(&state.time_locks, (long long)now, release_time_lock);
+
+    // 2. Aging needs no work: every waiting transaction gains priority at
+    // the same rate, so the heap order on priority_key never goes stale.
+    hist_record(&metrics()->timer_pass, metrics_clock_us() - start);
+}
+
+// Applies a processing outcome; shared with WAL replay
+void settle_transaction(Transaction* t, TxStatus outcome, time_t now) {
+    if (outcome == STATUS_DONE) {
         Customer* sender = find_customer(t->sender_id);
         Customer* receiver = find_customer(t->receiver_id);
+        sender->balance -= t->amount;
+        receiver->balance += t->amount;
+        mark_customer_changed(sender);
+        mark_customer_changed(receiver);
+    }
+    t->status = outcome;
+    mark_tx_changed(t);
+    state.processed_count++;
+    state.total_wait_time += difftime(now, t->arrival_time);
+    retire_transaction(t);
+}
 
-        if (sender && receiver && sender->balance >= t->amount) {
-            sender->balance -= t->amount;
-            receiver->balance += t->amount;
-            t->status = STATUS_DONE; 
+// A decided transaction on its way to being published
+typedef struct {
+    Transaction* t;
+    TxStatus outcome;
+} Settlement;
+
+// Step 1. Receivers' credits are collected in `credits` (room for `max`)
+// for deliver_credits to hand over once they are published.
+int shard_take(Shard* s, Settlement* out, int max, Credit* credits, int* credit_count) {
+    int n = 0;
+    *credit_count = 0;
+    pthread_mutex_lock(&s->lock);
+
+    for (int i = 0; i < s->inbox_len; i++) customer_at(s->inbox[i].account)->available += s->inbox[i].amount;
+    s->inbox_len = 0;
+
+    while (n < max && s->queue->size > 0) {
+        Transaction* t = heap_pop(s->queue);
+        Customer* sender = customer_at(t->sender_id);
+
+        // Fails if the money was spent elsewhere while waiting
+        TxStatus outcome = (sender->available >= t->amount) ? STATUS_DONE : STATUS_CANCELLED;
+        if (outcome == STATUS_DONE) {
+            sender->available -= t->amount;
+            credits[*credit_count].account = t->receiver_id;
+            credits[*credit_count].amount = t->amount;
+            (*credit_count)++;
+        }
+        out[n].t = t;
+        out[n].outcome = outcome;
+        n++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+// Step 2. Caller holds state_lock.
+void publish_settlements(Settlement* batch, int n, time_t now, BatchSummary* out) {
+    MetricsBlock* m = metrics();
+    for (int i = 0; i < n; i++) {
+        Transaction* t = batch[i].t;
+        hist_record(&m->queue_wait[urgency_class(t->urgency)][tier_class(t->tier)],
+            (long long)(difftime(now, t->arrival_time) * 1e6));
+        if (batch[i].outcome == STATUS_DONE) {
+            out->done++;
+            out->amount += t->amount;
         } else {
-            // Failed during processing (e.g. money spent elsewhere while waiting)
-            t->status = STATUS_CANCELLED; 
+            out->failed++;
         }
+        int id = t->id;
+        settle_transaction(t, batch[i].outcome, now);
+        wal_log_event(WAL_TX_PROCESS, id, batch[i].outcome, now);
+        out->processed++;
+    }
+}
 
-        state.processed_count++;
-        state.total_wait_time += difftime(time(NULL), t->arrival_time);
+// One shard lock at a time, so this never waits on a shard while holding another
+void deliver_credits(Credit* credits, int n) {
+    for (int i = 0; i < n; i++) {
+        Shard* s = shard_for(credits[i].account);
+        pthread_mutex_lock(&s->lock);
+        if (s->inbox_len == s->inbox_cap) {
+            s->inbox_cap = s->inbox_cap ? s->inbox_cap * 2 : 256;
+            s->inbox = (Credit*)realloc(s->inbox, sizeof(Credit) * s->inbox_cap);
+        }
+        s->inbox[s->inbox_len++] = credits[i];
+        pthread_mutex_unlock(&s->lock);
     }
-    return t;
 }
 
-void cancel_transaction(int id) {
-    Transaction* target = NULL;
-    for(int i=0; i<state.tx_count; i++) {
-        if (state.all_transactions[i].id == id) {
-            target = &state.all_transactions[i];
-            break;
+// Settles up to SHARD_BATCH of the shard's transactions; returns how many.
+// `locked` says whether the caller already holds state_lock.
+int shard_process(Shard* s, int max, bool locked, BatchSummary* out) {
+    Settlement batch[SHARD_BATCH];
+    Credit credits[SHARD_BATCH];
+    int credit_count;
+    if (max > SHARD_BATCH) max = SHARD_BATCH;
+
+    int n = shard_take(s, batch, max, credits, &credit_count);
+    if (n == 0) return 0;
+    if (!locked) pthread_mutex_lock(&state_lock);
+    publish_settlements(batch, n, engine_now(), out);
+    if (!locked) pthread_mutex_unlock(&state_lock);
+    deliver_credits(credits, credit_count);
+    return n;
+}
+
+// Settles the highest-priority transaction across all shards; returns
+// false if none are waiting. Caller holds state_lock.
+bool process_next_transaction() {
+    Shard* best = NULL;
+    HeapEntry best_top;
+    for (int i = 0; i < state.shard_count; i++) {
+        Shard* s = &state.shards[i];
+        pthread_mutex_lock(&s->lock);
+        if (s->queue->size > 0 && (!best || heap_before(&s->queue->data[0], &best_top))) {
+            best = s;
+            best_top = s->queue->data[0];
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    BatchSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    return best && shard_process(best, 1, true, &summary) > 0;
+}
+
+double now_ms() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Drains up to max_items, 64 at a time from each shard in turn, stopping
+// early once budget_ms has passed (<= 0 means no time limit). Caller
+// holds state_lock.
+void process_batch(int max_items, double budget_ms, BatchSummary* out) {
+    memset(out, 0, sizeof(BatchSummary));
+    double deadline = now_ms() + budget_ms;
+
+    bool progress = true;
+    while (progress && out->processed < max_items) {
+        progress = false;
+        for (int i = 0; i < state.shard_count && out->processed < max_items; i++) {
+            int chunk = max_items - out->processed < 64 ? max_items - out->processed : 64;
+            if (shard_process(&state.shards[i], chunk, true, out) > 0) progress = true;
         }
+        // Checking the clock per item would cost more than the item
+        if (budget_ms > 0 && now_ms() > deadline) break;
     }
+    out->remaining = waiting_count();
+}
+
+void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// Background drain at a fixed rate (transactions per second, split
+// evenly over the shards), one thread per shard, in ticks of 100 ms.
+// state_lock is only held to publish each SHARD_BATCH.
+typedef struct {
+    Shard* shard;
+    double rate;
+} ShardWorker;
+
+void* shard_worker(void* arg) {
+    ShardWorker* w = (ShardWorker*)arg;
+    double credit = 0;
+
+    while (1) {
+        sleep_ms(100);
+        credit += w->rate / 10.0;
+        if (credit < 1) continue;
+
+        BatchSummary summary;
+        memset(&summary, 0, sizeof(summary));
+        int n;
+        do {
+            n = shard_process(w->shard, (int)credit - summary.processed, false, &summary);
+        } while (n > 0 && summary.processed < (int)credit);
+        wal_wait_durable(wal_lsn());
+
+        // Unused credit doesn't pile up while the queue is empty
+        credit = (n > 0) ? credit - summary.processed : 0;
+        if (credit > w->rate) credit = w->rate;
+    }
+    return NULL;
+}
+
+void start_auto_processor(double rate) {
+    static ShardWorker workers[MAX_SHARDS];
+    for (int i = 0; i < state.shard_count; i++) {
+        workers[i].shard = &state.shards[i];
+        workers[i].rate = rate / state.shard_count;
+        pthread_t thread;
+        pthread_create(&thread, NULL, shard_worker, &workers[i]);
+        pthread_detach(thread);
+    }
+}
+
+// Releases time locks on the second they expire, whether or not any
+// requests are coming in
+void* lock_timer(void* arg) {
+    (void)arg;
+#ifndef _WIN32
+    // Fires on every whole second of the wall clock unlock times use
+    int fd = timerfd_create(CLOCK_REALTIME, 0);
+    struct itimerspec spec = { { 1, 0 }, { time(NULL) + 1, 0 } };
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+#endif
+
+    while (1) {
+#ifdef _WIN32
+        sleep_ms(1000 - (int)((long long)now_ms() % 1000));
+#else
+        unsigned long long expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0) continue;
+#endif
+        pthread_mutex_lock(&state_lock);
+        update_system_state();
+        pthread_mutex_unlock(&state_lock);
+    }
+    return NULL;
+}
+
+void start_lock_timer() {
+    pthread_t thread;
+    pthread_create(&thread, NULL, lock_timer, NULL);
+    pthread_detach(thread);
+}
+
+void cancel_transaction(int id) {
+    Transaction* target = find_transaction(id);
 
     if (!target) return;
     if (target->status == STATUS_DONE || target->status == STATUS_CANCELLED) return;
 
     if (target->status == STATUS_LOCKED) {
-        heap_remove(state.time_lock_queue, id);
+        wheel_remove(&state.time_locks, target);
     } else if (target->status == STATUS_WAITING) {
-        heap_remove(state.priority_queue, id);
+        if (!dequeue_waiting(target)) return; // Its shard is settling it
     }
 
     target->status = STATUS_CANCELLED;
     state.cancelled_count++;
+    mark_tx_changed(target);
+    retire_transaction(target);
+    wal_log_event(WAL_TX_CANCEL, id, STATUS_CANCELLED, engine_now());
 }
 
 void force_unlock(int id) {
-     Transaction* target = NULL;
-    for(int i=0; i<state.tx_count; i++) {
-        if (state.all_transactions[i].id == id) {
-            target = &state.all_transactions[i];
-            break;
-        }
-    }
+    Transaction* target = find_transaction(id);
     if (!target || target->status != STATUS_LOCKED) return;
     
-    heap_remove(state.time_lock_queue, id);
+    wheel_remove(&state.time_locks, target);
+    hist_record(&metrics()->lock_dwell, (long long)(difftime(engine_now(), target->arrival_time) * 1e6));
     target->status = STATUS_WAITING;
-    heap_push(state.priority_queue, target);
+    enqueue_waiting(target);
+    mark_tx_changed(target);
+    wal_log_event(WAL_TX_UNLOCK, id, STATUS_WAITING, engine_now());
 }
@@ -0,0 +1,257 @@
+#include "structures.h"
+#include <stdarg.h>
+
+// --- METRICS ---
+// Latency histograms and counters for GET /api/metrics. Every thread
+// records into its own MetricsBlock, so recording takes no lock and never
+// shares a cache line with another thread; a scrape walks all the blocks
+// and adds them up. A block has one writer, which stores with relaxed
+// atomics only so that a scrape never reads a torn value. Blocks outlive
+// their threads, so totals only ever go up.
+//
+// Histograms are log-linear (HDR-style): values up to HIST_SUB are exact,
+// and every power of two above that is split into HIST_SUB buckets, so a
+// bucket is never wider than 1/HIST_SUB of its values. A bucket includes
+// its upper bound, as a Prometheus "le" does. All values are whole
+// microseconds.
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 40             // Up to 2^40 us (~12 days); longer lands in the last bucket
+#define HIST_BUCKETS (HIST_SUB * (HIST_OCTAVES - HIST_SUB_BITS + 1))
+
+typedef struct {
+    unsigned long long count;       // Only in merged copies: buckets added up
+    unsigned long long sum;
+    unsigned long long buckets[HIST_BUCKETS];
+} Histogram;
+
+// Labels of the HTTP histograms
+typedef enum {
+    ROUTE_STATIC,
+    ROUTE_STATE,
+    ROUTE_EVENTS,
+    ROUTE_CUSTOMER,
+    ROUTE_LOGIN,
+    ROUTE_TRANSACTION,
+    ROUTE_IMPORT,
+    ROUTE_PROCESS,
+    ROUTE_CANCEL,
+    ROUTE_UNLOCK,
+    ROUTE_HISTORY,
+    ROUTE_AGGREGATE,
+    ROUTE_REPLICATION,
+    ROUTE_METRICS,
+    ROUTE_NOT_FOUND,
+    ROUTE_COUNT
+} Route;
+
+const char* route_names[ROUTE_COUNT] = {
+    "static", "/api/state", "/api/events", "/api/customer", "/api/login", "/api/transaction",
+    "/api/import", "/api/process", "/api/cancel", "/api/unlock", "/api/history",
+    "/api/aggregate", "/api/replication", "/api/metrics", "not_found"
+};
+
+#define URGENCY_CLASSES 3
+#define TIER_CLASSES 4
+const char* urgency_names[URGENCY_CLASSES] = { "normal", "emi", "medical" };
+const char* tier_names[TIER_CLASSES] = { "basic", "premium", "vip", "elite" };
+
+typedef struct MetricsBlock {
+    Histogram http[ROUTE_COUNT];    // Handling time, until the response is queued
+    Histogram commit_wait;          // Responses held back for the WAL
+    Histogram queue_wait[URGENCY_CLASSES][TIER_CLASSES]; // Arrival to settlement
+    Histogram lock_dwell;           // Arrival to release of a time lock
+    Histogram timer_pass;           // One update_system_state()
+    unsigned long long parse_errors;
+    unsigned long long admission_rejected[2]; // Rate limited, shed
+    struct MetricsBlock* next;
+} MetricsBlock;
+
+MetricsBlock* metrics_blocks;       // Every thread's, newest first
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER; // Guards adding to the list
+__thread MetricsBlock* metrics_local;
+
+// This thread's block, created on its first use
+MetricsBlock* metrics() {
+    MetricsBlock* m = metrics_local;
+    if (!m) {
+        m = (MetricsBlock*)calloc(1, sizeof(MetricsBlock));
+        pthread_mutex_lock(&metrics_lock);
+        m->next = metrics_blocks;
+        metrics_blocks = m;
+        pthread_mutex_unlock(&metrics_lock);
+        metrics_local = m;
+    }
+    return m;
+}
+
+long long metrics_clock_us() {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Only the owning thread adds, so a plain read of the old value is enough
+static inline void metric_add(unsigned long long* x, unsigned long long v) {
+    __atomic_store_n(x, *x + v, __ATOMIC_RELAXED);
+}
+
+// Bucket i holds the values in (hist_upper(i - 1), hist_upper(i)]
+static inline int hist_index(unsigned long long v) {
+    if (v <= HIST_SUB) return (int)v;
+    v--; // A bound ends its bucket instead of starting the next one
+    int e = 63 - __builtin_clzll(v);
+    if (e >= HIST_OCTAVES) return HIST_BUCKETS - 1;
+    int i = (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)(v >> (e - HIST_SUB_BITS)) - HIST_SUB + 1;
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// Largest value that lands in bucket i (the last one also takes all above)
+unsigned long long hist_upper(int i) {
+    if (i < HIST_SUB) return (unsigned long long)i;
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (unsigned long long)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static inline void hist_record(Histogram* h, long long us) {
+    unsigned long long v = us > 0 ? (unsigned long long)us : 0;
+    metric_add(&h->buckets[hist_index(v)], 1);
+    metric_add(&h->sum, v);
+}
+
+// The count is taken from the buckets, so it always matches them even
+// while the owner keeps recording
+void hist_merge(Histogram* into, const Histogram* h) {
+    into->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        unsigned long long n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        into->buckets[i] += n;
+        into->count += n;
+    }
+}
+
+// Value below which a fraction q of the recorded ones lie, as the middle
+// of the bucket it falls in
+unsigned long long hist_quantile(const Histogram* h, double q) {
+    unsigned long long rank = (unsigned long long)(q * h->count), seen = 0;
+    if (rank >= h->count && h->count > 0) rank = h->count - 1;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) return i == 0 ? 0 : hist_upper(i - 1) + (hist_upper(i) - hist_upper(i - 1) + 1) / 2;
+    }
+    return hist_upper(HIST_BUCKETS - 2) + 1;
+}
+
+int urgency_class(int urgency) {
+    return urgency >= URGENCY_MEDICAL ? 2 : (urgency >= URGENCY_EMI ? 1 : 0);
+}
+
+int tier_class(int tier) {
+    return tier >= TIER_ELITE ? 3 : (tier >= TIER_VIP ? 2 : (tier >= TIER_PREMIUM ? 1 : 0));
+}
+
+// --- PROMETHEUS TEXT FORMAT ---
+
+typedef struct {
+    char* buf;
+    int len;
+    int cap;
+} MetricsText;
+
+void mt_printf(MetricsText* mt, const char* fmt, ...) {
+    while (1) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(mt->buf + mt->len, mt->cap - mt->len, fmt, args);
+        va_end(args);
+        if (n < mt->cap - mt->len) {
+            mt->len += n;
+            return;
+        }
+        mt->cap = mt->cap ? mt->cap * 2 : 16384;
+        mt->buf = (char*)realloc(mt->buf, mt->cap);
+    }
+}
+
+void mt_family(MetricsText* mt, const char* name, const char* type, const char* help) {
+    mt_printf(mt, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One histogram series, in seconds. Buckets are cumulative at each power
+// of two from 2^lo to 2^hi microseconds; those are bucket bounds, so the
+// counts are exact, a value equal to one included.
+void mt_histogram(MetricsText* mt, const char* name, const char* labels, const Histogram* h, int lo, int hi) {
+    const char* sep = labels[0] ? "," : "";
+    unsigned long long cumulative = 0;
+    int i = 0;
+    for (int e = lo; e <= hi; e++) {
+        int end = hist_index(1ULL << e) + 1;
+        for (; i < end; i++) cumulative += h->buckets[i];
+        mt_printf(mt, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep, (double)(1ULL << e) / 1e6, cumulative);
+    }
+    mt_printf(mt, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, h->count);
+    const char* open = labels[0] ? "{" : "";
+    const char* close = labels[0] ? "}" : "";
+    mt_printf(mt, "%s_sum%s%s%s %.6f\n", name, open, labels, close, h->sum / 1e6);
+    mt_printf(mt, "%s_count%s%s%s %llu\n", name, open, labels, close, h->count);
+}
+
+// Everything the threads have recorded, added up
+void metrics_render(MetricsText* mt) {
+    pthread_mutex_lock(&metrics_lock);
+    MetricsBlock* blocks = metrics_blocks;
+    pthread_mutex_unlock(&metrics_lock);
+
+    MetricsBlock* sum = (MetricsBlock*)calloc(1, sizeof(MetricsBlock));
+    for (MetricsBlock* m = blocks; m; m = m->next) {
+        for (int r = 0; r < ROUTE_COUNT; r++) hist_merge(&sum->http[r], &m->http[r]);
+        hist_merge(&sum->commit_wait, &m->commit_wait);
+        for (int u = 0; u < URGENCY_CLASSES; u++) {
+            for (int t = 0; t < TIER_CLASSES; t++) hist_merge(&sum->queue_wait[u][t], &m->queue_wait[u][t]);
+        }
+        hist_merge(&sum->lock_dwell, &m->lock_dwell);
+        hist_merge(&sum->timer_pass, &m->timer_pass);
+        sum->parse_errors += __atomic_load_n(&m->parse_errors, __ATOMIC_RELAXED);
+        for (int r = 0; r < 2; r++) sum->admission_rejected[r] += __atomic_load_n(&m->admission_rejected[r], __ATOMIC_RELAXED);
+    }
+
+    char labels[128];
+    mt_family(mt, "bank_http_request_duration_seconds", "histogram",
+        "Time to handle a request until its response is queued, by route; _count is the request count.");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        if (sum->http[r].count == 0) continue;
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+        mt_histogram(mt, "bank_http_request_duration_seconds", labels, &sum->http[r], 3, 25);
+    }
+    mt_family(mt, "bank_http_commit_wait_seconds", "histogram",
+        "Time responses were held until the changes they report were durable in the WAL.");
+    mt_histogram(mt, "bank_http_commit_wait_seconds", "", &sum->commit_wait, 3, 25);
+    mt_family(mt, "bank_http_parse_errors_total", "counter", "Requests answered 400 or 413 by the parser.");
+    mt_printf(mt, "bank_http_parse_errors_total %llu\n", sum->parse_errors);
+    mt_family(mt, "bank_admission_rejected_total", "counter",
+        "Transactions turned away by admission control: over a rate limit (429) or shed under load (503).");
+    mt_printf(mt, "bank_admission_rejected_total{reason=\"rate_limit\"} %llu\n", sum->admission_rejected[0]);
+    mt_printf(mt, "bank_admission_rejected_total{reason=\"overload\"} %llu\n", sum->admission_rejected[1]);
+
+    mt_family(mt, "bank_queue_wait_seconds", "histogram",
+        "Arrival to settlement of processed transactions (time locks included; whole seconds).");
+    for (int u = 0; u < URGENCY_CLASSES; u++) {
+        for (int t = 0; t < TIER_CLASSES; t++) {
+            if (sum->queue_wait[u][t].count == 0) continue;
+            snprintf(labels, sizeof(labels), "urgency=\"%s\",tier=\"%s\"", urgency_names[u], tier_names[t]);
+            mt_histogram(mt, "bank_queue_wait_seconds", labels, &sum->queue_wait[u][t], 20, 36);
+        }
+    }
+    mt_family(mt, "bank_time_lock_dwell_seconds", "histogram",
+        "Arrival to release of time-locked transactions, on expiry or forced (whole seconds).");
+    mt_histogram(mt, "bank_time_lock_dwell_seconds", "", &sum->lock_dwell, 20, 36);
+    mt_family(mt, "bank_timer_pass_seconds", "histogram",
+        "Cost of one update_system_state() pass: releasing expired time locks. Aging itself needs no pass.");
+    mt_histogram(mt, "bank_timer_pass_seconds", "", &sum->timer_pass, 0, 20);
+    free(sum);
+}
@@ -0,0 +1,156 @@
+#include "structures.h"
+
+// --- CRASH RECOVERY ---
+// Loads <dir>/bank.snap, replays <dir>/bank.wal on top of it and rebuilds
+// both heaps. Replay applies the logged outcomes directly, so it does not
+// depend on the clock or on queue order.
+
+#define WAL_MAX_RECORD 4096
+
+bool read_file_header(FILE* f, const char* magic, const char* path) {
+    WalFileHeader expected, h;
+    wal_file_header(&expected, magic);
+    if (fread(&h, sizeof(h), 1, f) != 1) return false; // Empty file
+    if (memcmp(&h, &expected, sizeof(h)) != 0) {
+        printf("%s was written by an incompatible build\n", path);
+        exit(1);
+    }
+    return true;
+}
+
+void restore_transaction(const Transaction* saved) {
+    Transaction* t = alloc_transaction();
+    *t = *saved;
+    t->heap_index = -1;
+    t->next = t->prev = NULL;
+    tx_index_insert(&state.tx_index, t);
+    if (t->id >= id_counter) id_counter = t->id + 1;
+    if (t->status == STATUS_DONE || t->status == STATUS_CANCELLED) retire_transaction(t);
+}
+
+void restore_customer(const Customer* saved) {
+    Customer* c = (Customer*)arena_alloc(&state.customers);
+    *c = *saved;
+    if (c->account_number >= account_counter) account_counter = c->account_number + 1;
+}
+
+// Loads a snapshot written by write_snapshot_to; false if it ended early.
+// `name` is what to call it in messages.
+bool read_snapshot(FILE* f, const char* name) {
+    SnapshotHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1) return false;
+    WalFileHeader expected;
+    wal_file_header(&expected, SNAP_MAGIC);
+    if (memcmp(&h.file, &expected, sizeof(expected)) != 0) {
+        printf("%s was written by an incompatible build\n", name);
+        exit(1);
+    }
+
+    wal.generation = h.generation;
+    id_counter = h.id_counter;
+    account_counter = h.account_counter;
+    state.processed_count = h.processed_count;
+    state.cancelled_count = h.cancelled_count;
+    state.total_wait_time = h.total_wait_time;
+
+    Customer c;
+    int customers = 0, txs = 0;
+    for (; customers < h.customer_count && fread(&c, sizeof(c), 1, f) == 1; customers++) restore_customer(&c);
+    Transaction t;
+    for (; txs < h.tx_count && fread(&t, sizeof(t), 1, f) == 1; txs++) restore_transaction(&t);
+    return customers == h.customer_count && txs == h.tx_count;
+}
+
+// A missing snapshot is a fresh start; a short one stops the server, since
+// starting would write a new snapshot over whatever it still holds
+void load_snapshot(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return;
+    bool complete = read_snapshot(f, path);
+    fclose(f);
+    if (!complete) {
+        printf("%s is cut short; restore it, or move it away to start empty\n", path);
+        exit(1);
+    }
+}
+
+void replay_record(WalRecordHeader* h, const char* payload) {
+    if (h->type == WAL_CUSTOMER) {
+        restore_customer((const Customer*)payload);
+        return;
+    }
+    if (h->type == WAL_TX_CREATE) {
+        restore_transaction((const Transaction*)payload);
+        return;
+    }
+
+    const WalTxEvent* e = (const WalTxEvent*)payload;
+    Transaction* t = find_transaction(e->id);
+    if (!t) return;
+
+    if (h->type == WAL_TX_PROCESS) {
+        settle_transaction(t, (TxStatus)e->outcome, (time_t)e->when);
+    } else if (h->type == WAL_TX_CANCEL) {
+        t->status = STATUS_CANCELLED;
+        state.cancelled_count++;
+        retire_transaction(t);
+    } else if (h->type == WAL_TX_UNLOCK) {
+        t->status = STATUS_WAITING;
+    }
+}
+
+// Returns the number of records applied. Stops at the first record that
+// is short or fails its checksum: that is where the crash cut the log.
+long replay_wal(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return 0;
+
+    long count = 0;
+    long long generation = 0;
+    if (read_file_header(f, WAL_MAGIC, path) && fread(&generation, sizeof(generation), 1, f) == 1) {
+        if (generation < wal.generation) {
+            // Cut off before it was reset; the snapshot already has all of it
+            printf("%s predates %s; skipping it\n", path, wal.snap_path);
+            fclose(f);
+            return 0;
+        }
+        WalRecordHeader h;
+        char payload[WAL_MAX_RECORD];
+        while (fread(&h, sizeof(h), 1, f) == 1) {
+            if (h.len > WAL_MAX_RECORD || fread(payload, 1, h.len, f) != h.len) break;
+            if (fnv1a(payload, h.len) != h.checksum) break;
+            replay_record(&h, payload);
+            count++;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+// Waiting transactions go back with one O(N) heap build per shard; locks
+// that expired while the server was down are released on the first tick.
+// Nothing is in flight between shards yet, so `available` = `balance`.
+void rebuild_queues() {
+    for (int i = 0; i < state.transactions.count; i++) {
+        Transaction* t = transaction_at(i);
+        if (t->status == STATUS_WAITING) heap_append(shard_for(t->sender_id)->queue, t);
+        else if (t->status == STATUS_LOCKED) wheel_insert(&state.time_locks, t);
+    }
+    for (int i = 0; i < state.shard_count; i++) heap_build(state.shards[i].queue);
+    for (int i = 0; i < state.customers.count; i++) {
+        Customer* c = (Customer*)arena_at(&state.customers, i);
+        c->available = c->balance;
+    }
+}
+
+void recover_state() {
+    clock_t start = clock();
+    load_snapshot(wal.snap_path);
+    long replayed = replay_wal(wal.wal_path);
+    rebuild_queues();
+    history_recovered();
+    double ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+    printf("Recovered %d customers and %d transactions (%ld log records) in %.1f ms\n",
+        state.customers.count, state.tx_count, replayed, ms);
+}
@@ -0,0 +1,502 @@
+#include "structures.h"
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// --- REPLICATION ---
+// A primary started with --replicate PORT ships its write-ahead log to
+// read-only replicas (--replica-of HOST:PORT). Each replica keeps its own
+// copy of the state and serves the read endpoints from it, so dashboards
+// no longer take state_lock on the process that moves the money.
+//
+// A replica connects and says where its copy ends. If the primary still
+// has the log from there, it sends the rest. Otherwise it sends a
+// snapshot (the bank.snap format) taken at some log position P, then the
+// log from P. The log is the WAL records exactly as in bank.wal, shipped
+// once they are on disk, so a replica never shows a change that a crash
+// of the primary would undo. Every second the primary also sends a
+// heartbeat with how far its log goes, and the replica answers with how
+// far it has applied: the difference is its lag.
+//
+// Replicas keep nothing on disk. One that falls behind by more than the
+// primary keeps (REPL_RING_SIZE), or whose primary restarted, exits so
+// it can be restarted onto a fresh snapshot. Time locks are released by
+// each replica's own lock timer, as on the primary, since those releases
+// aren't logged.
+
+#define REPL_MAGIC "BANKREP1"
+#define REPL_RING_SIZE (64 * 1024 * 1024) // Log kept for replicas that are behind or reconnecting
+#define REPL_MAX_REPLICAS 16
+#define REPL_HEARTBEAT 0x100            // Record type sent to replicas only, never in bank.wal
+#define REPL_TIMEOUT_SECONDS 5          // Silence after which either side gives up on the other
+#define REPL_SEND_CHUNK (256 * 1024)
+
+// The first thing each side sends
+typedef struct {
+    WalFileHeader file;     // REPL_MAGIC and the struct sizes, as in the WAL
+    long long epoch;        // The primary's run; log positions restart with it
+    long long lsn;          // Replica: where its copy ends, 0 for none. Primary: where the log it sends starts.
+    int snapshot;           // Primary: 1 if a snapshot comes before the log
+} ReplHello;
+
+typedef struct {
+    long long lsn;          // How far the primary's log goes
+} ReplHeartbeat;
+
+// One connected replica, as the primary sees it
+typedef struct {
+    bool active;
+    int fd;
+    char address[64];
+    long long sent_lsn;
+    long long applied_lsn;  // As of its last answer to a heartbeat
+} ReplicaLink;
+
+typedef struct {
+    bool enabled;
+    pthread_mutex_t lock;
+    pthread_cond_t shipped;     // `end` moved forward
+    char* ring;                 // Log bytes [start, end), each at position % REPL_RING_SIZE
+    long long start, end;
+    ReplicaLink links[REPL_MAX_REPLICAS];
+} ReplShipper;
+
+// The replica's side. Written under state_lock, along with the state it
+// describes.
+typedef struct {
+    bool enabled;
+    char host[128];
+    int port;
+    bool connected;
+    long long epoch;            // The primary's run this copy came from
+    long long applied_lsn;
+    long long primary_lsn;      // As of the last heartbeat
+    long long caught_up_ms;     // When applied_lsn last reached primary_lsn
+} ReplicaState;
+
+ReplShipper repl;
+ReplicaState replica;
+
+double repl_now_ms() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Installed as on_wal_durable
+void repl_ship(const char* records, int len) {
+    pthread_mutex_lock(&repl.lock);
+    for (int done = 0; done < len;) {
+        int at = (int)(repl.end % REPL_RING_SIZE);
+        int n = REPL_RING_SIZE - at < len - done ? REPL_RING_SIZE - at : len - done;
+        memcpy(repl.ring + at, records + done, n);
+        done += n;
+        repl.end += n;
+    }
+    if (repl.end - repl.start > REPL_RING_SIZE) repl.start = repl.end - REPL_RING_SIZE;
+    pthread_cond_broadcast(&repl.shipped);
+    pthread_mutex_unlock(&repl.lock);
+}
+
+// Copies of the connected replicas; returns how many
+int repl_links(ReplicaLink* out) {
+    int n = 0;
+    pthread_mutex_lock(&repl.lock);
+    for (int i = 0; i < REPL_MAX_REPLICAS; i++) {
+        if (repl.links[i].active) out[n++] = repl.links[i];
+    }
+    pthread_mutex_unlock(&repl.lock);
+    return n;
+}
+
+long long repl_shipped_lsn() {
+    pthread_mutex_lock(&repl.lock);
+    long long end = repl.end;
+    pthread_mutex_unlock(&repl.lock);
+    return end;
+}
+
+#ifndef _WIN32
+
+bool send_all(int fd, const void* data, long long len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+void repl_set_timeouts(int fd) {
+    struct timeval tv = { REPL_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+void repl_hello(ReplHello* h, long long epoch, long long lsn, int snapshot) {
+    memset(h, 0, sizeof(*h));
+    wal_file_header(&h->file, REPL_MAGIC);
+    h->epoch = epoch;
+    h->lsn = lsn;
+    h->snapshot = snapshot;
+}
+
+bool repl_hello_valid(const ReplHello* h) {
+    WalFileHeader expected;
+    wal_file_header(&expected, REPL_MAGIC);
+    return memcmp(&h->file, &expected, sizeof(expected)) == 0;
+}
+
+bool repl_send_heartbeat(int fd, long long lsn) {
+    ReplHeartbeat beat = { lsn };
+    WalRecordHeader h;
+    h.type = REPL_HEARTBEAT;
+    h.len = sizeof(beat);
+    h.checksum = fnv1a(&beat, sizeof(beat));
+    char msg[sizeof(h) + sizeof(beat)]; // Packed, as records are in the log
+    memcpy(msg, &h, sizeof(h));
+    memcpy(msg + sizeof(h), &beat, sizeof(beat));
+    return send_all(fd, msg, sizeof(msg));
+}
+
+// Sends a snapshot of the state as it is now; returns the log position it
+// was taken at, or -1
+long long repl_send_snapshot(int fd) {
+    FILE* f = tmpfile();
+    if (!f) return -1;
+    pthread_mutex_lock(&state_lock);
+    long long lsn = wal_lsn();
+    bool written = write_snapshot_to(f);
+    pthread_mutex_unlock(&state_lock);
+    if (!written) {
+        fclose(f);
+        return -1;
+    }
+    // It may hold changes whose records haven't been shipped yet. Waiting
+    // for the ring rather than the disk covers every sync mode, and the
+    // log sent after it must start exactly at lsn.
+    pthread_mutex_lock(&repl.lock);
+    while (repl.end < lsn) pthread_cond_wait(&repl.shipped, &repl.lock);
+    pthread_mutex_unlock(&repl.lock);
+
+    ReplHello h;
+    repl_hello(&h, state.epoch, lsn, 1);
+    bool ok = send_all(fd, &h, sizeof(h));
+    char buf[65536];
+    size_t n;
+    rewind(f);
+    while (ok && (n = fread(buf, 1, sizeof(buf), f)) > 0) ok = send_all(fd, buf, n);
+    fclose(f);
+    return ok ? lsn : -1;
+}
+
+// One thread per replica: catch it up, then follow the log until it goes
+// away or falls out of the ring
+void* repl_sender(void* arg) {
+    ReplicaLink* link = (ReplicaLink*)arg;
+    int fd = link->fd;
+    ReplHello hello;
+    long long pos = -1;
+    bool resumed = false;
+
+    if (recv(fd, &hello, sizeof(hello), MSG_WAITALL) == sizeof(hello) && repl_hello_valid(&hello)) {
+        pthread_mutex_lock(&repl.lock);
+        resumed = hello.epoch == state.epoch && hello.lsn >= repl.start && hello.lsn <= repl.end;
+        pthread_mutex_unlock(&repl.lock);
+        if (resumed) {
+            ReplHello h;
+            repl_hello(&h, state.epoch, hello.lsn, 0);
+            if (send_all(fd, &h, sizeof(h))) pos = hello.lsn;
+        } else {
+            pos = repl_send_snapshot(fd);
+        }
+    }
+    printf("Replica %s %s at log position %lld\n", link->address,
+        pos < 0 ? "failed to start" : resumed ? "resumed" : "loaded a snapshot", pos);
+
+    char* chunk = (char*)malloc(REPL_SEND_CHUNK);
+    char ack[sizeof(long long)];
+    int ack_len = 0;
+    double last_beat = 0;
+    while (pos >= 0) {
+        pthread_mutex_lock(&repl.lock);
+        if (repl.end == pos) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&repl.shipped, &repl.lock, &until);
+        }
+        if (pos < repl.start) {
+            pthread_mutex_unlock(&repl.lock);
+            printf("Replica %s fell more than %d MB behind\n", link->address, REPL_RING_SIZE >> 20);
+            break;
+        }
+        if (pos > repl.end) {
+            // Sending from here would repeat records the replica has applied
+            pthread_mutex_unlock(&repl.lock);
+            printf("Replica %s is at %lld, past the shipped log at %lld\n", link->address, pos, repl.end);
+            break;
+        }
+        int n = repl.end - pos < REPL_SEND_CHUNK ? (int)(repl.end - pos) : REPL_SEND_CHUNK;
+        for (int done = 0; done < n;) {
+            int at = (int)((pos + done) % REPL_RING_SIZE);
+            int part = REPL_RING_SIZE - at < n - done ? REPL_RING_SIZE - at : n - done;
+            memcpy(chunk + done, repl.ring + at, part);
+            done += part;
+        }
+        long long end = repl.end;
+        pthread_mutex_unlock(&repl.lock);
+
+        if (n > 0 && !send_all(fd, chunk, n)) break;
+        pos += n;
+        double now = repl_now_ms();
+        if (now - last_beat >= 1000) {
+            if (!repl_send_heartbeat(fd, end)) break;
+            last_beat = now;
+        }
+
+        // Answers to heartbeats: the replica's applied position
+        ssize_t got;
+        while ((got = recv(fd, ack + ack_len, sizeof(ack) - ack_len, MSG_DONTWAIT)) > 0) {
+            ack_len += (int)got;
+            if (ack_len < (int)sizeof(ack)) continue;
+            pthread_mutex_lock(&repl.lock);
+            memcpy(&link->applied_lsn, ack, sizeof(ack));
+            pthread_mutex_unlock(&repl.lock);
+            ack_len = 0;
+        }
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) break;
+
+        pthread_mutex_lock(&repl.lock);
+        link->sent_lsn = pos;
+        pthread_mutex_unlock(&repl.lock);
+    }
+    free(chunk);
+    close(fd);
+    printf("Replica %s disconnected\n", link->address);
+    pthread_mutex_lock(&repl.lock);
+    link->active = false;
+    pthread_mutex_unlock(&repl.lock);
+    return NULL;
+}
+
+void* repl_listener(void* arg) {
+    int server = (int)(long)arg;
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(server, (struct sockaddr*)&addr, &addr_len);
+        if (fd < 0) continue;
+        repl_set_timeouts(fd);
+
+        ReplicaLink* link = NULL;
+        pthread_mutex_lock(&repl.lock);
+        for (int i = 0; i < REPL_MAX_REPLICAS && !link; i++) {
+            if (!repl.links[i].active) link = &repl.links[i];
+        }
+        if (link) {
+            memset(link, 0, sizeof(*link));
+            link->active = true;
+            link->fd = fd;
+            snprintf(link->address, sizeof(link->address), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        }
+        pthread_mutex_unlock(&repl.lock);
+        if (!link) {
+            close(fd);
+            continue;
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, repl_sender, link);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Called before wal_start, so the ring sees the log from its first record.
+// Listens on the loopback interface only: the log carries PINs.
+bool repl_start_primary(int port) {
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, REPL_MAX_REPLICAS) < 0) {
+        printf("Replication port %d: %s\n", port, strerror(errno));
+        return false;
+    }
+
+    pthread_mutex_init(&repl.lock, NULL);
+    pthread_cond_init(&repl.shipped, NULL);
+    repl.ring = (char*)malloc(REPL_RING_SIZE);
+    repl.enabled = true;
+    on_wal_durable = repl_ship;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, repl_listener, (void*)(long)server);
+    pthread_detach(thread);
+    printf("Shipping the log to replicas on 127.0.0.1:%d\n", port);
+    return true;
+}
+
+// --- REPLICA ---
+
+// Applies one shipped record. replay_record changes statuses the way
+// recovery does; a replica's queues and timing wheel are live, so it also
+// moves the transaction between them, and records the change for
+// /api/state deltas and event streams. Caller holds state_lock.
+void replica_apply(WalRecordHeader* h, const char* payload) {
+    if (h->type == WAL_CUSTOMER) {
+        replay_record(h, payload);
+        Customer* c = find_customer(((const Customer*)payload)->account_number);
+        c->available = c->balance;
+        mark_customer_changed(c);
+        return;
+    }
+
+    Transaction* t;
+    if (h->type == WAL_TX_CREATE) {
+        replay_record(h, payload);
+        t = find_transaction(((const Transaction*)payload)->id);
+        if (!t) return;
+    } else {
+        t = find_transaction(((const WalTxEvent*)payload)->id);
+        if (!t) return;
+        if (t->status == STATUS_WAITING) dequeue_waiting(t);
+        else if (t->status == STATUS_LOCKED) wheel_remove(&state.time_locks, t);
+        replay_record(h, payload);
+        if (h->type == WAL_TX_PROCESS) return; // settle_transaction recorded it
+    }
+    if (t->status == STATUS_WAITING) enqueue_waiting(t);
+    else if (t->status == STATUS_LOCKED) wheel_insert(&state.time_locks, t);
+    mark_tx_changed(t);
+}
+
+int replica_connect() {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", replica.port);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(replica.host, port, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) repl_set_timeouts(fd);
+    return fd;
+}
+
+// Connects and reads the primary's hello, loading the snapshot if one
+// follows. Returns the stream to follow, or NULL to try again later.
+FILE* replica_attach() {
+    int fd = replica_connect();
+    if (fd < 0) return NULL;
+
+    pthread_mutex_lock(&state_lock);
+    ReplHello h;
+    repl_hello(&h, replica.epoch, replica.applied_lsn, 0);
+    pthread_mutex_unlock(&state_lock);
+    FILE* in = fdopen(fd, "r+b");
+    if (!send_all(fd, &h, sizeof(h)) || fread(&h, sizeof(h), 1, in) != 1 || !repl_hello_valid(&h)) {
+        fclose(in);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&state_lock);
+    if (h.snapshot) {
+        if (replica.epoch != 0) {
+            // Loading it would mean starting over from an empty state
+            printf("The primary no longer has the log this replica needs; restart it to load a new snapshot\n");
+            exit(1);
+        }
+        if (!read_snapshot(in, "The primary's snapshot")) {
+            printf("Lost the primary while loading its snapshot\n");
+            exit(1);
+        }
+        rebuild_queues();
+    }
+    replica.epoch = h.epoch;
+    replica.applied_lsn = replica.primary_lsn = h.lsn;
+    replica.caught_up_ms = (long long)repl_now_ms();
+    replica.connected = true;
+    pthread_mutex_unlock(&state_lock);
+    printf("Following %s:%d from log position %lld%s\n", replica.host, replica.port, h.lsn,
+        h.snapshot ? " after its snapshot" : "");
+    return in;
+}
+
+// Applies records until the connection drops. A heartbeat is answered with
+// the position applied so far.
+void replica_follow(FILE* in) {
+    WalRecordHeader h;
+    char payload[WAL_MAX_RECORD];
+    while (fread(&h, sizeof(h), 1, in) == 1) {
+        if (h.len > WAL_MAX_RECORD || fread(payload, 1, h.len, in) != h.len) break;
+        if (fnv1a(payload, h.len) != h.checksum) break;
+
+        pthread_mutex_lock(&state_lock);
+        if (h.type == REPL_HEARTBEAT) {
+            replica.primary_lsn = ((ReplHeartbeat*)payload)->lsn;
+        } else {
+            replica_apply(&h, payload);
+            replica.applied_lsn += sizeof(h) + h.len;
+        }
+        if (replica.applied_lsn >= replica.primary_lsn) replica.caught_up_ms = (long long)repl_now_ms();
+        long long applied = replica.applied_lsn;
+        pthread_mutex_unlock(&state_lock);
+
+        if (h.type == REPL_HEARTBEAT && !send_all(fileno(in), &applied, sizeof(applied))) break;
+    }
+}
+
+void* replica_loop(void* arg) {
+    FILE* in = (FILE*)arg;
+    while (1) {
+        if (in) {
+            replica_follow(in);
+            fclose(in);
+            pthread_mutex_lock(&state_lock);
+            replica.connected = false;
+            pthread_mutex_unlock(&state_lock);
+            printf("Lost the primary; reconnecting\n");
+        }
+        sleep_ms(1000);
+        in = replica_attach();
+    }
+    return NULL;
+}
+
+// Blocks until the first snapshot is loaded, so the replica never serves
+// an empty state, then follows the log in the background
+void repl_start_replica(const char* primary) {
+    replica.enabled = true;
+    replica.port = 6000;
+    sscanf(primary, "%127[^:]:%d", replica.host, &replica.port);
+
+    FILE* in;
+    while (!(in = replica_attach())) {
+        printf("Waiting for the primary at %s:%d...\n", replica.host, replica.port);
+        sleep_ms(1000);
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, replica_loop, in);
+    pthread_detach(thread);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "structures.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// --- RISK SCORING ---
+// Every new transaction gets a risk score from 0 to 100, which lowers its
+// base priority by up to 50 (see calculate_base_priority). It adds up four
+// features:
+//   - how much larger the amount is than what the sender usually sends
+//   - how many transactions the sender made in the last minute or so
+//   - whether the sender has paid this receiver before
+//   - whether it arrives at night (UTC)
+// Admission reads the features off the sender's running aggregates,
+// updating them as it goes, into a RiskBatch: one array per feature.
+// risk_score_batch() then scores four at a time where SSE2 is available.
+// Imports fill batches of RISK_BATCH rows; a single transaction is a
+// batch of one.
+//
+// The aggregates are kept beside the customers, not in Customer, so the
+// WAL and snapshot formats are unchanged. They aren't persisted: after a
+// restart they fill up again from new transactions. Scores are logged
+// with their transactions, so recovery never recomputes one.
+
+#define RISK_BATCH 64
+#define RISK_ALPHA 0.1f             // Weight of the newest amount in the running mean and deviation
+#define RISK_MIN_DEVIATION 0.25f    // Floor on the usual spread of log(amount), so a regular sender isn't flagged for small changes
+#define RISK_VELOCITY_TAU 60.0f     // Seconds for the recent-transaction count to decay by 1/e
+#define RISK_VELOCITY_FULL 10.0f    // Recent transactions that score the whole velocity weight
+#define RISK_WARMUP 3               // History needed before amount and receiver count
+#define RISK_NIGHT_START 0          // UTC hours [start, end)
+#define RISK_NIGHT_END 5
+#define RISK_W_AMOUNT 40.0f
+#define RISK_W_VELOCITY 30.0f
+#define RISK_W_RECEIVER 20.0f
+#define RISK_W_NIGHT 10.0f
+
+typedef struct {
+    float log_mean;                 // Running mean of log(1 + amount)
+    float log_deviation;            // Running mean of its absolute deviation
+    float velocity;                 // Decaying transaction count, as of last_seen
+    int count;                      // Transactions sent, up to RISK_WARMUP
+    long long last_seen;
+    unsigned long long receivers[4]; // Bloom filter of receivers paid (two bits each)
+} RiskProfile;
+
+// Features of up to RISK_BATCH transactions, one array each
+typedef struct {
+    int n;
+    float log_amount[RISK_BATCH];
+    float log_mean[RISK_BATCH];
+    float log_deviation[RISK_BATCH];
+    float velocity[RISK_BATCH];
+    float warm[RISK_BATCH];         // 1 once the sender has RISK_WARMUP transactions
+    float new_receiver[RISK_BATCH]; // 0 or 1
+    float night[RISK_BATCH];        // 0 or 1
+    int score[RISK_BATCH];
+} RiskBatch;
+
+// Slot i belongs to account FIRST_ACCOUNT_NUMBER + i. Guarded by
+// state_lock, like admission.
+RiskProfile* risk_profiles;
+int risk_profile_cap = 0;
+
+RiskProfile* risk_profile(int acc_no) {
+    int i = acc_no - FIRST_ACCOUNT_NUMBER;
+    if (i >= risk_profile_cap) {
+        int cap = risk_profile_cap ? risk_profile_cap : 1024;
+        while (cap <= i) cap *= 2;
+        risk_profiles = (RiskProfile*)realloc(risk_profiles, sizeof(RiskProfile) * cap);
+        memset(risk_profiles + risk_profile_cap, 0, sizeof(RiskProfile) * (cap - risk_profile_cap));
+        risk_profile_cap = cap;
+    }
+    return &risk_profiles[i];
+}
+
+// Adds a transaction's features to the batch, as its sender's history
+// stood just before it, then counts it into that history
+static inline void risk_observe(RiskBatch* b, int sender_id, int receiver_id, double amount, long long now) {
+    RiskProfile* p = risk_profile(sender_id);
+    int i = b->n++;
+
+    float x = logf(1.0f + (float)(amount > 0 ? amount : 0));
+    float elapsed = now > p->last_seen ? (float)(now - p->last_seen) : 0.0f;
+    float velocity = p->count ? p->velocity * expf(-elapsed / RISK_VELOCITY_TAU) : 0.0f;
+    unsigned int h = (unsigned int)receiver_id * 2654435761u;
+    int bit1 = h >> 24, bit2 = (h >> 16) & 0xFF;
+    unsigned long long m1 = 1ULL << (bit1 & 63), m2 = 1ULL << (bit2 & 63);
+    bool known = (p->receivers[bit1 >> 6] & m1) && (p->receivers[bit2 >> 6] & m2);
+
+    b->log_amount[i] = x;
+    b->log_mean[i] = p->log_mean;
+    b->log_deviation[i] = p->log_deviation;
+    b->velocity[i] = velocity;
+    b->warm[i] = p->count >= RISK_WARMUP ? 1.0f : 0.0f;
+    b->new_receiver[i] = known ? 0.0f : 1.0f;
+    int hour = (int)((now % 86400 + 86400) % 86400 / 3600); // UTC
+    b->night[i] = (hour >= RISK_NIGHT_START && hour < RISK_NIGHT_END) ? 1.0f : 0.0f;
+
+    if (p->count == 0) {
+        p->log_mean = x;
+    } else {
+        float d = x - p->log_mean;
+        p->log_mean += RISK_ALPHA * d;
+        p->log_deviation += RISK_ALPHA * (fabsf(d) - p->log_deviation);
+    }
+    p->velocity = velocity + 1.0f;
+    p->last_seen = now;
+    if (p->count < RISK_WARMUP) p->count++;
+    p->receivers[bit1 >> 6] |= m1;
+    p->receivers[bit2 >> 6] |= m2;
+}
+
+// Scores lanes [from, b->n) one at a time, with the same float
+// operations in the same order as the SSE2 path, so both give the same
+// scores
+static inline void risk_score_lanes(RiskBatch* b, int from) {
+    for (int i = from; i < b->n; i++) {
+        // Only amounts above the usual count, up to 4 deviations
+        float z = (b->log_amount[i] - b->log_mean[i]) / (b->log_deviation[i] + RISK_MIN_DEVIATION);
+        z = z > 0.0f ? z : 0.0f;
+        z = z < 4.0f ? z : 4.0f;
+        float v = b->velocity[i] * (1.0f / RISK_VELOCITY_FULL);
+        v = v < 1.0f ? v : 1.0f;
+        float s = b->warm[i] * (RISK_W_AMOUNT * 0.25f * z + RISK_W_RECEIVER * b->new_receiver[i])
+                + (RISK_W_VELOCITY * v + RISK_W_NIGHT * b->night[i]);
+        b->score[i] = (int)(s + 0.5f);
+    }
+}
+
+void risk_score_batch(RiskBatch* b) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), four = _mm_set1_ps(4.0f), half = _mm_set1_ps(0.5f);
+    const __m128 min_deviation = _mm_set1_ps(RISK_MIN_DEVIATION), per_velocity = _mm_set1_ps(1.0f / RISK_VELOCITY_FULL);
+    const __m128 w_amount = _mm_set1_ps(RISK_W_AMOUNT * 0.25f), w_receiver = _mm_set1_ps(RISK_W_RECEIVER);
+    const __m128 w_velocity = _mm_set1_ps(RISK_W_VELOCITY), w_night = _mm_set1_ps(RISK_W_NIGHT);
+    for (; i + 4 <= b->n; i += 4) {
+        __m128 z = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(b->log_amount + i), _mm_loadu_ps(b->log_mean + i)),
+                              _mm_add_ps(_mm_loadu_ps(b->log_deviation + i), min_deviation));
+        z = _mm_min_ps(_mm_max_ps(z, zero), four);
+        __m128 v = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(b->velocity + i), per_velocity), one);
+        __m128 history = _mm_add_ps(_mm_mul_ps(w_amount, z), _mm_mul_ps(w_receiver, _mm_loadu_ps(b->new_receiver + i)));
+        __m128 recent = _mm_add_ps(_mm_mul_ps(w_velocity, v), _mm_mul_ps(w_night, _mm_loadu_ps(b->night + i)));
+        __m128 s = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(b->warm + i), history), recent);
+        _mm_storeu_si128((__m128i*)(b->score + i), _mm_cvttps_epi32(_mm_add_ps(s, half)));
+    }
+#endif
+    risk_score_lanes(b, i);
+}
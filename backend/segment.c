@@ -0,0 +1,236 @@
+#include "structures.h"
+#include <math.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// --- HISTORY SEGMENTS ---
+// A full history chunk, written once to a file that never changes again
+// and read back through mmap. Only the pages a query touches are loaded,
+// and the kernel can drop them again at will, so archived history costs
+// disk and page cache rather than heap.
+//
+// Each column is stored frame-of-reference encoded: the smallest value in
+// the segment, then every value minus it in as few bytes as the range
+// needs (0 to 4). Amounts are kept in cents when that is exact, otherwise
+// as doubles; urgency, tier and status share one byte. Every row stays one
+// multiply away, which account listings need as they follow their chains
+// from row to row, and a row takes around 20 bytes instead of 35.
+//
+// The header carries the chunk's summary and, for every HISTORY_BLOCK
+// rows, their time and id ranges: a sparse index that lets aggregates
+// decode only the blocks inside their range and lookups by id decode only
+// the blocks that can hold it. It is copied into memory when the segment
+// is mapped, about 1.3 KB per HISTORY_CHUNK rows.
+
+#define SEGMENT_MAGIC "BANKSEG1"
+#define HISTORY_BLOCK 1024
+#define SEGMENT_BLOCKS (HISTORY_CHUNK / HISTORY_BLOCK)
+#define SEGMENT_RAW 8               // Width of amounts that aren't whole cents
+
+typedef enum {
+    SEG_ID,
+    SEG_SENDER,
+    SEG_RECEIVER,
+    SEG_AMOUNT,
+    SEG_TIME,
+    SEG_CLASSES,                    // urgency | tier << 2 | status << 4
+    SEG_PREV_SENT,
+    SEG_PREV_RECEIVED,
+    SEGMENT_COLUMNS
+} SegmentColumn;
+
+typedef struct {
+    long long base;                 // Smallest value
+    int width;                      // Bytes per value: 0-4, or SEGMENT_RAW
+    int offset;                     // From the start of the file
+} SegmentColumnInfo;
+
+typedef struct {
+    unsigned int min_time, max_time;
+    int min_id, max_id;
+} SegmentBlock;
+
+typedef struct {
+    char magic[8];
+    int header_size;                // sizeof(SegmentHeader) of the build that wrote it
+    int rows;
+    long long size;                 // Of the whole file
+    unsigned int checksum;          // FNV-1a of everything after the header
+    HistorySummary summary;
+    SegmentColumnInfo columns[SEGMENT_COLUMNS];
+    SegmentBlock blocks[SEGMENT_BLOCKS];
+} SegmentHeader;
+
+typedef struct {
+    const unsigned char* map;
+    long long size;
+    SegmentHeader header;           // Copied out, so pruning never waits on the disk
+} HistorySegment;
+
+static const unsigned int segment_mask[5] = { 0, 0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF };
+
+// Row i of an integer column
+static inline long long segment_value(const HistorySegment* s, SegmentColumn col, int i) {
+    const SegmentColumnInfo* c = &s->header.columns[col];
+    unsigned int v;
+    memcpy(&v, s->map + c->offset + (size_t)i * c->width, 4); // Each column is padded for this
+    return c->base + (v & segment_mask[c->width]);
+}
+
+static inline double segment_amount(const HistorySegment* s, int i) {
+    const SegmentColumnInfo* c = &s->header.columns[SEG_AMOUNT];
+    if (c->width != SEGMENT_RAW) return (double)segment_value(s, SEG_AMOUNT, i) / 100.0;
+    double a;
+    memcpy(&a, s->map + c->offset + (size_t)i * SEGMENT_RAW, sizeof(a));
+    return a;
+}
+
+// Row i of chunk c as a segment column holds it (amounts in cents)
+static long long segment_source(const HistoryChunk* c, SegmentColumn col, int i) {
+    switch (col) {
+        case SEG_ID: return c->id[i];
+        case SEG_SENDER: return c->sender[i];
+        case SEG_RECEIVER: return c->receiver[i];
+        case SEG_AMOUNT: return llround(c->amount[i] * 100);
+        case SEG_TIME: return c->time[i];
+        case SEG_CLASSES: return c->urgency[i] | c->tier[i] << 2 | c->status[i] << 4;
+        case SEG_PREV_SENT: return c->prev_sent[i];
+        default: return c->prev_received[i];
+    }
+}
+
+static int segment_align(long long n) {
+    return (int)((n + 7) & ~7LL);
+}
+
+// Encodes full chunk c into a freshly allocated buffer; sets *size
+unsigned char* segment_encode(const HistoryChunk* c, long long* size) {
+    SegmentHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SEGMENT_MAGIC, 8);
+    h.header_size = sizeof(SegmentHeader);
+    h.rows = HISTORY_CHUNK;
+    h.summary = c->summary;
+
+    bool cents = true;
+    for (int i = 0; i < HISTORY_CHUNK && cents; i++) {
+        double a = c->amount[i];
+        cents = fabs(a) < 1e15 && (double)llround(a * 100) / 100.0 == a;
+    }
+
+    int offset = segment_align(sizeof(SegmentHeader));
+    for (int col = 0; col < SEGMENT_COLUMNS; col++) {
+        SegmentColumnInfo* info = &h.columns[col];
+        info->offset = offset;
+        if (col == SEG_AMOUNT && !cents) {
+            info->width = SEGMENT_RAW;
+        } else {
+            long long lo = LLONG_MAX, hi = LLONG_MIN;
+            for (int i = 0; i < HISTORY_CHUNK; i++) {
+                long long v = segment_source(c, (SegmentColumn)col, i);
+                if (v < lo) lo = v;
+                if (v > hi) hi = v;
+            }
+            unsigned long long range = (unsigned long long)(hi - lo);
+            info->base = lo;
+            info->width = range == 0 ? 0 : range <= 0xFF ? 1 : range <= 0xFFFF ? 2 : range <= 0xFFFFFF ? 3 : 4;
+            if (range > 0xFFFFFFFFULL) info->width = SEGMENT_RAW; // Only amounts get this wide
+        }
+        offset = segment_align(offset + (long long)HISTORY_CHUNK * info->width + 4);
+    }
+    h.size = offset;
+
+    for (int b = 0; b < SEGMENT_BLOCKS; b++) {
+        SegmentBlock* block = &h.blocks[b];
+        block->min_time = UINT_MAX;
+        block->min_id = INT_MAX;
+        block->max_id = INT_MIN;
+        for (int i = b * HISTORY_BLOCK; i < (b + 1) * HISTORY_BLOCK; i++) {
+            if (c->time[i] < block->min_time) block->min_time = c->time[i];
+            if (c->time[i] > block->max_time) block->max_time = c->time[i];
+            if (c->id[i] < block->min_id) block->min_id = c->id[i];
+            if (c->id[i] > block->max_id) block->max_id = c->id[i];
+        }
+    }
+
+    unsigned char* buf = (unsigned char*)calloc(1, h.size);
+    if (!buf) return NULL;
+    for (int col = 0; col < SEGMENT_COLUMNS; col++) {
+        const SegmentColumnInfo* info = &h.columns[col];
+        unsigned char* out = buf + info->offset;
+        if (info->width == SEGMENT_RAW) {
+            memcpy(out, c->amount, sizeof(double) * HISTORY_CHUNK);
+            continue;
+        }
+        if (info->width == 0) continue;
+        for (int i = 0; i < HISTORY_CHUNK; i++) {
+            unsigned int v = (unsigned int)(segment_source(c, (SegmentColumn)col, i) - info->base);
+            memcpy(out + (size_t)i * info->width, &v, info->width); // Low bytes first, as segment_value reads them
+        }
+    }
+    h.checksum = fnv1a(buf + sizeof(h), (int)(h.size - sizeof(h)));
+    memcpy(buf, &h, sizeof(h));
+    *size = h.size;
+    return buf;
+}
+
+#ifndef _WIN32
+// Writes chunk c to `path` through a temporary file, so a crash leaves
+// either the whole segment or none of it
+bool segment_write(const HistoryChunk* c, const char* path) {
+    long long size;
+    unsigned char* buf = segment_encode(c, &size);
+    if (!buf) return false;
+
+    char tmp_path[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* f = fopen(tmp_path, "wb");
+    bool ok = f && fwrite(buf, 1, size, f) == (size_t)size;
+    if (f) {
+        sync_file(f);
+        ok = fclose(f) == 0 && ok;
+    }
+    free(buf);
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+// Maps the segment at `path`; NULL if it is missing, or damaged (and then
+// says so). Checking the checksum reads the whole file, so the archiver,
+// which has just written it, skips that.
+HistorySegment* segment_map(const char* path, bool verify) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SegmentHeader)) {
+        close(fd);
+        printf("%s is damaged\n", path);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const SegmentHeader* h = (const SegmentHeader*)map;
+    if (memcmp(h->magic, SEGMENT_MAGIC, 8) != 0 || h->header_size != (int)sizeof(SegmentHeader) ||
+        h->rows != HISTORY_CHUNK || h->size != st.st_size ||
+        (verify && fnv1a((const unsigned char*)map + sizeof(SegmentHeader), (int)(h->size - sizeof(SegmentHeader))) != h->checksum)) {
+        printf("%s is damaged or was written by an incompatible build\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    HistorySegment* s = (HistorySegment*)malloc(sizeof(HistorySegment));
+    s->map = (const unsigned char*)map;
+    s->size = st.st_size;
+    s->header = *h;
+    return s;
+}
+#endif
@@ -7,54 +7,254 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
 #define closesocket close
 #endif
 #include <sys/stat.h>
+#include <limits.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 #include "logic.c"
+#include "recovery.c"
+#include "replication.c"
+#include "http.c"
+#include "assets.c"
+#include "json.c"
+#include "import.c"
 
 #define PORT 5000
 #define BUFFER_SIZE 4096
+#define MAX_EVENTS 256
+#define MAX_WORKERS 64
+#define OUT_HIGH_WATER (256 * 1024) // Stop reading while this much is unsent
+#define SSE_MAX_BACKLOG (64 * 1024)  // Unsent bytes before a subscriber is skipped
+#define SSE_PING_SECONDS 15
+
+// One client connection. Requests are accumulated in `in` and responses
+// are queued in `out`, so a slow reader never blocks a worker. Both buffers
+// live as long as the connection and are reused across requests.
+typedef struct Connection {
+    SOCKET fd;
+    char* in;
+    int in_len, in_cap;
+    int in_start;     // First byte not yet consumed by a request
+    int scanned;      // Parser progress on the pending request
+    char* out;
+    int out_len, out_cap, out_sent;
+    const char* out_body; // Cached file body sent after out[0..out_body_at), not copied
+    int out_body_at, out_body_len, out_body_sent;
+    bool keep_alive;  // Of the request being answered
+    bool http10;
+    bool closing;     // Close once `out` is drained
+    bool want_write;  // Waiting for EPOLLOUT
+    bool dead;        // Closed; its events in the current batch are stale
+    Route route;      // Of the request being answered, for metrics
+    long long commit_lsn; // WAL position the queued responses depend on
+    bool awaiting_commit; // Responses held until commit_lsn is on disk
+    bool parked;          // Linked into its worker's parked list meanwhile
+    long long commit_since;
+    struct Connection* park_prev;
+    struct Connection* park_next;
+
+    // Event-stream subscribers (GET /api/events)
+    bool subscriber;
+    bool subscribed;      // Linked into its worker's list
+    long long sent_version;
+    time_t last_event;
+    struct Connection* sub_prev;
+    struct Connection* sub_next;
+} Connection;
+
+Connection* conn_create(SOCKET fd) {
+    Connection* conn = (Connection*)calloc(1, sizeof(Connection));
+    conn->fd = fd;
+    return conn;
+}
+
+void conn_destroy(Connection* conn) {
+    closesocket(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+// Make sure `buf` can hold `need` bytes (doubling growth)
+void buf_reserve(char** buf, int* cap, int need) {
+    if (need <= *cap) return;
+    int new_cap = *cap ? *cap : BUFFER_SIZE;
+    while (new_cap < need) new_cap *= 2;
+    *buf = (char*)realloc(*buf, new_cap);
+    *cap = new_cap;
+}
+
+void conn_write(Connection* conn, const char* data, int len) {
+    buf_reserve(&conn->out, &conn->out_cap, conn->out_len + len);
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+}
+
+// Queues a body that outlives the connection (a cached file) by
+// reference. One at a time; another is copied like any other output.
+void conn_attach_body(Connection* conn, const char* body, int len) {
+#ifndef _WIN32
+    if (!conn->out_body && len > 0) {
+        conn->out_body = body;
+        conn->out_body_at = conn->out_len;
+        conn->out_body_len = len;
+        conn->out_body_sent = 0;
+        return;
+    }
+#endif
+    conn_write(conn, body, len);
+}
+
+bool conn_pending(Connection* conn) {
+    return conn->out_sent < conn->out_len || conn->out_body;
+}
+
+#ifndef _WIN32
+// One sendmsg of what is queued, in order: `out` up to the attached body,
+// the body, then the rest of `out`. Returns what sendmsg returned.
+ssize_t conn_send_some(Connection* conn, int flags) {
+    struct iovec iov[3];
+    int parts = 0;
+    if (conn->out_body) {
+        if (conn->out_sent < conn->out_body_at) {
+            iov[parts].iov_base = conn->out + conn->out_sent;
+            iov[parts++].iov_len = conn->out_body_at - conn->out_sent;
+        }
+        iov[parts].iov_base = (void*)(conn->out_body + conn->out_body_sent);
+        iov[parts++].iov_len = conn->out_body_len - conn->out_body_sent;
+        if (conn->out_body_at < conn->out_len) {
+            iov[parts].iov_base = conn->out + conn->out_body_at;
+            iov[parts++].iov_len = conn->out_len - conn->out_body_at;
+        }
+    } else {
+        iov[parts].iov_base = conn->out + conn->out_sent;
+        iov[parts++].iov_len = conn->out_len - conn->out_sent;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = parts;
+    ssize_t n = sendmsg(conn->fd, &msg, flags);
+    if (n <= 0) return n;
+
+    ssize_t left = n;
+    if (conn->out_body) {
+        if (conn->out_sent < conn->out_body_at) {
+            int k = (left < conn->out_body_at - conn->out_sent) ? (int)left : conn->out_body_at - conn->out_sent;
+            conn->out_sent += k;
+            left -= k;
+        }
+        int k = (left < conn->out_body_len - conn->out_body_sent) ? (int)left : conn->out_body_len - conn->out_body_sent;
+        conn->out_body_sent += k;
+        left -= k;
+        if (conn->out_body_sent == conn->out_body_len) conn->out_body = NULL;
+    }
+    conn->out_sent += (int)left;
+    return n;
+}
+#endif
+
+// Sends what is queued without blocking, so a long response can leave
+// while it is still being produced. Whatever doesn't fit stays queued
+// for the event loop.
+void conn_try_send(Connection* conn) {
+#ifndef _WIN32
+    while (conn_pending(conn)) {
+        if (conn_send_some(conn, MSG_NOSIGNAL | MSG_DONTWAIT) <= 0) return;
+    }
+    conn->out_len = conn->out_sent = 0;
+#endif
+}
 
 // --- HELPER FUNCTIONS ---
 
-const char* get_mime_type(const char* path) {
-    const char* ext = strrchr(path, '.');
-    if (!ext) return "text/plain";
-    if (strcmp(ext, ".html") == 0) return "text/html";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".js") == 0) return "application/javascript";
-    if (strcmp(ext, ".json") == 0) return "application/json";
-    return "text/plain";
+void send_response(Connection* conn, const char* header, const char* body) {
+    conn_write(conn, header, strlen(header));
+    conn_write(conn, body, strlen(body));
 }
 
-void send_response(SOCKET client_socket, const char* header, const char* body) {
-    send(client_socket, header, strlen(header), 0);
-    send(client_socket, body, strlen(body), 0);
+const char* connection_header(Connection* conn) {
+    return conn->keep_alive ? "" : "Connection: close\r\n";
 }
 
-void send_json(SOCKET client_socket, const char* json_body) {
+void send_json(Connection* conn, const char* json_body) {
     char header[512];
     sprintf(header, 
         "HTTP/1.1 200 OK\r\n"
         "Content-Type: application/json\r\n"
         "Content-Length: %llu\r\n"
+        "%s"
         "Access-Control-Allow-Origin: *\r\n\r\n", 
-        (unsigned long long)strlen(json_body));
-    send_response(client_socket, header, json_body);
+        (unsigned long long)strlen(json_body), connection_header(conn));
+    send_response(conn, header, json_body);
+}
+
+// An error the client should retry after `retry_after` seconds: 429 or 503
+void send_json_retry(Connection* conn, const char* status, double retry_after, const char* json_body) {
+    int seconds = (int)ceil(retry_after);
+    if (seconds < 1) seconds = 1;
+    if (seconds > ADMIT_MAX_RETRY) seconds = ADMIT_MAX_RETRY;
+    char header[512];
+    sprintf(header,
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %llu\r\n"
+        "Retry-After: %d\r\n"
+        "%s"
+        "Access-Control-Allow-Origin: *\r\n\r\n",
+        status, (unsigned long long)strlen(json_body), seconds, connection_header(conn));
+    send_response(conn, header, json_body);
 }
 
-void send_file(SOCKET client_socket, const char* filepath) {
+void send_not_found(Connection* conn) {
+    char msg[128];
+    sprintf(msg, "HTTP/1.1 404 Not Found\r\nContent-Length: 14\r\n%s\r\nFile Not Found", connection_header(conn));
+    conn_write(conn, msg, strlen(msg));
+}
+
+// True if a request path can't leave ASSET_DIR: once %XX escapes are
+// decoded it has no ".." segment, no backslash and no NUL
+bool asset_path_safe(const char* path) {
+    char decoded[256];
+    int n = 0;
+    for (const char* s = path; *s && n < (int)sizeof(decoded) - 1; s++) {
+        unsigned int c = (unsigned char)*s;
+        if (c == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            sscanf(s + 1, "%2x", &c);
+            s += 2;
+        }
+        if (c == 0 || c == '\\') return false;
+        decoded[n++] = (char)c;
+    }
+    decoded[n] = 0;
+
+    for (const char* seg = decoded; seg; seg = strchr(seg, '/')) {
+        if (*seg == '/') seg++;
+        if (seg[0] == '.' && seg[1] == '.' && (seg[2] == '/' || seg[2] == 0)) return false;
+    }
+    return true;
+}
+
+void send_file(Connection* conn, const char* filepath) {
     FILE* f = fopen(filepath, "rb");
     if (!f) {
         if (strncmp(filepath, "./", 2) == 0) f = fopen(filepath + 2, "rb");
     }
 
     if (!f) {
-        const char* msg = "HTTP/1.1 404 Not Found\r\n\r\nFile Not Found";
-        send(client_socket, msg, strlen(msg), 0);
+        send_not_found(conn);
         return;
     }
 
@@ -71,167 +271,1483 @@ void send_file(SOCKET client_socket, const char* filepath) {
     sprintf(header, 
         "HTTP/1.1 200 OK\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %ld\r\n\r\n", 
-        get_mime_type(filepath), fsize);
+        "Content-Length: %ld\r\n"
+        "%s\r\n", 
+        get_mime_type(filepath), fsize, connection_header(conn));
 
-    send(client_socket, header, strlen(header), 0);
-    send(client_socket, content, fsize, 0);
+    conn_write(conn, header, strlen(header));
+    conn_write(conn, content, fsize);
     free(content);
 }
 
+// A cached frontend file (see assets.c): a 304 if the client's copy is
+// current, else the smallest encoding it accepts. False if not cached.
+bool send_asset(Connection* conn, HttpRequest* req) {
+    Asset* a = find_asset(req->path);
+    if (!a) return false;
+
+    AssetVariant* v = asset_revalidated(a, req->if_none_match, req->accept);
+    bool modified = !v;
+    if (modified) v = asset_pick(a, req->accept);
+    const char* close = connection_header(conn);
+    if (modified) conn_write(conn, v->header, v->header_len);
+    else conn_write(conn, v->not_modified, v->not_modified_len);
+    conn_write(conn, close, strlen(close));
+    conn_write(conn, "\r\n", 2);
+    if (modified && strcmp(req->method, "HEAD") != 0) conn_attach_body(conn, v->body, v->length);
+    return true;
+}
+
+// --- STREAMING JSON ---
+// Writes straight into the connection's output buffer using chunked
+// transfer encoding: every JSON_CHUNK_SIZE bytes the chunk is framed and
+// handed to the socket, so the buffer stays small and nothing is
+// allocated per request once it has warmed up.
+
+#define JSON_CHUNK_SIZE 16384
+#define CHUNK_PREFIX 8 // "xxxxxx\r\n", patched when the chunk closes
+
+typedef struct {
+    Connection* conn;
+    bool chunked;      // HTTP/1.0 gets an unframed body ended by close
+    int chunk_start;   // Offset of the open chunk's size field
+} JsonStream;
+
+void js_open_chunk(JsonStream* js) {
+    if (!js->chunked) return;
+    js->chunk_start = js->conn->out_len;
+    conn_write(js->conn, "000000\r\n", CHUNK_PREFIX);
+}
+
+void js_close_chunk(JsonStream* js) {
+    if (!js->chunked) return;
+    Connection* conn = js->conn;
+    int size = conn->out_len - js->chunk_start - CHUNK_PREFIX;
+    if (size == 0) {
+        conn->out_len = js->chunk_start; // A zero-size chunk would end the body
+        return;
+    }
+    static const char hex[] = "0123456789abcdef";
+    char* p = conn->out + js->chunk_start;
+    for (int i = 5; i >= 0; i--, size >>= 4) p[i] = hex[size & 15];
+    conn_write(conn, "\r\n", 2);
+}
+
+// Room for `n` more bytes, rolling over to a new chunk when this one is full
+char* js_reserve(JsonStream* js, int n) {
+    Connection* conn = js->conn;
+    if (conn->out_len - js->chunk_start >= JSON_CHUNK_SIZE) {
+        js_close_chunk(js);
+        // Earlier pipelined responses may still wait on the log; they and
+        // this one go out together once it is on disk
+        if (wal_durable() >= conn->commit_lsn) conn_try_send(conn);
+        js_open_chunk(js);
+        if (!js->chunked) js->chunk_start = conn->out_len;
+    }
+    buf_reserve(&conn->out, &conn->out_cap, conn->out_len + n);
+    return conn->out + conn->out_len;
+}
+
+void js_raw(JsonStream* js, const char* s, int len) {
+    memcpy(js_reserve(js, len), s, len);
+    js->conn->out_len += len;
+}
+
+#define JS_LIT(js, s) js_raw(js, s, sizeof(s) - 1)
+
+// Digits written backwards into a small buffer; no printf
+int format_int(char* out, long long v) {
+    char tmp[24];
+    int n = 0;
+    unsigned long long u = (v < 0) ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    do { tmp[n++] = '0' + (u % 10); u /= 10; } while (u);
+    int len = 0;
+    if (v < 0) out[len++] = '-';
+    while (n) out[len++] = tmp[--n];
+    return len;
+}
+
+void js_int(JsonStream* js, long long v) {
+    js->conn->out_len += format_int(js_reserve(js, 24), v);
+}
+
+// Two decimals, like %.2f, via integer cents
+void js_money(JsonStream* js, double v) {
+    char* p = js_reserve(js, 48);
+    if (v != v || v > 9e15 || v < -9e15) {
+        js->conn->out_len += snprintf(p, 48, "%.2f", v); // Out of exact range, NaN
+        return;
+    }
+    long long cents = llround(v * 100.0);
+    int len = 0;
+    if (cents < 0) {
+        p[len++] = '-';
+        cents = -cents;
+    }
+    len += format_int(p + len, cents / 100);
+    p[len++] = '.';
+    p[len++] = '0' + (cents % 100) / 10;
+    p[len++] = '0' + cents % 10;
+    js->conn->out_len += len;
+}
+
+void js_string(JsonStream* js, const char* s) {
+    int len = (int)strlen(s);
+    char* p = js_reserve(js, len * 6 + 2); // Worst case: every byte \u00XX
+    char* start = p;
+    *p++ = '"';
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    js->conn->out_len += (int)(p - start);
+}
+
+// Starts a body (or, for event streams, the next piece of one) whose
+// headers were already written
+void js_open(JsonStream* js, Connection* conn) {
+    js->conn = conn;
+    js->chunked = !conn->http10;
+    js->chunk_start = conn->out_len;
+    js_open_chunk(js);
+}
+
+void js_begin(JsonStream* js, Connection* conn) {
+    if (conn->http10) conn->keep_alive = false; // Only the close can end the body
+
+    char header[256];
+    sprintf(header,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "%s"
+        "%s"
+        "Access-Control-Allow-Origin: *\r\n\r\n",
+        conn->http10 ? "" : "Transfer-Encoding: chunked\r\n", connection_header(conn));
+    conn_write(conn, header, strlen(header));
+    js_open(js, conn);
+}
+
+void js_end(JsonStream* js) {
+    js_close_chunk(js);
+    if (js->chunked) conn_write(js->conn, "0\r\n\r\n", 5);
+}
+
 // --- API HANDLERS ---
 
-void handle_get_state(SOCKET client_socket) {
-    update_system_state(); 
-
-    // Allocate buffer (Increased for customer list just in case, though mainly for transactions)
-    char* buffer = (char*)malloc(1024 * 1024); 
-    strcpy(buffer, "{ \"transactions\": [");
-
-    for (int i = 0; i < state.tx_count; i++) {
-        Transaction* t = &state.all_transactions[i];
-        char tx_json[512];
-        sprintf(tx_json, 
-            "{\"id\":%d, \"sender\":%d, \"receiver\":%d, \"amount\":%.2f, \"urgency\":%d, \"tier\":%d, \"status\":%d, "
-            "\"base_priority\":%.2f, \"effective_priority\":%.2f, \"arrival\":%lld, \"unlock\":%lld}%s",
-            t->id, t->sender_id, t->receiver_id, t->amount, t->urgency, t->tier, t->status,
-            t->base_priority, t->effective_priority, (long long)t->arrival_time, (long long)t->unlock_time,
-            (i < state.tx_count - 1) ? "," : "");
-        strcat(buffer, tx_json);
-    }
-    
-    // Add Customers (Securely? Admin sees names/ids, no pins)
-    strcat(buffer, "], \"customers\": [");
-    for (int i=0; i < state.customer_count; i++) {
-        Customer* c = &state.all_customers[i];
-         char cust_json[256];
-         sprintf(cust_json, 
-            "{\"id\":%d, \"name\":\"%s\", \"tier\":%d, \"balance\":%.2f}%s",
-            c->account_number, c->name, c->tier, c->balance,
-            (i < state.customer_count - 1) ? "," : "");
-         strcat(buffer, cust_json);
-    }
-
-    strcat(buffer, "], \"stats\": {");
-    char stats[256];
-    sprintf(stats, "\"processed\":%d, \"cancelled\":%d, \"waiting_pq\":%d, \"locked\":%d } }", 
-        state.processed_count, state.cancelled_count, state.priority_queue->size, state.time_lock_queue->size);
-    strcat(buffer, stats);
-
-    send_json(client_socket, buffer);
-    free(buffer);
-}
-
-void handle_create_customer(SOCKET client_socket, char* body) {
+void js_transaction(JsonStream* js, Transaction* t, time_t now) {
+    JS_LIT(js, "{\"id\":"); js_int(js, t->id);
+    JS_LIT(js, ",\"sender\":"); js_int(js, t->sender_id);
+    JS_LIT(js, ",\"receiver\":"); js_int(js, t->receiver_id);
+    JS_LIT(js, ",\"amount\":"); js_money(js, t->amount);
+    JS_LIT(js, ",\"urgency\":"); js_int(js, t->urgency);
+    JS_LIT(js, ",\"tier\":"); js_int(js, t->tier);
+    JS_LIT(js, ",\"status\":"); js_int(js, t->status);
+    JS_LIT(js, ",\"risk\":"); js_int(js, t->risk_score);
+    JS_LIT(js, ",\"base_priority\":"); js_money(js, t->base_priority);
+    JS_LIT(js, ",\"effective_priority\":"); js_money(js, effective_priority(t, now));
+    JS_LIT(js, ",\"arrival\":"); js_int(js, (long long)t->arrival_time);
+    JS_LIT(js, ",\"unlock\":"); js_int(js, (long long)t->unlock_time);
+    JS_LIT(js, "}");
+}
+
+// Admin sees names/ids, no pins
+void js_customer(JsonStream* js, Customer* c) {
+    JS_LIT(js, "{\"id\":"); js_int(js, c->account_number);
+    JS_LIT(js, ",\"name\":"); js_string(js, c->name);
+    JS_LIT(js, ",\"tier\":"); js_int(js, c->tier);
+    JS_LIT(js, ",\"balance\":"); js_money(js, c->balance);
+    JS_LIT(js, "}");
+}
+
+// "waiting,locked" -> bit per TxStatus; unknown names are ignored
+int parse_status_filter(const char* list) {
+    static const char* names[] = { "waiting", "locked", "processing", "done", "cancelled" };
+    int mask = 0;
+    for (int i = 0; i < 5; i++) {
+        if (strstr(list, names[i])) mask |= 1 << i;
+    }
+    return mask;
+}
+
+bool delta_available(long long since) {
+    return since >= 0 && since <= state.version && since >= oldest_change() - 1;
+}
+
+// --- STATE SNAPSHOTS ---
+// /api/state and /api/events copy what they are going to list while
+// holding state_lock, which takes about as long as a memcpy, and format the
+// JSON after releasing it. A big listing to a slow client never holds up
+// writers. Each thread reuses its own buffers.
+
+typedef struct {
+    long long epoch;
+    long long version;
+    time_t now;
+    bool full;
+    int next_cursor;
+    Transaction* txs;
+    int tx_count, tx_cap;
+    int* removed;
+    int removed_count, removed_cap;
+    Customer* customers;
+    int customer_count, customer_cap;
+    int processed, cancelled, waiting, locked;
+} StateView;
+
+__thread StateView thread_view;
+
+void* view_grow(void* items, int* cap, int elem_size) {
+    *cap = *cap ? *cap * 2 : 256;
+    return realloc(items, (size_t)*cap * elem_size);
+}
+
+void view_add_tx(StateView* v, Transaction* t) {
+    if (v->tx_count == v->tx_cap) v->txs = (Transaction*)view_grow(v->txs, &v->tx_cap, sizeof(Transaction));
+    v->txs[v->tx_count++] = published_transaction(t);
+}
+
+void view_add_customer(StateView* v, Customer* c) {
+    if (v->customer_count == v->customer_cap) {
+        v->customers = (Customer*)view_grow(v->customers, &v->customer_cap, sizeof(Customer));
+    }
+    v->customers[v->customer_count++] = published_customer(c);
+}
+
+void view_add_removed(StateView* v, int id) {
+    if (v->removed_count == v->removed_cap) v->removed = (int*)view_grow(v->removed, &v->removed_cap, sizeof(int));
+    v->removed[v->removed_count++] = id;
+}
+
+// Fills this thread's view; returns NULL without copying anything when
+// nothing changed after `unless_version` (pass -1 to always copy)
+StateView* collect_state(long long since, int status_mask, int cursor, int limit, long long unless_version) {
+    StateView* v = &thread_view;
+    v->tx_count = v->removed_count = v->customer_count = 0;
+    v->next_cursor = -1;
+
+    pthread_mutex_lock(&state_lock);
+    if (state.version == unless_version) {
+        pthread_mutex_unlock(&state_lock);
+        return NULL;
+    }
+    bool delta = delta_available(since);
+    v->epoch = state.epoch;
+    v->version = state.version;
+    v->now = engine_now();
+    v->full = !delta;
+
+    if (delta) {
+        // An entity is listed at its latest change only
+        for (long long ver = since + 1; ver <= state.version; ver++) {
+            ChangeEntry* e = &state.changes.entries[(ver - 1) % CHANGELOG_SIZE];
+            if (e->kind == CHANGE_TX) {
+                Transaction* t = find_transaction(e->id);
+                if (!t || t->version != ver) continue;
+                // One that moved out of the filter is gone as far as this
+                // listing goes
+                if (status_mask & (1 << t->status)) view_add_tx(v, t);
+                else view_add_removed(v, e->id);
+            } else if (e->kind == CHANGE_TX_REMOVED) {
+                view_add_removed(v, e->id);
+            } else {
+                Customer* c = find_customer(e->id);
+                if (c && c->version == ver) view_add_customer(v, c);
+            }
+        }
+    } else {
+        for (int i = cursor; i < state.transactions.count; i++) {
+            Transaction* t = transaction_at(i);
+            if (t->status == STATUS_FREE || !(status_mask & (1 << t->status))) continue;
+            if (v->tx_count == limit) {
+                v->next_cursor = i;
+                break;
+            }
+            view_add_tx(v, t);
+        }
+        // Customers come with the first page of a full listing
+        if (cursor == 0) {
+            for (int i = 0; i < state.customers.count; i++) view_add_customer(v, (Customer*)arena_at(&state.customers, i));
+        }
+    }
+
+    v->processed = state.processed_count;
+    v->cancelled = state.cancelled_count;
+    v->waiting = waiting_count();
+    v->locked = state.time_locks.count;
+    pthread_mutex_unlock(&state_lock);
+    return v;
+}
+
+void write_state_json(JsonStream* js_out, StateView* v) {
+    JsonStream js = *js_out;
+
+    JS_LIT(&js, "{\"epoch\":"); js_int(&js, v->epoch);
+    JS_LIT(&js, ",\"version\":"); js_int(&js, v->version);
+    JS_LIT(&js, ",\"now\":"); js_int(&js, (long long)v->now);
+    if (v->full) JS_LIT(&js, ",\"full\":true");
+    else JS_LIT(&js, ",\"full\":false");
+
+    JS_LIT(&js, ",\"transactions\":[");
+    for (int i = 0; i < v->tx_count; i++) {
+        if (i > 0) JS_LIT(&js, ",");
+        js_transaction(&js, &v->txs[i], v->now);
+    }
+    JS_LIT(&js, "]");
+
+    if (!v->full) {
+        JS_LIT(&js, ",\"removed\":[");
+        for (int i = 0; i < v->removed_count; i++) {
+            if (i > 0) JS_LIT(&js, ",");
+            js_int(&js, v->removed[i]);
+        }
+        JS_LIT(&js, "]");
+    }
+
+    JS_LIT(&js, ",\"customers\":[");
+    for (int i = 0; i < v->customer_count; i++) {
+        if (i > 0) JS_LIT(&js, ",");
+        js_customer(&js, &v->customers[i]);
+    }
+
+    JS_LIT(&js, "],\"next_cursor\":"); js_int(&js, v->next_cursor);
+    JS_LIT(&js, ",\"stats\":{\"processed\":"); js_int(&js, v->processed);
+    JS_LIT(&js, ",\"cancelled\":"); js_int(&js, v->cancelled);
+    JS_LIT(&js, ",\"waiting_pq\":"); js_int(&js, v->waiting);
+    JS_LIT(&js, ",\"locked\":"); js_int(&js, v->locked);
+    JS_LIT(&js, "}}");
+    *js_out = js;
+}
+
+// GET /api/state[?since=V&epoch=E][&status=a,b][&cursor=C&limit=N]
+//   since/epoch: only what changed after version V of run E, plus the ids
+//                of transactions that dropped out of history or out of the
+//                status filter. Falls back to a full listing ("full":true)
+//                when V is too old.
+//   status:      only transactions in these states
+//   cursor/limit: page through a full listing; follow "next_cursor"
+void handle_get_state(Connection* conn, const char* query) {
+    char val[64];
+    long long since = -1;
+    int status_mask = ~0, cursor = 0, limit = INT_MAX;
+    if (query_param(query, "since", val, sizeof(val))) since = atoll(val);
+    if (query_param(query, "epoch", val, sizeof(val)) && atoll(val) != state.epoch) since = -1;
+    if (query_param(query, "status", val, sizeof(val))) status_mask = parse_status_filter(val);
+    if (query_param(query, "cursor", val, sizeof(val))) cursor = atoi(val);
+    if (query_param(query, "limit", val, sizeof(val)) && atoi(val) > 0) limit = atoi(val);
+    if (cursor < 0) cursor = 0;
+
+    StateView* v = collect_state(since, status_mask, cursor, limit, -1);
+    JsonStream js;
+    js_begin(&js, conn);
+    write_state_json(&js, v);
+    js_end(&js);
+}
+
+// --- HISTORY QUERIES ---
+// Both read the history store (history.c) without holding state_lock
+// beyond looking up an account.
+
+#define HISTORY_PAGE_DEFAULT 50
+#define HISTORY_PAGE_MAX 1000
+
+void write_history_row(JsonStream* js, const HistoryRow* r) {
+    JS_LIT(js, "{\"id\":"); js_int(js, r->id);
+    JS_LIT(js, ",\"sender\":"); js_int(js, r->sender);
+    JS_LIT(js, ",\"receiver\":"); js_int(js, r->receiver);
+    JS_LIT(js, ",\"amount\":"); js_money(js, r->amount);
+    JS_LIT(js, ",\"urgency\":"); js_int(js, r->urgency);
+    JS_LIT(js, ",\"tier\":"); js_int(js, r->tier);
+    JS_LIT(js, ",\"status\":"); js_int(js, r->status);
+    JS_LIT(js, ",\"arrival\":"); js_int(js, r->time);
+    JS_LIT(js, "}");
+}
+
+// GET /api/history?account=N[&role=sent|received][&limit=L][&cursor=C]
+//   Finished transfers of one account, newest first. Follow "next_cursor"
+//   (null on the last page) for older ones.
+// GET /api/history?id=N
+//   One finished transfer, archived ones included: {"transaction":{...}}
+void handle_history(Connection* conn, const char* query) {
+    char val[64];
+    int account = 0, limit = HISTORY_PAGE_DEFAULT;
+    if (query_param(query, "id", val, sizeof(val))) {
+        HistoryRow row;
+        if (!history_find(atoi(val), &row)) {
+            send_json(conn, "{\"error\":\"Transaction Not Found\"}");
+            return;
+        }
+        JsonStream js;
+        js_begin(&js, conn);
+        JS_LIT(&js, "{\"transaction\":");
+        write_history_row(&js, &row);
+        JS_LIT(&js, "}");
+        js_end(&js);
+        return;
+    }
+    bool want_sent = true, want_received = true;
+    if (query_param(query, "account", val, sizeof(val))) account = atoi(val);
+    if (query_param(query, "limit", val, sizeof(val)) && atoi(val) > 0) limit = atoi(val);
+    if (limit > HISTORY_PAGE_MAX) limit = HISTORY_PAGE_MAX;
+    if (query_param(query, "role", val, sizeof(val))) {
+        want_sent = strcmp(val, "received") != 0;
+        want_received = strcmp(val, "sent") != 0;
+    }
+
+    int sent, received;
+    if (!history_heads(account, &sent, &received)) {
+        send_json(conn, "{\"error\":\"Account Not Found\"}");
+        return;
+    }
+    // The cursor is where the two chains left off: "sent,received"
+    if (query_param(query, "cursor", val, sizeof(val)) && sscanf(val, "%d,%d", &sent, &received) != 2) sent = received = -1;
+    if (!want_sent) sent = -1;
+    if (!want_received) received = -1;
+
+    HistoryRow* rows = (HistoryRow*)malloc(sizeof(HistoryRow) * limit);
+    int n = history_page(account, &sent, &received, limit, rows);
+
+    JsonStream js;
+    js_begin(&js, conn);
+    JS_LIT(&js, "{\"account\":"); js_int(&js, account);
+    JS_LIT(&js, ",\"transactions\":[");
+    for (int i = 0; i < n; i++) {
+        if (i > 0) JS_LIT(&js, ",");
+        write_history_row(&js, &rows[i]);
+    }
+    JS_LIT(&js, "],\"next_cursor\":");
+    if (sent < 0 && received < 0) {
+        JS_LIT(&js, "null");
+    } else {
+        char cursor[32];
+        snprintf(cursor, sizeof(cursor), "%d,%d", sent, received);
+        js_string(&js, cursor);
+    }
+    JS_LIT(&js, "}");
+    js_end(&js);
+    free(rows);
+}
+
+// GET /api/aggregate?by=tier|urgency|status|time[&from=T][&to=T][&bucket=S]
+//   Count and volume of finished transfers that arrived in [from, to)
+//   (Unix seconds; everything by default), per class or per time bucket
+//   of S seconds (default 3600, UTC-aligned). By time, the range defaults
+//   to the last 24 buckets.
+void handle_aggregate(Connection* conn, const char* query) {
+    char val[64];
+    HistoryDimension by;
+    const char* const* names = NULL;
+    if (!query_param(query, "by", val, sizeof(val))) val[0] = 0;
+    if (strcmp(val, "tier") == 0) { by = HISTORY_BY_TIER; names = tier_names; }
+    else if (strcmp(val, "urgency") == 0) { by = HISTORY_BY_URGENCY; names = urgency_names; }
+    else if (strcmp(val, "status") == 0) { by = HISTORY_BY_STATUS; }
+    else if (strcmp(val, "time") == 0) { by = HISTORY_BY_TIME; }
+    else {
+        send_json(conn, "{\"error\":\"Unknown Grouping\"}");
+        return;
+    }
+    static const char* status_names[2] = { "done", "cancelled" };
+    if (by == HISTORY_BY_STATUS) names = status_names;
+
+    unsigned int bucket = 3600;
+    if (query_param(query, "bucket", val, sizeof(val)) && atoll(val) > 0) bucket = (unsigned int)atoll(val);
+    unsigned int from = 0, to = UINT_MAX;
+    bool has_from = query_param(query, "from", val, sizeof(val));
+    if (has_from) from = (unsigned int)strtoul(val, NULL, 10);
+    if (query_param(query, "to", val, sizeof(val))) to = (unsigned int)strtoul(val, NULL, 10);
+    if (by == HISTORY_BY_TIME) {
+        if (to == UINT_MAX) to = (unsigned int)engine_now() + 1;
+        if (!has_from) from = to > 24ULL * bucket ? (to / bucket - 23) * bucket : 0;
+    }
+
+    HistoryGroup* groups = (HistoryGroup*)malloc(sizeof(HistoryGroup) * HISTORY_MAX_BUCKETS);
+    int n = history_aggregate(by, from, to, bucket, groups);
+    if (n < 0) {
+        free(groups);
+        send_json(conn, "{\"error\":\"Too Many Buckets\"}");
+        return;
+    }
+
+    JsonStream js;
+    js_begin(&js, conn);
+    JS_LIT(&js, "{\"by\":"); js_string(&js, by == HISTORY_BY_TIME ? "time" : val);
+    JS_LIT(&js, ",\"from\":"); js_int(&js, from);
+    JS_LIT(&js, ",\"to\":"); js_int(&js, to);
+    JS_LIT(&js, ",\"groups\":[");
+    for (int i = 0; i < n; i++) {
+        if (i > 0) JS_LIT(&js, ",");
+        JS_LIT(&js, "{\"key\":");
+        if (names) js_string(&js, names[i]);
+        else js_int(&js, ((long long)from / bucket + i) * bucket);
+        JS_LIT(&js, ",\"count\":"); js_int(&js, groups[i].count);
+        JS_LIT(&js, ",\"sum\":"); js_money(&js, groups[i].sum);
+        JS_LIT(&js, "}");
+    }
+    JS_LIT(&js, "]}");
+    js_end(&js);
+    free(groups);
+}
+
+// --- EVENT STREAM ---
+// GET /api/events[?since=V&epoch=E] keeps the connection open and sends a
+// "state" event, shaped like a delta /api/state response, whenever the
+// state has changed. A subscriber that can't keep up is skipped until its
+// socket drains, then gets a single event covering everything it missed.
+
+// Writes an event unless the subscriber is already up to date
+void sse_write_event(Connection* conn) {
+    StateView* v = collect_state(conn->sent_version, ~0, 0, INT_MAX, conn->sent_version);
+    if (!v) return;
+
+    JsonStream js;
+    js_open(&js, conn);
+    JS_LIT(&js, "event: state\ndata: ");
+    write_state_json(&js, v);
+    JS_LIT(&js, "\n\n");
+    js_close_chunk(&js);
+    conn->sent_version = v->version;
+    conn->last_event = v->now;
+}
+
+void handle_subscribe(Connection* conn, const char* query) {
+#ifdef _WIN32
+    (void)query;
+    send_json(conn, "{\"error\":\"Not Supported\"}"); // The serial loop can't hold it open; clients poll
+#else
+    char val[64];
+    long long since = -1;
+    if (query_param(query, "since", val, sizeof(val))) since = atoll(val);
+    if (query_param(query, "epoch", val, sizeof(val)) && atoll(val) != state.epoch) since = -1;
+
+    char header[256];
+    sprintf(header,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "%s"
+        "Access-Control-Allow-Origin: *\r\n\r\n",
+        conn->http10 ? "" : "Transfer-Encoding: chunked\r\n");
+    conn_write(conn, header, strlen(header));
+
+    conn->subscriber = true;
+    conn->keep_alive = true;
+    conn->sent_version = since;
+    sse_write_event(conn);
+#endif
+}
+
+// Handlers call into logic.c between these, so parsing the request and
+// formatting the response happen outside the lock. A response waits for
+// the WAL only if its call logged something.
+long long state_begin() {
+    pthread_mutex_lock(&state_lock);
+    return wal_lsn();
+}
+
+void state_end(Connection* conn, long long lsn_before) {
+    long long lsn_after = wal_lsn();
+    pthread_mutex_unlock(&state_lock);
+    if (lsn_after > lsn_before) conn->commit_lsn = lsn_after;
+}
+
+void send_malformed(Connection* conn) {
+    send_json(conn, "{\"error\":\"Malformed JSON\"}");
+}
+
+void handle_create_customer(Connection* conn, char* body, int body_len) {
     // {"name":"Ayush", "pin":1234, "tier":0, "balance":5000}
     char name[50] = "Unknown";
     int pin=0, tier=0;
     double balance=0;
-
-    char* pName = strstr(body, "\"name\":\"");
-    if(pName) {
-        sscanf(pName + 8, "%[^\"]", name);
+    JsonField fields[] = {
+        JSON_STRING_FIELD("name", name),
+        JSON_FIELD("pin", JSON_INT, &pin),
+        JSON_FIELD("tier", JSON_INT, &tier),
+        JSON_FIELD("balance", JSON_NUMBER, &balance),
+    };
+    if (!json_parse(body, body_len, fields, 4)) {
+        send_malformed(conn);
+        return;
     }
-    char* pPin = strstr(body, "\"pin\":");
-    if(pPin) pin = atoi(pPin + 6);
-    
-    char* pTier = strstr(body, "\"tier\":");
-    if(pTier) tier = atoi(pTier + 7);
-    
-    char* pBal = strstr(body, "\"balance\":");
-    if(pBal) balance = atof(pBal + 10);
 
+    long long lsn = state_begin();
     Customer* c = create_customer(name, pin, tier, balance);
+    state_end(conn, lsn);
     if(c) {
         char resp[128];
         sprintf(resp, "{\"status\":\"ok\", \"account_number\":%d}", c->account_number);
-        send_json(client_socket, resp);
+        send_json(conn, resp);
     } else {
-        send_json(client_socket, "{\"error\":\"Limit Reached\"}");
+        send_json(conn, "{\"error\":\"Limit Reached\"}");
     }
 }
 
-void handle_login(SOCKET client_socket, char* body) {
+void handle_login(Connection* conn, char* body, int body_len) {
     // {"id":50000, "pin":1234}
     int id=0, pin=0;
-    char* pId = strstr(body, "\"id\":");
-    if(pId) id = atoi(pId + 5);
-    char* pPin = strstr(body, "\"pin\":");
-    if(pPin) pin = atoi(pPin + 6);
+    JsonField fields[] = {
+        JSON_FIELD("id", JSON_INT, &id),
+        JSON_FIELD("pin", JSON_INT, &pin),
+    };
+    if (!json_parse(body, body_len, fields, 2)) {
+        send_malformed(conn);
+        return;
+    }
 
+    long long lsn = state_begin();
     Customer* c = find_customer(id);
+    double balance = c ? c->balance : 0;
+    state_end(conn, lsn);
     if(c && c->pin == pin) {
         char resp[256];
-        sprintf(resp, "{\"status\":\"ok\", \"name\":\"%s\", \"tier\":%d, \"balance\":%.2f}", c->name, c->tier, c->balance);
-        send_json(client_socket, resp);
+        sprintf(resp, "{\"status\":\"ok\", \"name\":\"%s\", \"tier\":%d, \"balance\":%.2f}", c->name, c->tier, balance);
+        send_json(conn, resp);
+    } else {
+        send_json(conn, "{\"error\":\"Invalid Credentials\"}");
+    }
+}
+
+// CSV or binary batch (see import.c); answers with totals and the
+// rejected rows
+void handle_import(Connection* conn, char* body, int body_len) {
+    ImportRow* rows;
+    int n = import_parse(body, body_len, &rows);
+    if (n < 0) {
+        send_json(conn, "{\"error\":\"Malformed Upload\"}");
+        return;
+    }
+
+    // Rows carry mixed priorities, so a batch is all or nothing
+    double retry_after;
+    pthread_mutex_lock(&state_lock);
+    bool full = admission_full(&retry_after);
+    pthread_mutex_unlock(&state_lock);
+    if (full) {
+        free(rows);
+        send_json_retry(conn, "503 Service Unavailable", retry_after, "{\"error\":\"Overloaded\"}");
+        return;
+    }
+
+    ImportError* errors = (ImportError*)malloc(sizeof(ImportError) * IMPORT_MAX_ERRORS);
+    ImportSummary s;
+    memset(&s, 0, sizeof(s));
+    for (int off = 0; off < n; off += IMPORT_CHUNK) {
+        long long lsn = state_begin();
+        import_transactions(rows + off, (n - off < IMPORT_CHUNK) ? n - off : IMPORT_CHUNK, errors, IMPORT_MAX_ERRORS, &s);
+        state_end(conn, lsn);
+    }
+
+    JsonStream js;
+    js_begin(&js, conn);
+    JS_LIT(&js, "{\"status\":\"ok\",\"rows\":"); js_int(&js, s.rows);
+    JS_LIT(&js, ",\"accepted\":"); js_int(&js, s.accepted);
+    JS_LIT(&js, ",\"locked\":"); js_int(&js, s.locked);
+    JS_LIT(&js, ",\"rejected\":"); js_int(&js, s.rejected);
+    if (s.accepted > 0) {
+        JS_LIT(&js, ",\"first_id\":"); js_int(&js, s.first_id);
+        JS_LIT(&js, ",\"last_id\":"); js_int(&js, s.last_id);
+    }
+    JS_LIT(&js, ",\"errors\":[");
+    int listed = s.rejected < IMPORT_MAX_ERRORS ? s.rejected : IMPORT_MAX_ERRORS;
+    for (int i = 0; i < listed; i++) {
+        if (i > 0) JS_LIT(&js, ",");
+        JS_LIT(&js, "{\"line\":"); js_int(&js, errors[i].line);
+        JS_LIT(&js, ",\"error\":"); js_string(&js, tx_error_message(errors[i].code));
+        JS_LIT(&js, "}");
+    }
+    JS_LIT(&js, "]}");
+    js_end(&js);
+
+    free(errors);
+    free(rows);
+}
+
+// GET /api/replication
+//   This server's role. A primary lists its replicas with how far each has
+//   applied its log; a replica says how far it is behind its primary, in
+//   log bytes and in seconds since it was last caught up.
+void handle_replication(Connection* conn) {
+    JsonStream js;
+    js_begin(&js, conn);
+    if (replica.enabled) {
+        pthread_mutex_lock(&state_lock);
+        ReplicaState r = replica;
+        pthread_mutex_unlock(&state_lock);
+        long long lag = r.primary_lsn - r.applied_lsn;
+        char primary[160];
+        snprintf(primary, sizeof(primary), "%s:%d", r.host, r.port);
+        JS_LIT(&js, "{\"role\":\"replica\",\"primary\":"); js_string(&js, primary);
+        if (r.connected) JS_LIT(&js, ",\"connected\":true");
+        else JS_LIT(&js, ",\"connected\":false");
+        JS_LIT(&js, ",\"applied\":"); js_int(&js, r.applied_lsn);
+        JS_LIT(&js, ",\"primary_lsn\":"); js_int(&js, r.primary_lsn);
+        JS_LIT(&js, ",\"lag_bytes\":"); js_int(&js, lag > 0 ? lag : 0);
+        JS_LIT(&js, ",\"lag_ms\":"); js_int(&js, lag > 0 ? (long long)repl_now_ms() - r.caught_up_ms : 0);
+        JS_LIT(&js, "}");
     } else {
-        send_json(client_socket, "{\"error\":\"Invalid Credentials\"}");
+        ReplicaLink links[REPL_MAX_REPLICAS];
+        int n = repl.enabled ? repl_links(links) : 0;
+        long long lsn = repl.enabled ? repl_shipped_lsn() : wal_lsn();
+        JS_LIT(&js, "{\"role\":\"primary\",\"lsn\":"); js_int(&js, lsn);
+        JS_LIT(&js, ",\"replicas\":[");
+        for (int i = 0; i < n; i++) {
+            if (i > 0) JS_LIT(&js, ",");
+            JS_LIT(&js, "{\"address\":"); js_string(&js, links[i].address);
+            JS_LIT(&js, ",\"sent\":"); js_int(&js, links[i].sent_lsn);
+            JS_LIT(&js, ",\"applied\":"); js_int(&js, links[i].applied_lsn);
+            JS_LIT(&js, ",\"lag_bytes\":"); js_int(&js, lsn - links[i].applied_lsn);
+            JS_LIT(&js, "}");
+        }
+        JS_LIT(&js, "]}");
     }
+    js_end(&js);
 }
 
-void handle_api_request(SOCKET client_socket, char* method, char* path, char* body) {
+// Prometheus text format: the per-thread histograms (metrics.c) plus
+// gauges read from the state
+void handle_metrics(Connection* conn) {
+    MetricsText mt = { NULL, 0, 0 };
+    metrics_render(&mt);
+
+    mt_family(&mt, "bank_queue_depth", "gauge", "Waiting transactions in each shard's priority queue.");
+    for (int i = 0; i < state.shard_count; i++) {
+        Shard* s = &state.shards[i];
+        pthread_mutex_lock(&s->lock);
+        int size = s->queue->size;
+        pthread_mutex_unlock(&s->lock);
+        mt_printf(&mt, "bank_queue_depth{shard=\"%d\"} %d\n", i, size);
+    }
+
+    pthread_mutex_lock(&state_lock);
+    int locked = state.time_locks.count, live = state.tx_count, finished = state.finished_count;
+    int processed = state.processed_count, cancelled = state.cancelled_count;
+    double wait = state.total_wait_time;
+    pthread_mutex_unlock(&state_lock);
+    mt_family(&mt, "bank_time_locks", "gauge", "Transactions held in the timing wheel.");
+    mt_printf(&mt, "bank_time_locks %d\n", locked);
+    mt_family(&mt, "bank_transactions", "gauge", "Transaction slots in use, finished ones kept for history included.");
+    mt_printf(&mt, "bank_transactions %d\n", live);
+    mt_family(&mt, "bank_transactions_finished", "gauge", "Finished transactions kept before their slots are reused.");
+    mt_printf(&mt, "bank_transactions_finished %d\n", finished);
+    mt_family(&mt, "bank_history_rows", "gauge", "Finished transactions in the history store.");
+    mt_printf(&mt, "bank_history_rows %d\n", __atomic_load_n(&history.count, __ATOMIC_ACQUIRE));
+    mt_family(&mt, "bank_history_archived_rows", "gauge", "History rows in segment files rather than memory.");
+    mt_printf(&mt, "bank_history_archived_rows %lld\n", (long long)__atomic_load_n(&history.archived, __ATOMIC_ACQUIRE) * HISTORY_CHUNK);
+    mt_family(&mt, "bank_processed_total", "counter", "Transactions settled by processing, cancelled for funds included.");
+    mt_printf(&mt, "bank_processed_total %d\n", processed);
+    mt_family(&mt, "bank_cancelled_total", "counter", "Transactions cancelled on request.");
+    mt_printf(&mt, "bank_cancelled_total %d\n", cancelled);
+    mt_family(&mt, "bank_wait_seconds_total", "counter", "Sum of arrival-to-settlement times.");
+    mt_printf(&mt, "bank_wait_seconds_total %.0f\n", wait);
+
+    if (replica.enabled) {
+        pthread_mutex_lock(&state_lock);
+        ReplicaState r = replica;
+        pthread_mutex_unlock(&state_lock);
+        long long lag = r.primary_lsn > r.applied_lsn ? r.primary_lsn - r.applied_lsn : 0;
+        mt_family(&mt, "bank_replica_connected", "gauge", "1 while this replica is following its primary.");
+        mt_printf(&mt, "bank_replica_connected %d\n", r.connected ? 1 : 0);
+        mt_family(&mt, "bank_replica_lag_bytes", "gauge", "Log bytes the primary had at its last heartbeat that this replica hasn't applied.");
+        mt_printf(&mt, "bank_replica_lag_bytes %lld\n", lag);
+        mt_family(&mt, "bank_replica_lag_seconds", "gauge", "Time since this replica last had everything its primary had.");
+        mt_printf(&mt, "bank_replica_lag_seconds %.3f\n", lag > 0 ? (repl_now_ms() - r.caught_up_ms) / 1000.0 : 0.0);
+    } else if (repl.enabled) {
+        ReplicaLink links[REPL_MAX_REPLICAS];
+        int n = repl_links(links);
+        long long lsn = repl_shipped_lsn();
+        mt_family(&mt, "bank_replicas", "gauge", "Replicas connected to this primary.");
+        mt_printf(&mt, "bank_replicas %d\n", n);
+        mt_family(&mt, "bank_replica_applied_lag_bytes", "gauge", "Log bytes each replica hadn't applied at its last heartbeat.");
+        for (int i = 0; i < n; i++) {
+            mt_printf(&mt, "bank_replica_applied_lag_bytes{replica=\"%s\"} %lld\n", links[i].address, lsn - links[i].applied_lsn);
+        }
+    }
+
+    char header[256];
+    sprintf(header,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n"
+        "%s\r\n",
+        mt.len, connection_header(conn));
+    conn_write(conn, header, strlen(header));
+    conn_write(conn, mt.buf, mt.len);
+    free(mt.buf);
+}
+
+void handle_api_request(Connection* conn, char* method, char* path, char* body, int body_len) {
+    char* query = strchr(path, '?');
+    if (query) *query++ = 0;
+    else query = "";
+
+    // A replica only answers reads; logging in changes nothing
+    if (replica.enabled && strcmp(method, "GET") != 0 && strcmp(path, "/api/login") != 0) {
+        conn->route = ROUTE_NOT_FOUND;
+        send_json(conn, "{\"error\":\"Read Only Replica\"}");
+        return;
+    }
+
     if (strcmp(path, "/api/state") == 0 && strcmp(method, "GET") == 0) {
-        handle_get_state(client_socket);
+        conn->route = ROUTE_STATE;
+        handle_get_state(conn, query);
     } 
+    else if (strcmp(path, "/api/events") == 0 && strcmp(method, "GET") == 0) {
+        conn->route = ROUTE_EVENTS;
+        handle_subscribe(conn, query);
+    }
+    else if (strcmp(path, "/api/history") == 0 && strcmp(method, "GET") == 0) {
+        conn->route = ROUTE_HISTORY;
+        handle_history(conn, query);
+    }
+    else if (strcmp(path, "/api/aggregate") == 0 && strcmp(method, "GET") == 0) {
+        conn->route = ROUTE_AGGREGATE;
+        handle_aggregate(conn, query);
+    }
     else if (strcmp(path, "/api/customer") == 0 && strcmp(method, "POST") == 0) {
-        handle_create_customer(client_socket, body);
+        conn->route = ROUTE_CUSTOMER;
+        handle_create_customer(conn, body, body_len);
     }
     else if (strcmp(path, "/api/login") == 0 && strcmp(method, "POST") == 0) {
-        handle_login(client_socket, body);
+        conn->route = ROUTE_LOGIN;
+        handle_login(conn, body, body_len);
     }
     else if (strcmp(path, "/api/transaction") == 0 && strcmp(method, "POST") == 0) {
+        conn->route = ROUTE_TRANSACTION;
         // {"sender":50000, "receiver":50001, "pin":1234, "amount":100, "urgency":0}
         double amount = 0;
         int sender=0, receiver=0, pin=0, urgency=0;
-        
-        char* pS = strstr(body, "\"sender\":"); if(pS) sender = atoi(pS+9);
-        char* pR = strstr(body, "\"receiver\":"); if(pR) receiver = atoi(pR+11);
-        char* pP = strstr(body, "\"pin\":"); if(pP) pin = atoi(pP+6);
-        char* pA = strstr(body, "\"amount\":"); if(pA) amount = atof(pA+9);
-        char* pU = strstr(body, "\"urgency\":"); if(pU) urgency = atoi(pU+10);
+        JsonField fields[] = {
+            JSON_FIELD("sender", JSON_INT, &sender),
+            JSON_FIELD("receiver", JSON_INT, &receiver),
+            JSON_FIELD("pin", JSON_INT, &pin),
+            JSON_FIELD("amount", JSON_NUMBER, &amount),
+            JSON_FIELD("urgency", JSON_INT, &urgency),
+        };
+        if (!json_parse(body, body_len, fields, 5)) {
+            send_malformed(conn);
+            return;
+        }
 
-        int res = create_transaction(sender, receiver, pin, amount, urgency);
+        double retry_after;
+        long long lsn = state_begin();
+        int res = submit_transaction(sender, receiver, pin, amount, urgency, &retry_after);
+        state_end(conn, lsn);
         
-        if (res == 0) send_json(client_socket, "{\"status\":\"ok\"}");
-        else if (res == 1) send_json(client_socket, "{\"error\":\"Invalid Sender\"}");
-        else if (res == 2) send_json(client_socket, "{\"error\":\"Receiver Not Found\"}");
-        else if (res == 3) send_json(client_socket, "{\"error\":\"Wrong PIN\"}");
-        else if (res == 4) send_json(client_socket, "{\"error\":\"Insufficient Funds\"}");
-        else send_json(client_socket, "{\"error\":\"Unknown Error\"}");
+        if (res == 0) {
+            send_json(conn, "{\"status\":\"ok\"}");
+        } else if (res == ADMIT_RATE_LIMITED) {
+            send_json_retry(conn, "429 Too Many Requests", retry_after, "{\"error\":\"Rate Limited\"}");
+        } else if (res == ADMIT_OVERLOADED) {
+            send_json_retry(conn, "503 Service Unavailable", retry_after, "{\"error\":\"Overloaded\"}");
+        } else {
+            char resp[128];
+            sprintf(resp, "{\"error\":\"%s\"}", tx_error_message(res));
+            send_json(conn, resp);
+        }
+    }
+    else if (strcmp(path, "/api/import") == 0 && strcmp(method, "POST") == 0) {
+        conn->route = ROUTE_IMPORT;
+        handle_import(conn, body, body_len);
     }
     else if (strcmp(path, "/api/process") == 0 && strcmp(method, "POST") == 0) {
-        Transaction* t = process_next_transaction();
-        if(t) send_json(client_socket, "{\"status\":\"processed\"}");
-        else send_json(client_socket, "{\"status\":\"empty\"}");
+        conn->route = ROUTE_PROCESS;
+        // {} processes one; {"count":N} and/or {"budget_ms":X} drain a batch
+        int count = 0;
+        double budget_ms = 0;
+        JsonField fields[] = {
+            JSON_FIELD("count", JSON_INT, &count),
+            JSON_FIELD("budget_ms", JSON_NUMBER, &budget_ms),
+        };
+        if (!json_parse(body, body_len, fields, 2)) {
+            send_malformed(conn);
+            return;
+        }
+
+        if (count > 0 || budget_ms > 0) {
+            BatchSummary s;
+            long long lsn = state_begin();
+            process_batch(count > 0 ? count : INT_MAX, budget_ms, &s);
+            state_end(conn, lsn);
+            char resp[256];
+            sprintf(resp, "{\"status\":\"ok\", \"processed\":%d, \"done\":%d, \"failed\":%d, \"amount\":%.2f, \"remaining\":%d}",
+                s.processed, s.done, s.failed, s.amount, s.remaining);
+            send_json(conn, resp);
+        } else {
+            long long lsn = state_begin();
+            bool processed = process_next_transaction();
+            state_end(conn, lsn);
+            if (processed) send_json(conn, "{\"status\":\"processed\"}");
+            else send_json(conn, "{\"status\":\"empty\"}");
+        }
     }
     else if (strcmp(path, "/api/cancel") == 0 && strcmp(method, "POST") == 0) {
+        conn->route = ROUTE_CANCEL;
         int id = 0;
-        char* pId = strstr(body, "\"id\":");
-        if(pId) id = atoi(pId + 5);
+        JsonField fields[] = { JSON_FIELD("id", JSON_INT, &id) };
+        if (!json_parse(body, body_len, fields, 1)) {
+            send_malformed(conn);
+            return;
+        }
+        long long lsn = state_begin();
         cancel_transaction(id);
-        send_json(client_socket, "{\"status\":\"cancelled\"}");
+        state_end(conn, lsn);
+        send_json(conn, "{\"status\":\"cancelled\"}");
     }
     else if (strcmp(path, "/api/unlock") == 0 && strcmp(method, "POST") == 0) {
+        conn->route = ROUTE_UNLOCK;
         int id = 0;
-        char* pId = strstr(body, "\"id\":");
-        if(pId) id = atoi(pId + 5);
+        JsonField fields[] = { JSON_FIELD("id", JSON_INT, &id) };
+        if (!json_parse(body, body_len, fields, 1)) {
+            send_malformed(conn);
+            return;
+        }
+        long long lsn = state_begin();
         force_unlock(id);
-        send_json(client_socket, "{\"status\":\"unlocked\"}");
+        state_end(conn, lsn);
+        send_json(conn, "{\"status\":\"unlocked\"}");
+    }
+    else if (strcmp(path, "/api/replication") == 0 && strcmp(method, "GET") == 0) {
+        conn->route = ROUTE_REPLICATION;
+        handle_replication(conn);
+    }
+    else if (strcmp(path, "/api/metrics") == 0 && strcmp(method, "GET") == 0) {
+        conn->route = ROUTE_METRICS;
+        handle_metrics(conn);
     }
     else {
-        send_json(client_socket, "{\"error\":\"Not Found\"}");
+        conn->route = ROUTE_NOT_FOUND;
+        send_json(conn, "{\"error\":\"Not Found\"}");
     }
 }
 
-int main() {
+// Queue the response for one parsed request
+void handle_request(Connection* conn, HttpRequest* req) {
+    // Handlers expect a terminated body; borrow the byte after it
+    char saved = req->body[req->body_len];
+    req->body[req->body_len] = 0;
+    long long start = metrics_clock_us();
+    conn->route = ROUTE_STATIC;
+
+    // Route; API handlers take state_lock themselves, static files never need it
+    if (strncmp(req->path, "/api/", 5) == 0) {
+        handle_api_request(conn, req->method, req->path, req->body, req->body_len);
+    } else if (!send_asset(conn, req)) {
+        // Not in the cache (added since startup): read it from disk
+        char filepath[512];
+        const char* path = strcmp(req->path, "/") == 0 ? "/index.html" : req->path;
+        int n = snprintf(filepath, sizeof(filepath), "%s%s", ASSET_DIR, path);
+        if (!asset_path_safe(path) || n >= (int)sizeof(filepath)) send_not_found(conn);
+        else send_file(conn, filepath);
+    }
+
+    req->body[req->body_len] = saved;
+    hist_record(&metrics()->http[conn->route], metrics_clock_us() - start);
+}
+
+void send_parse_error(Connection* conn, HttpParseResult rc) {
+    const char* msg = (rc == HTTP_TOO_LARGE)
+        ? "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+        : "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    metric_add(&metrics()->parse_errors, 1);
+    conn_write(conn, msg, strlen(msg));
+}
+
+// Answers every complete request in the input buffer, in order, so
+// pipelined requests get their responses back-to-back. Whatever is left
+// is a partial request and is moved to the front of the buffer.
+void conn_process_input(Connection* conn) {
+    long long logged = conn->commit_lsn;
+    while (!conn->closing && !conn->subscriber) {
+        HttpRequest req;
+        HttpParseResult rc = http_parse_request(conn->in + conn->in_start, conn->in_len - conn->in_start,
+                                                &conn->scanned, &req);
+        if (rc == HTTP_INCOMPLETE) break;
+        if (rc != HTTP_COMPLETE) {
+            send_parse_error(conn, rc);
+            conn->closing = true;
+            break;
+        }
 #ifdef _WIN32
-    WSADATA wsa;
+        req.keep_alive = false; // The serial loop cannot afford idle connections
 #endif
-    SOCKET server, client;
-    struct sockaddr_in server_addr, client_addr;
+        conn->keep_alive = req.keep_alive;
+        conn->http10 = req.http10;
+        handle_request(conn, &req);
+        if (!conn->keep_alive) conn->closing = true; // Handlers may downgrade
+        conn->in_start += req.total_len;
+    }
+
+    // Changes must be durable before their responses go out. The serial
+    // loop waits here; an epoll worker parks the connection and serves
+    // others until the flusher says the log has caught up.
+    if (conn->commit_lsn != logged) {
+#ifdef _WIN32
+        long long start = metrics_clock_us();
+        wal_wait_durable(conn->commit_lsn);
+        hist_record(&metrics()->commit_wait, metrics_clock_us() - start);
+#else
+        if (wal_durable() < conn->commit_lsn) {
+            conn->awaiting_commit = true;
+            conn->commit_since = metrics_clock_us();
+        }
+#endif
+    }
+
+    if (conn->in_start > 0) {
+        conn->in_len -= conn->in_start;
+        memmove(conn->in, conn->in + conn->in_start, conn->in_len);
+        conn->in[conn->in_len] = 0;
+        conn->in_start = 0;
+    }
+}
+
+#ifdef _WIN32
+
+// Serial fallback: one connection at a time with blocking sockets
+void serve_forever(SOCKET server, int worker_count) {
+    struct sockaddr_in client_addr;
     int addr_len = sizeof(client_addr);
+    (void)worker_count;
+
+    while (1) {
+        SOCKET client = accept(server, (struct sockaddr *)&client_addr, &addr_len);
+        if (client == INVALID_SOCKET) continue;
+
+        Connection* conn = conn_create(client);
+        while (!conn->closing) {
+            buf_reserve(&conn->in, &conn->in_cap, conn->in_len + BUFFER_SIZE);
+            int bytes_received = recv(client, conn->in + conn->in_len, conn->in_cap - conn->in_len - 1, 0);
+            if (bytes_received <= 0) break;
+            conn->in_len += bytes_received;
+            conn->in[conn->in_len] = 0; // Null terminate
+            conn_process_input(conn);
+        }
+        while (conn->out_sent < conn->out_len) {
+            int n = send(client, conn->out + conn->out_sent, conn->out_len - conn->out_sent, 0);
+            if (n <= 0) break;
+            conn->out_sent += n;
+        }
+        conn_destroy(conn);
+    }
+}
+
+#else
+
+typedef struct Worker {
+    int epfd;
+    SOCKET server;
+    pthread_t thread;
+
+    int wake_fd;             // eventfd poked when the state changes
+    int wake_pending;        // Set until the worker has seen the poke
+    int subscriber_count;
+    Connection* subscribers; // Event-stream connections owned by this worker
+    int parked_count;
+    Connection* parked;      // Waiting for the log to reach their commit_lsn
+    time_t last_tick;
+    Connection* closed;      // Freed once the current epoll batch is done
+} Worker;
+
+Worker workers[MAX_WORKERS];
+int worker_total = 0;
+
+void set_nonblocking(SOCKET fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+void accept_clients(Worker* w) {
+    while (1) {
+        SOCKET client = accept(w->server, NULL, NULL);
+        if (client == INVALID_SOCKET) return; // EAGAIN: backlog drained
+
+        set_nonblocking(client);
+        Connection* conn = conn_create(client);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, client, &ev) < 0) conn_destroy(conn);
+    }
+}
+
+void watch_events(Worker* w, Connection* conn, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Returns 0 while the connection should stay open
+int conn_flush(Worker* w, Connection* conn) {
+    while (conn_pending(conn)) {
+        ssize_t n = conn_send_some(conn, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer full: stop reading and resume when writable
+                if (!conn->want_write) watch_events(w, conn, EPOLLOUT);
+                conn->want_write = true;
+                return 0;
+            }
+            return -1;
+        }
+    }
+
+    conn->out_len = conn->out_sent = 0;
+    if (conn->closing) return -1;
+    if (conn->want_write) watch_events(w, conn, EPOLLIN);
+    conn->want_write = false;
+    return 0;
+}
+
+int sub_push(Worker* w, Connection* conn);
+
+// Sends a subscriber whatever changed since its last event. Skipped while
+// its unsent backlog is large; conn_flush calls back once it drains.
+int sub_push(Worker* w, Connection* conn) {
+    if (conn->out_len - conn->out_sent > SSE_MAX_BACKLOG) return 0;
+    sse_write_event(conn);
+    return conn_flush(w, conn);
+}
+
+void sub_add(Worker* w, Connection* conn) {
+    conn->subscribed = true;
+    conn->sub_prev = NULL;
+    conn->sub_next = w->subscribers;
+    if (w->subscribers) w->subscribers->sub_prev = conn;
+    w->subscribers = conn;
+    __atomic_add_fetch(&w->subscriber_count, 1, __ATOMIC_SEQ_CST);
+}
+
+void sub_remove(Worker* w, Connection* conn) {
+    if (conn->sub_prev) conn->sub_prev->sub_next = conn->sub_next;
+    else w->subscribers = conn->sub_next;
+    if (conn->sub_next) conn->sub_next->sub_prev = conn->sub_prev;
+    conn->subscribed = false;
+    __atomic_sub_fetch(&w->subscriber_count, 1, __ATOMIC_SEQ_CST);
+}
+
+void conn_unpark(Worker* w, Connection* conn) {
+    if (conn->park_prev) conn->park_prev->park_next = conn->park_next;
+    else w->parked = conn->park_next;
+    if (conn->park_next) conn->park_next->park_prev = conn->park_prev;
+    conn->parked = false;
+    __atomic_sub_fetch(&w->parked_count, 1, __ATOMIC_SEQ_CST);
+}
+
+// The log is far enough for conn's responses to go out
+void conn_committed(Connection* conn) {
+    conn->awaiting_commit = false;
+    hist_record(&metrics()->commit_wait, metrics_clock_us() - conn->commit_since);
+}
+
+// Holds conn's responses, and stops reading from it, until the log is on
+// disk up to its commit_lsn. False if it already is by the time conn is
+// listed: the flusher may have finished before it could see the list.
+bool conn_park(Worker* w, Connection* conn) {
+    conn->parked = true;
+    conn->park_prev = NULL;
+    conn->park_next = w->parked;
+    if (w->parked) w->parked->park_prev = conn;
+    w->parked = conn;
+    __atomic_add_fetch(&w->parked_count, 1, __ATOMIC_SEQ_CST);
+    if (wal_durable() < conn->commit_lsn) {
+        // Pipelined requests or a half-close would keep a level-triggered
+        // EPOLLIN firing; errors and hangups still come through
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.ptr = conn;
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        return true;
+    }
+    conn_unpark(w, conn);
+    conn_committed(conn);
+    return false;
+}
+
+// Subscribers can be closed while pushing to them, with an event for the
+// same connection still later in the batch, so freeing waits until the
+// batch is done
+void conn_close(Worker* w, Connection* conn) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (conn->subscribed) sub_remove(w, conn);
+    if (conn->parked) conn_unpark(w, conn);
+    conn->dead = true;
+    conn->sub_next = w->closed;
+    w->closed = conn;
+}
+
+// One poke per worker until it has been handled
+void worker_poke(Worker* w) {
+    if (__atomic_exchange_n(&w->wake_pending, 1, __ATOMIC_SEQ_CST)) return;
+    uint64_t one = 1;
+    if (write(w->wake_fd, &one, sizeof(one)) < 0) { /* Counter full: already readable */ }
+}
+
+// Installed as on_state_change, so it runs under state_lock on whichever
+// thread made the change
+void wake_subscribers() {
+    for (int i = 0; i < worker_total; i++) {
+        if (__atomic_load_n(&workers[i].subscriber_count, __ATOMIC_SEQ_CST) > 0) worker_poke(&workers[i]);
+    }
+}
+
+// Installed as on_wal_synced, so it runs on the flusher under wal.lock
+void wake_parked() {
+    for (int i = 0; i < worker_total; i++) {
+        if (__atomic_load_n(&workers[i].parked_count, __ATOMIC_SEQ_CST) > 0) worker_poke(&workers[i]);
+    }
+}
+
+int conn_read(Worker* w, Connection* conn);
+
+// Handles a poke: sends parked responses whose changes are now on disk
+// and carries on reading their connections, then brings subscribers up
+// to date
+void worker_wake(Worker* w) {
+    uint64_t count;
+    if (read(w->wake_fd, &count, sizeof(count)) < 0) { /* Raced with another read */ }
+    __atomic_store_n(&w->wake_pending, 0, __ATOMIC_SEQ_CST); // Changes from here on poke again
+
+    Connection* next;
+    if (w->parked) {
+        long long durable = wal_durable();
+        for (Connection* conn = w->parked; conn; conn = next) {
+            next = conn->park_next;
+            if (conn->commit_lsn > durable) continue;
+            conn_unpark(w, conn);
+            conn_committed(conn);
+            watch_events(w, conn, EPOLLIN);
+            if (conn_read(w, conn) != 0) conn_close(w, conn);
+        }
+    }
+    for (Connection* conn = w->subscribers; conn; conn = next) {
+        next = conn->sub_next;
+        if (!conn->want_write && sub_push(w, conn) != 0) conn_close(w, conn);
+    }
+}
+
+// Keeps idle streams alive through proxies with a comment line
+void sub_tick(Worker* w) {
+    time_t now = time(NULL);
+    if (now == w->last_tick) return;
+    w->last_tick = now;
+
+    Connection* next;
+    for (Connection* conn = w->subscribers; conn; conn = next) {
+        next = conn->sub_next;
+        if (now - conn->last_event < SSE_PING_SECONDS || conn->want_write) continue;
+        JsonStream js;
+        js_open(&js, conn);
+        JS_LIT(&js, ": ping\n\n");
+        js_close_chunk(&js);
+        conn->last_event = now;
+        if (conn_flush(w, conn) != 0) conn_close(w, conn);
+    }
+}
+
+// Returns 0 while the connection should stay open
+int conn_read(Worker* w, Connection* conn) {
+    if (conn->parked) return 0; // An event from earlier in the batch
+    while (!conn->closing && !conn->want_write && !conn->awaiting_commit) {
+        buf_reserve(&conn->in, &conn->in_cap, conn->in_len + BUFFER_SIZE);
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len - 1, 0);
+        if (n == 0) {
+            conn->closing = true; // Peer is done sending; still answer what it sent
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (conn->subscriber) continue; // Nothing more is read from an event stream
+        conn->in_len += n;
+        conn->in[conn->in_len] = 0;
+
+        conn_process_input(conn);
+        if (conn->awaiting_commit) break;
+        if (conn->out_len - conn->out_sent >= OUT_HIGH_WATER && conn_flush(w, conn) != 0) return -1;
+    }
+    if (conn->awaiting_commit && conn_park(w, conn)) return 0;
+    if (conn->subscriber && !conn->subscribed && !conn->closing) {
+        sub_add(w, conn);
+        // Changes made before it was listed didn't poke this worker
+        return sub_push(w, conn);
+    }
+    return conn_flush(w, conn);
+}
+
+void* worker_loop(void* arg) {
+    Worker* w = (Worker*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int timeout = w->subscriber_count > 0 ? 1000 : -1;
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(w);
+                continue;
+            }
+            if (events[i].data.ptr == w) {
+                worker_wake(w);
+                continue;
+            }
+
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (conn->dead) continue;
+            int rc;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) rc = -1;
+            else if (events[i].events & EPOLLOUT) {
+                rc = conn_flush(w, conn);
+                // Pipelined requests may have been left unread meanwhile;
+                // a drained subscriber catches up on what it skipped
+                if (rc == 0 && !conn->want_write) rc = conn->subscribed ? sub_push(w, conn) : conn_read(w, conn);
+            }
+            else rc = conn_read(w, conn);
+
+            if (rc != 0) conn_close(w, conn);
+        }
+        if (w->subscriber_count > 0) sub_tick(w);
+
+        while (w->closed) {
+            Connection* conn = w->closed;
+            w->closed = conn->sub_next;
+            conn_destroy(conn);
+        }
+    }
+    return NULL;
+}
+
+// Every worker owns an epoll set and its connections for their whole life.
+// The listening socket is shared; EPOLLEXCLUSIVE wakes one worker per accept.
+void serve_forever(SOCKET server, int worker_count) {
+    signal(SIGPIPE, SIG_IGN);
+    set_nonblocking(server);
+
+    worker_total = worker_count;
+    for (int i = 0; i < worker_count; i++) {
+        Worker* w = &workers[i];
+        w->server = server;
+        w->epfd = epoll_create1(0);
+        w->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL; // Marks the listening socket
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, server, &ev);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = w; // Marks the wake-up eventfd
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake_fd, &ev);
+
+        if (i > 0) pthread_create(&w->thread, NULL, worker_loop, w);
+    }
+    // A replica is already applying changes; they read this under state_lock
+    pthread_mutex_lock(&state_lock);
+    on_state_change = wake_subscribers;
+    pthread_mutex_unlock(&state_lock);
+    pthread_mutex_lock(&wal.lock); // The flusher is already running
+    on_wal_synced = wake_parked;
+    pthread_mutex_unlock(&wal.lock);
+    worker_loop(&workers[0]);
+}
+
+#endif
+
+int main(int argc, char** argv) {
+#ifdef _WIN32
+    WSADATA wsa;
+    int worker_count = 1;
+#else
+    int worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    SOCKET server;
+    struct sockaddr_in server_addr;
+
+    const char* data_dir = "./data";
+    WalSyncMode sync_mode = WAL_SYNC_GROUP;
+    double process_rate = 0;
+    int shard_count = 1;
+    const char* imports[16];
+    int import_count = 0;
+    int port = PORT;
+    int replicate_port = 0;
+    const char* primary = NULL;
+
+    // ./server [-w workers] [-d data_dir] [-s group|always|off] [-r tx_per_second] [-S shards]
+    //          [-q high_water] [-l customer_tx_per_second] [--tier-rate basic,premium,vip,elite]
+    //          [-p port] [--replicate replication_port] [--replica-of host:replication_port]
+    //          [--import batch_file]...   Load the files into data_dir and exit
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--data") == 0) && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--sync") == 0) && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "always") == 0) sync_mode = WAL_SYNC_ALWAYS;
+            else if (strcmp(argv[i], "off") == 0) sync_mode = WAL_SYNC_OFF;
+            else sync_mode = WAL_SYNC_GROUP;
+        } else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--process-rate") == 0) && i + 1 < argc) {
+            process_rate = atof(argv[++i]);
+        } else if ((strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--shards") == 0) && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--high-water") == 0) && i + 1 < argc) {
+            admission.high_water = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--customer-rate") == 0) && i + 1 < argc) {
+            admission.customer_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tier-rate") == 0 && i + 1 < argc) {
+            double* r = admission.tier_rate;
+            sscanf(argv[++i], "%lf,%lf,%lf,%lf", &r[0], &r[1], &r[2], &r[3]);
+        } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replicate") == 0 && i + 1 < argc) {
+            replicate_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc) {
+            primary = argv[++i];
+        } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc && import_count < 16) {
+            imports[import_count++] = argv[++i];
+        }
+    }
+    if (worker_count < 1) worker_count = 1;
+    if (worker_count > MAX_WORKERS) worker_count = MAX_WORKERS;
 
     init_state();
+    init_shards(shard_count);
+    load_assets(ASSET_DIR);
+#ifndef _WIN32
+    if (primary) {
+        // Everything comes from the primary: no log, imports or processing here
+        repl_start_replica(primary);
+        start_lock_timer();
+    }
+#endif
+    if (!primary) {
+        wal_init(data_dir, sync_mode);
+        history_open(data_dir);
+        recover_state();
+        if (import_count > 0) {
+            int rc = 0;
+            for (int i = 0; i < import_count && rc == 0; i++) rc = import_file(imports[i]);
+            // Imports aren't logged: only the snapshot keeps them
+            if (!write_snapshot()) return 1;
+            wal_reset_file(); // Recovery skips the old log either way
+            return rc;
+        }
+#ifndef _WIN32
+        if (replicate_port > 0 && !repl_start_primary(replicate_port)) return 1;
+#endif
+        if (!wal_start()) return 1; // Refuse to take changes that couldn't be kept
+        start_lock_timer();
+        if (process_rate > 0) start_auto_processor(process_rate);
+    }
 
     // Init with Admin/Demo? No, user will create.
 
@@ -240,55 +1756,24 @@ int main() {
 #endif
     if ((server = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) return 1;
 
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
 
     if (bind(server, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
         printf("Bind failed\n");
         return 1;
     }
 
-    listen(server, 3);
-    printf("Server listening on port %d...\n", PORT);
+    listen(server, SOMAXCONN);
+    printf("Server listening on port %d with %d worker(s)%s...\n", port, worker_count, primary ? " as a read-only replica" : "");
 
     setbuf(stdout, NULL); // Disable buffering for real-time logs
 
-    while (1) {
-        client = accept(server, (struct sockaddr *)&client_addr, &addr_len);
-        if (client == INVALID_SOCKET) continue;
-
-        char buffer[BUFFER_SIZE] = {0};
-        int bytes_received = recv(client, buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytes_received <= 0) {
-            closesocket(client);
-            continue;
-        }
-        buffer[bytes_received] = 0; // Null terminate
-
-        char method[16] = {0}, path[256] = {0};
-        if (sscanf(buffer, "%15s %255s", method, path) != 2) {
-            closesocket(client);
-            continue;
-        }
-        
-        char* body = strstr(buffer, "\r\n\r\n");
-        if (body) body += 4;
-        else body = "";
-
-        // Route
-        if (strncmp(path, "/api/", 5) == 0) {
-            handle_api_request(client, method, path, body);
-        } else {
-            // Serve static files
-            char filepath[512] = "./frontend";
-            if (strcmp(path, "/") == 0) strcat(filepath, "/index.html");
-            else strcat(filepath, path);
-            send_file(client, filepath);
-        }
-        closesocket(client);
-    }
+    serve_forever(server, worker_count);
 
     closesocket(server);
 #ifdef _WIN32
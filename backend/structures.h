@@ -6,10 +6,22 @@
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 // --- CONSTANTS ---
-#define MAX_TRANSACTIONS 1000
-#define MAX_CUSTOMERS 100
+#define FIRST_ACCOUNT_NUMBER 50000
+#define MAX_FINISHED_HISTORY 10000  // DONE/CANCELLED kept before their slot is reused
+#define ARENA_CHUNK_SIZE 1024       // Elements per arena chunk
+#define ARENA_MAX_CHUNKS 65536
+#define CHANGELOG_SIZE 65536        // Changes a delta client can fall behind by
+#define WHEEL_BITS 6                // Timing wheel: 64 slots per level
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4              // 64^4 seconds (~194 days) of range
+#define MAX_SHARDS 64
+#define SHARD_BATCH 256             // Transactions a shard settles per state_lock hold
+#define HEAP_ARITY 4                // Children per heap node
+#define IMPORT_MALFORMED 6          // Import row error: couldn't be parsed
+#define TX_INVALID_AMOUNT 9         // Amount isn't a positive number (after the admission codes)
 #define TIME_LOCK_THRESHOLD 10000.0 
 #define TIME_LOCK_DURATION 30       
 #define AGING_FACTOR 0.5            
@@ -37,7 +49,8 @@ typedef enum {
     STATUS_LOCKED,      
     STATUS_PROCESSING,  
     STATUS_DONE,        
-    STATUS_CANCELLED    
+    STATUS_CANCELLED,
+    STATUS_FREE         // Recycled slot, not a transaction
 } TxStatus;
 
 // --- DATA STRUCTURES ---
@@ -46,11 +59,13 @@ typedef struct {
     int account_number; // Acts as ID
     char name[50];
     int pin;
-    double balance;
+    double balance;     // Published balance (state_lock)
+    double available;   // What its shard lets it spend (shard lock), see logic.c
     CustomerTier tier;
+    long long version; // state.version of its last change
 } Customer;
 
-typedef struct {
+typedef struct Transaction {
     int id;
     int sender_id;
     int receiver_id;
@@ -63,27 +78,107 @@ typedef struct {
     time_t unlock_time; 
 
     double base_priority;
-    double effective_priority; 
+    // Aging is linear in wait time, so ordering by
+    // base_priority + (now - arrival) * AGING_FACTOR is the same as ordering
+    // by this key, which never changes while the transaction waits.
+    double priority_key;
 
     TxStatus status;
+    int heap_index; // Slot in the heap holding it, or its timing-wheel slot while locked; -1 if in none
+    struct Transaction* next; // Finished FIFO, free list or timing-wheel slot link
+    struct Transaction* prev; // Timing-wheel slot link
+    long long version; // state.version of its last change
 } Transaction;
 
+// A heap slot: the transaction with the key it is ordered by, so
+// comparisons never dereference it
+typedef struct {
+    double key;        // Larger comes out first
+    long long tie;     // Then smaller (arrival time for the priority queue)
+    Transaction* t;
+} HeapEntry;
+
 typedef struct {
-    Transaction* data[MAX_TRANSACTIONS];
+    HeapEntry* data;
     int size;
     int capacity;
-    int (*compare)(const void* a, const void* b); 
 } Heap;
 
+// Hierarchical timing wheel (see timerwheel.c). Slot s of level l holds
+// the timers due in the s-th span of WHEEL_SLOTS^l seconds.
+typedef struct {
+    Transaction* slots[WHEEL_LEVELS * WHEEL_SLOTS]; // Doubly linked lists
+    long long now;   // Next second to expire; everything before it is done
+    int count;
+} TimingWheel;
+
+// A credit for an account on another shard, applied to `available` by
+// that shard before it decides anything else
 typedef struct {
-    Transaction all_transactions[MAX_TRANSACTIONS];
-    int tx_count;
+    int account;
+    double amount;
+} Credit;
 
-    Customer all_customers[MAX_CUSTOMERS];
-    int customer_count;
+// Accounts are partitioned by account_number % shard_count. A shard
+// queues the waiting transactions its accounts send, in priority order.
+typedef struct {
+    pthread_mutex_t lock;
+    Heap* queue;
+    Credit* inbox;
+    int inbox_len;
+    int inbox_cap;
+} Shard;
+
+// Open-addressing hash table: transaction id -> Transaction*
+typedef struct {
+    Transaction** slots; // NULL = empty
+    int capacity;        // Power of two
+    int count;
+} TxIndex;
+
+typedef enum {
+    CHANGE_TX,
+    CHANGE_CUSTOMER,
+    CHANGE_TX_REMOVED   // Slot recycled; clients should forget the id
+} ChangeKind;
+
+typedef struct {
+    int kind;
+    int id;
+} ChangeEntry;
+
+// Ring of the last CHANGELOG_SIZE changes. Every change bumps
+// state.version by one, so version v lives at (v - 1) % CHANGELOG_SIZE.
+typedef struct {
+    ChangeEntry entries[CHANGELOG_SIZE];
+} ChangeLog;
+
+// Chunked, pointer-stable storage (see arena.c)
+typedef struct {
+    char* chunks[ARENA_MAX_CHUNKS];
+    int elem_size;
+    int count; // Elements handed out so far
+} Arena;
+
+typedef struct {
+    Arena transactions;  // Slot i holds a Transaction, possibly STATUS_FREE
+    int tx_count;        // Slots not STATUS_FREE
+    Transaction* free_list;
+    // Finished transactions, oldest first; recycled past MAX_FINISHED_HISTORY
+    Transaction* finished_head;
+    Transaction* finished_tail;
+    int finished_count;
+
+    Arena customers;     // Slot i holds account FIRST_ACCOUNT_NUMBER + i
     
-    Heap* priority_queue;  
-    Heap* time_lock_queue; 
+    Shard shards[MAX_SHARDS]; // Waiting transactions, by sender
+    int shard_count;
+    TimingWheel time_locks; // Locked transactions by unlock_time
+    TxIndex tx_index;
+
+    long long epoch;     // Start time of this run; versions restart with it
+    long long version;   // Bumped on every change, see ChangeLog
+    ChangeLog changes;
 
     // Statistics
     int processed_count;
@@ -91,6 +186,41 @@ typedef struct {
     double total_wait_time;
 } GlobalState;
 
+// Result of one process_batch() call
+typedef struct {
+    int processed;
+    int done;
+    int failed;         // Cancelled at processing time (insufficient funds)
+    double amount;      // Total moved by the DONE ones
+    int remaining;      // Still waiting in the shard queues
+} BatchSummary;
+
+// One row of a bulk import (see import.c)
+typedef struct {
+    int sender;
+    int receiver;
+    int pin;
+    int urgency;
+    double amount;
+    int line;           // Line (CSV) or record (binary) number, from 1
+    int error;          // Set by the parser for a row it couldn't read
+} ImportRow;
+
+typedef struct {
+    int line;
+    int code;           // create_transaction's result codes, or IMPORT_MALFORMED
+} ImportError;
+
+// Totals of one import_transactions() call, or of several added up
+typedef struct {
+    int rows;
+    int accepted;
+    int rejected;
+    int locked;         // Accepted but time-locked
+    int first_id;       // Ids of the accepted rows, in input order
+    int last_id;
+} ImportSummary;
+
 extern GlobalState state;
 
 #endif
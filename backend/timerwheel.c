@@ -0,0 +1,86 @@
+#include "structures.h"
+
+// --- HIERARCHICAL TIMING WHEEL ---
+// Time locks hang off slot lists instead of a heap: inserting and
+// cancelling are O(1) list operations and releasing costs O(1) per lock.
+// Level 0 has a slot per second for the next 64 seconds, level 1 a slot
+// per 64 seconds for the next 4096, and so on. Whenever level 0 wraps,
+// the next level-1 slot is re-filed into level 0 (cascading), and likewise
+// further up. Same scheme as the classic Linux kernel timer wheel.
+
+void wheel_init(TimingWheel* w, long long now) {
+    memset(w->slots, 0, sizeof(w->slots));
+    w->now = now;
+    w->count = 0;
+}
+
+void wheel_insert(TimingWheel* w, Transaction* t) {
+    long long expires = t->unlock_time;
+    long long delta = expires - w->now;
+    long long range = 1LL << (WHEEL_BITS * WHEEL_LEVELS);
+    if (delta < 0) {
+        expires = w->now; // Overdue: goes out on the next tick
+        delta = 0;
+    } else if (delta >= range) {
+        expires = w->now + range - 1; // Parked at the far end, re-filed as it cascades
+        delta = range - 1;
+    }
+
+    int level = 0;
+    while (delta >= (1LL << (WHEEL_BITS * (level + 1)))) level++;
+    int slot = level * WHEEL_SLOTS + (int)((expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+
+    t->heap_index = slot;
+    t->prev = NULL;
+    t->next = w->slots[slot];
+    if (t->next) t->next->prev = t;
+    w->slots[slot] = t;
+    w->count++;
+}
+
+void wheel_remove(TimingWheel* w, Transaction* t) {
+    if (t->prev) t->prev->next = t->next;
+    else w->slots[t->heap_index] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->heap_index = -1;
+    w->count--;
+}
+
+// Spreads one slot of `level` over the levels below it; returns its index
+int wheel_cascade(TimingWheel* w, int level) {
+    int index = (int)((w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    Transaction* t = w->slots[level * WHEEL_SLOTS + index];
+    w->slots[level * WHEEL_SLOTS + index] = NULL;
+    while (t) {
+        Transaction* next = t->next;
+        w->count--;
+        wheel_insert(w, t);
+        t = next;
+    }
+    return index;
+}
+
+// Calls `expire` for everything due at or before `to`, a second at a time
+void wheel_advance(TimingWheel* w, long long to, void (*expire)(Transaction*)) {
+    while (w->now <= to) {
+        if (w->count == 0) {
+            w->now = to + 1; // Nothing to cascade; skip idle stretches
+            return;
+        }
+
+        int index = (int)(w->now & (WHEEL_SLOTS - 1));
+        for (int level = 1, carry = index; carry == 0 && level < WHEEL_LEVELS; level++) {
+            carry = wheel_cascade(w, level);
+        }
+
+        Transaction* t = w->slots[index];
+        w->now++;
+        while (t) {
+            Transaction* next = t->next;
+            wheel_remove(w, t);
+            expire(t);
+            t = next;
+        }
+    }
+}
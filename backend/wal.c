@@ -0,0 +1,444 @@
+#include "structures.h"
+#include <limits.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+// --- WRITE-AHEAD LOG ---
+// Every state change is appended to <dir>/bank.wal as a small binary record
+// before its HTTP response goes out. A flusher thread writes and fsyncs
+// whatever has accumulated in one go (group commit), and every
+// WAL_SNAPSHOT_EVERY records it writes <dir>/bank.snap and starts an empty
+// log. Recovery (recovery.c) loads the snapshot and replays the log.
+
+#define WAL_MAGIC "BANKWAL2"
+#define SNAP_MAGIC "BANKSNP2"
+#define WAL_SNAPSHOT_EVERY 100000
+
+typedef enum {
+    WAL_CUSTOMER = 1,   // Customer
+    WAL_TX_CREATE,      // Transaction as created
+    WAL_TX_PROCESS,     // WalTxEvent, outcome DONE or CANCELLED
+    WAL_TX_CANCEL,      // WalTxEvent
+    WAL_TX_UNLOCK       // WalTxEvent
+} WalRecordType;
+
+typedef enum {
+    WAL_SYNC_GROUP,     // Batched fsync, responses wait for it
+    WAL_SYNC_ALWAYS,    // fsync every record as it is logged
+    WAL_SYNC_OFF        // Leave it to the OS
+} WalSyncMode;
+
+// Written at the start of both files so a build with different struct
+// layouts refuses to read them instead of loading garbage
+typedef struct {
+    char magic[8];
+    int tx_size;
+    int customer_size;
+} WalFileHeader;
+
+typedef struct {
+    unsigned int type;
+    unsigned int len;       // Payload bytes
+    unsigned int checksum;  // FNV-1a of the payload; a torn tail fails it
+} WalRecordHeader;
+
+typedef struct {
+    int id;
+    int outcome;
+    long long when;
+} WalTxEvent;
+
+typedef struct {
+    WalFileHeader file;
+    long long generation;   // Of the log started right after it
+    int id_counter;
+    int account_counter;
+    int processed_count;
+    int cancelled_count;
+    double total_wait_time;
+    int customer_count;
+    int tx_count;
+} SnapshotHeader;
+
+typedef struct {
+    bool enabled;
+    WalSyncMode mode;
+    char dir[512];
+    char wal_path[512];
+    char snap_path[512];
+    FILE* file;
+
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;  // durable_lsn advanced
+    pthread_cond_t pending;  // Records waiting for the flusher
+
+    char* buf;               // Records not yet written
+    int buf_len, buf_cap;
+    char* spare;             // Swapped in while the flusher writes `buf`
+    int spare_cap;
+
+    long long appended_lsn;  // Bytes logged so far
+    long long durable_lsn;   // Bytes known to be on disk
+    int records_since_snapshot;
+    long long generation;    // Bumped by each snapshot; the log after it carries the same
+    long file_size;          // bank.wal up to the last record known written
+    bool needs_reset;        // A snapshot is in place but bank.wal still predates it
+    bool writing;            // The flusher is writing a batch outside the lock
+    bool failing;            // The last write failed; said once until one succeeds
+} Wal;
+
+Wal wal;
+
+// Called with each run of records once it is on disk, in log order; set
+// by replication.c to ship them to replicas
+void (*on_wal_durable)(const char* records, int len) = NULL;
+
+// Called under wal.lock each time durable_lsn advances; set by the
+// server to resume responses parked until then
+void (*on_wal_synced)(void) = NULL;
+
+unsigned int fnv1a(const void* data, int len) {
+    const unsigned char* p = (const unsigned char*)data;
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+void make_dir(const char* dir) {
+#ifdef _WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+}
+
+bool sync_file(FILE* f) {
+    if (fflush(f) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// Makes renames in the data directory durable. Windows has no way to
+// sync a directory, and its MoveFileEx is synchronous.
+void sync_dir(const char* dir) {
+#ifndef _WIN32
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void)dir;
+#endif
+}
+
+void wal_file_header(WalFileHeader* h, const char* magic) {
+    memcpy(h->magic, magic, 8);
+    h->tx_size = sizeof(Transaction);
+    h->customer_size = sizeof(Customer);
+}
+
+// Starts an empty log; everything before it is in the snapshot. The log
+// carries the snapshot's generation, so a crash after the snapshot was
+// renamed into place but before this ran leaves an older log behind, and
+// recovery skips it instead of applying it twice. For the same reason
+// nothing may be written to the old log once the snapshot is in place:
+// on failure needs_reset stays set and records wait in the buffer until a
+// retry succeeds. Caller holds wal.lock, or is the only thread.
+bool wal_reset_file() {
+    wal.needs_reset = true;
+    if (wal.file) fclose(wal.file);
+    wal.file = fopen(wal.wal_path, "wb");
+    if (!wal.file) return false;
+    WalFileHeader h;
+    wal_file_header(&h, WAL_MAGIC);
+    if (fwrite(&h, sizeof(h), 1, wal.file) != 1 || fwrite(&wal.generation, sizeof(wal.generation), 1, wal.file) != 1 ||
+        !sync_file(wal.file)) {
+        fclose(wal.file);
+        wal.file = NULL;
+        return false;
+    }
+    wal.file_size = (long)(sizeof(h) + sizeof(wal.generation));
+    wal.needs_reset = false;
+    wal.records_since_snapshot = 0;
+    return true;
+}
+
+// Customers in account order, then every live transaction. Caller holds
+// state_lock. Also how replicas catch up (replication.c). False if any of
+// it failed to write.
+bool write_snapshot_to(FILE* f) {
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    wal_file_header(&h.file, SNAP_MAGIC);
+    h.generation = wal.generation;
+    h.id_counter = id_counter;
+    h.account_counter = account_counter;
+    h.processed_count = state.processed_count;
+    h.cancelled_count = state.cancelled_count;
+    h.total_wait_time = state.total_wait_time;
+    h.customer_count = state.customers.count;
+    h.tx_count = state.tx_count;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (int i = 0; i < state.customers.count; i++) {
+        Customer c = published_customer((Customer*)arena_at(&state.customers, i));
+        fwrite(&c, sizeof(Customer), 1, f);
+    }
+    // Oldest finished first, so replaying keeps the history order
+    for (Transaction* t = state.finished_head; t; t = t->next) {
+        fwrite(t, sizeof(Transaction), 1, f);
+    }
+    for (int i = 0; i < state.transactions.count; i++) {
+        Transaction* t = (Transaction*)arena_at(&state.transactions, i);
+        if (t->status != STATUS_WAITING && t->status != STATUS_LOCKED) continue;
+        Transaction c = published_transaction(t);
+        fwrite(&c, sizeof(Transaction), 1, f);
+    }
+    return !ferror(f);
+}
+
+// Written to a temporary file and renamed so a crash never leaves half a
+// snapshot. False, with the old snapshot still in place, if any step
+// failed; the log must then be kept.
+bool write_snapshot() {
+    char tmp_path[520];
+    sprintf(tmp_path, "%s.tmp", wal.snap_path);
+    FILE* f = fopen(tmp_path, "wb");
+    bool ok = f != NULL;
+    wal.generation++;
+    if (f) {
+        ok = write_snapshot_to(f) && sync_file(f);
+        ok = fclose(f) == 0 && ok;
+    }
+#ifdef _WIN32
+    if (ok) remove(wal.snap_path); // rename() won't replace on Windows
+#endif
+    if (ok) ok = rename(tmp_path, wal.snap_path) == 0; // Atomic on POSIX: the old snapshot or the new one
+    if (!ok) {
+        printf("Could not write %s (%s); keeping the log\n", wal.snap_path, strerror(errno));
+        remove(tmp_path);
+        wal.generation--;
+        return false;
+    }
+    sync_dir(wal.dir);
+    return true;
+}
+
+// Appends records at the end of what is known written, so a retry after a
+// partial write overwrites its torn tail. Says so once when writes start
+// failing.
+bool wal_write_out(const char* records, int len) {
+    bool ok = wal.file && fseek(wal.file, wal.file_size, SEEK_SET) == 0 &&
+        fwrite(records, 1, len, wal.file) == (size_t)len &&
+        (wal.mode == WAL_SYNC_OFF ? fflush(wal.file) == 0 : sync_file(wal.file));
+    if (ok) {
+        wal.file_size += len;
+        wal.failing = false;
+    } else if (!wal.failing) {
+        printf("Could not write %s (%s); holding records until it can be\n", wal.wal_path, strerror(errno));
+        wal.failing = true;
+    }
+    return ok;
+}
+
+// Writes out the buffered records. Caller holds wal.lock. False if they
+// are still only in the buffer: the flusher is busy with the file, or it
+// could not be written, in which case durable_lsn stays where it was.
+bool wal_write_buffer() {
+    if (wal.buf_len == 0) return true;
+    if (wal.writing) return false;
+    if (wal.needs_reset && !wal_reset_file()) return false;
+    if (!wal_write_out(wal.buf, wal.buf_len)) return false;
+    if (on_wal_durable) on_wal_durable(wal.buf, wal.buf_len);
+    wal.buf_len = 0;
+    wal.durable_lsn = wal.appended_lsn;
+    pthread_cond_broadcast(&wal.flushed);
+    if (on_wal_synced) on_wal_synced();
+    return true;
+}
+
+void wal_append(WalRecordType type, const void* payload, int len) {
+    if (!wal.enabled) return;
+
+    WalRecordHeader h;
+    h.type = type;
+    h.len = len;
+    h.checksum = fnv1a(payload, len);
+
+    pthread_mutex_lock(&wal.lock);
+    int need = wal.buf_len + (int)sizeof(h) + len;
+    if (need > wal.buf_cap) {
+        while (wal.buf_cap < need) wal.buf_cap = wal.buf_cap ? wal.buf_cap * 2 : 65536;
+        wal.buf = (char*)realloc(wal.buf, wal.buf_cap);
+    }
+    memcpy(wal.buf + wal.buf_len, &h, sizeof(h));
+    memcpy(wal.buf + wal.buf_len + sizeof(h), payload, len);
+    wal.buf_len = need;
+    wal.appended_lsn += (int)sizeof(h) + len;
+    wal.records_since_snapshot++;
+
+    if (wal.mode == WAL_SYNC_ALWAYS) wal_write_buffer();
+    if (wal.buf_len > 0 || wal.records_since_snapshot >= WAL_SNAPSHOT_EVERY) pthread_cond_signal(&wal.pending);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+void wal_log_customer(Customer* c) {
+    Customer p = published_customer(c);
+    wal_append(WAL_CUSTOMER, &p, sizeof(Customer));
+}
+
+void wal_log_transaction(Transaction* t) {
+    Transaction p = published_transaction(t);
+    wal_append(WAL_TX_CREATE, &p, sizeof(Transaction));
+}
+
+void wal_log_event(WalRecordType type, int id, int outcome, time_t when) {
+    WalTxEvent e;
+    e.id = id;
+    e.outcome = outcome;
+    e.when = (long long)when;
+    wal_append(type, &e, sizeof(e));
+}
+
+long long wal_lsn() {
+    if (!wal.enabled) return 0;
+    pthread_mutex_lock(&wal.lock);
+    long long lsn = wal.appended_lsn;
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+// How far the log is on disk, for responses that must not go out before
+// their changes are; everything counts when nothing waits for fsync
+long long wal_durable() {
+    if (!wal.enabled || wal.mode != WAL_SYNC_GROUP) return LLONG_MAX;
+    pthread_mutex_lock(&wal.lock);
+    long long lsn = wal.durable_lsn;
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+// Blocks until everything up to `lsn` is on disk (group commit)
+void wal_wait_durable(long long lsn) {
+    if (!wal.enabled || wal.mode != WAL_SYNC_GROUP) return;
+    pthread_mutex_lock(&wal.lock);
+    while (wal.durable_lsn < lsn) pthread_cond_wait(&wal.flushed, &wal.lock);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+void sleep_ms(int ms);
+
+// After a failed write or reset: give the disk a moment instead of
+// spinning on it. Caller holds wal.lock.
+void failed_wait() {
+    pthread_mutex_unlock(&wal.lock);
+    sleep_ms(100);
+    pthread_mutex_lock(&wal.lock);
+}
+
+// Writes everything logged while the previous batch was being synced,
+// so one fsync covers as many requests as arrived in the meantime.
+void* wal_flusher(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&wal.lock);
+    while (1) {
+        while (wal.buf_len == 0 && wal.records_since_snapshot < WAL_SNAPSHOT_EVERY) {
+            pthread_cond_wait(&wal.pending, &wal.lock);
+        }
+
+        if (wal.records_since_snapshot >= WAL_SNAPSHOT_EVERY && !wal.needs_reset) {
+            // Needs a quiet state; state_lock comes before wal.lock. The
+            // snapshot must cover exactly what the log holds, and the log
+            // is only truncated once the snapshot is safely in place.
+            pthread_mutex_unlock(&wal.lock);
+            pthread_mutex_lock(&state_lock);
+            pthread_mutex_lock(&wal.lock);
+            if (wal_write_buffer() && write_snapshot()) wal_reset_file();
+            else wal.records_since_snapshot = 0; // Try again after as many more
+            pthread_mutex_unlock(&state_lock);
+            continue;
+        }
+        if (wal.needs_reset && !wal_reset_file()) {
+            failed_wait();
+            continue;
+        }
+
+        // Swap buffers and sync without holding the lock
+        char* batch = wal.buf;
+        int batch_len = wal.buf_len;
+        long long batch_lsn = wal.appended_lsn;
+        wal.buf = wal.spare;
+        wal.spare = batch;
+        int cap = wal.buf_cap;
+        wal.buf_cap = wal.spare_cap;
+        wal.spare_cap = cap;
+        wal.buf_len = 0;
+        wal.writing = true;
+        pthread_mutex_unlock(&wal.lock);
+
+        bool ok = wal_write_out(batch, batch_len);
+        if (ok && on_wal_durable) on_wal_durable(batch, batch_len);
+
+        pthread_mutex_lock(&wal.lock);
+        wal.writing = false;
+        if (!ok) {
+            // Back in front of what was logged meanwhile, for the retry
+            if (wal.spare_cap < batch_len + wal.buf_len) {
+                wal.spare_cap = batch_len + wal.buf_len;
+                wal.spare = (char*)realloc(wal.spare, wal.spare_cap);
+            }
+            memcpy(wal.spare + batch_len, wal.buf, wal.buf_len);
+            batch_len += wal.buf_len;
+            char* held = wal.spare;
+            wal.spare = wal.buf;
+            wal.buf = held;
+            cap = wal.buf_cap;
+            wal.buf_cap = wal.spare_cap;
+            wal.spare_cap = cap;
+            wal.buf_len = batch_len;
+            failed_wait();
+            continue;
+        }
+        wal.durable_lsn = batch_lsn;
+        pthread_cond_broadcast(&wal.flushed);
+        if (on_wal_synced) on_wal_synced();
+    }
+    return NULL;
+}
+
+void wal_init(const char* dir, WalSyncMode mode) {
+    make_dir(dir);
+    snprintf(wal.dir, sizeof(wal.dir), "%s", dir);
+    sprintf(wal.wal_path, "%s/bank.wal", dir);
+    sprintf(wal.snap_path, "%s/bank.snap", dir);
+    wal.mode = mode;
+    pthread_mutex_init(&wal.lock, NULL);
+    pthread_cond_init(&wal.flushed, NULL);
+    pthread_cond_init(&wal.pending, NULL);
+}
+
+// Called after recovery: compacts what was recovered into a fresh
+// snapshot, then starts logging. False if either can't be written.
+bool wal_start() {
+    if (!write_snapshot()) return false;
+    if (!wal_reset_file()) {
+        printf("Could not start %s (%s)\n", wal.wal_path, strerror(errno));
+        return false;
+    }
+    wal.enabled = true;
+
+    pthread_t flusher;
+    pthread_create(&flusher, NULL, wal_flusher, NULL);
+    pthread_detach(flusher);
+    return true;
+}
@@ -4,6 +4,13 @@ let role = 'guest';
 
 // API
 const API_URL = '/api';
+const AGING_FACTOR = 0.5; // Must match backend/structures.h
+
+// Local copy of the server state, kept current by /events (or by polling
+// /state?since=<version> where event streams aren't available)
+const mirror = { epoch: null, version: 0, txs: new Map(), customers: new Map(), stats: null, skew: 0 };
+let events = null;
+let pollTimer = null;
 
 function toggleLoginFields() {
     role = document.getElementById('user-role').value;
@@ -29,7 +36,7 @@ async function login() {
     if (role === 'admin') {
         document.getElementById('login-page').classList.add('d-none');
         document.getElementById('admin-page').classList.remove('d-none');
-        fetchState();
+        startUpdates();
     } else {
         const id = document.getElementById('login-id').value;
         const pin = document.getElementById('login-pin').value;
@@ -46,7 +53,7 @@ async function login() {
 
             document.getElementById('login-page').classList.add('d-none');
             document.getElementById('customer-page').classList.remove('d-none');
-            fetchState();
+            startUpdates();
         } else {
             errorDiv.innerText = res.error || "Login Failed";
             errorDiv.classList.remove('d-none');
@@ -130,14 +137,74 @@ async function fetchState() {
     if (document.getElementById('login-page').classList.contains('d-none') === false) return; // Don't poll on login
 
     try {
-        const res = await fetch(API_URL + '/state');
+        let url = API_URL + '/state';
+        if (mirror.epoch !== null) url += `?since=${mirror.version}&epoch=${mirror.epoch}`;
+        const res = await fetch(url);
         const data = await res.json();
-        render(data);
+        applyState(data);
+        renderMirror();
     } catch (e) {
         console.error("Connection lost", e);
     }
 }
 
+// Pushed updates over /events; falls back to polling once a second when
+// the browser or server can't hold the stream open
+async function startUpdates() {
+    await fetchState();
+    if (events || pollTimer) return;
+    if (!window.EventSource) {
+        pollTimer = setInterval(fetchState, 1000);
+        return;
+    }
+
+    events = new EventSource(`${API_URL}/events?since=${mirror.version}&epoch=${mirror.epoch}`);
+    events.addEventListener('state', e => {
+        const data = JSON.parse(e.data);
+        if (data.epoch !== mirror.epoch || data.version > mirror.version) {
+            applyState(data);
+            renderMirror();
+        }
+    });
+    events.onerror = () => {
+        events.close();
+        events = null;
+        if (!pollTimer) pollTimer = setInterval(fetchState, 1000);
+    };
+}
+
+function renderMirror() {
+    if (mirror.epoch === null) return;
+
+    // Waiting transactions keep aging between updates
+    const now = Date.now() / 1000 + mirror.skew;
+    mirror.txs.forEach(t => {
+        if (t.status === 0) t.effective_priority = t.base_priority + (now - t.arrival) * AGING_FACTOR;
+    });
+
+    render({
+        transactions: [...mirror.txs.values()],
+        customers: [...mirror.customers.values()],
+        stats: mirror.stats
+    });
+}
+
+// Merges a full or delta response into the mirror
+function applyState(data) {
+    if (data.full) {
+        mirror.txs.clear();
+        mirror.customers.clear();
+    }
+    data.transactions.forEach(t => mirror.txs.set(t.id, t));
+    (data.removed || []).forEach(id => mirror.txs.delete(id));
+    data.customers.forEach(c => mirror.customers.set(c.id, c));
+
+    mirror.epoch = data.epoch;
+    mirror.version = data.version;
+    mirror.stats = data.stats;
+    mirror.skew = data.now - Date.now() / 1000;
+}
+
 function getTierName(t) {
     if (t == 0) return 'Basic';
     if (t == 20) return 'Premium';
@@ -233,4 +300,5 @@ function render(data) {
     }
 }
 
-setInterval(fetchState, 1000);
+// Countdowns and aging move even when nothing changes on the server
+setInterval(renderMirror, 1000);